@@ -1,4 +1,5 @@
 #include "bsg.h"
+#include <unistd.h>
 
 namespace bsg {
 
@@ -12,22 +13,28 @@ void bsgUtils::printMat(const std::string& name, const glm::mat4& mat) {
     std::cout << std::endl;
   }
 }
+
+size_t bsgStats::bytesUploaded = 0;
+size_t bsgStats::programSwitches = 0;
+size_t bsgStats::textureSwitches = 0;
+
+void bsgStats::newFrame() {
+  bytesUploaded = 0;
+  programSwitches = 0;
+  textureSwitches = 0;
+}
   
 // Get a handle for our lighting uniforms.  We are not binding the
 // attribute to a known location, just asking politely for it.  Note
-// that what is going on here is that OpenGL is actually matching
-// the _lightPositionName string to a variable in the shader.
-//
-// This must be preceded by a glUseProgram(programID) call.
-void lightList::load(const GLint programID) {
+// that what is going on here is that the shader is matching the
+// _lightPositionName string to a variable in its program.
+void lightList::load(shaderMgr &shader) {
 
   // If there aren't any lights, don't bother.
   if (_lightPositions.size() > 0) {
   
-    _lightPositions.ID = glGetUniformLocation(programID,
-                                              _lightPositions.name.c_str());
-    _lightColors.ID = glGetUniformLocation(programID,
-                                           _lightColors.name.c_str());
+    _lightPositions.ID = shader.getUniformID(_lightPositions.name);
+    _lightColors.ID = shader.getUniformID(_lightColors.name);
   }
 }
 
@@ -50,7 +57,8 @@ void textureMgr::readFile(const textureType& type, const std::string& fileName)
 
   switch(type) {
   case textureDDS:
-    throw std::runtime_error("still working on DDS, try PNG");
+    _release();
+    _textureBufferID = _loadDDS(fileName);
     break;
 
   case textureBMP:
@@ -58,10 +66,12 @@ void textureMgr::readFile(const textureType& type, const std::string& fileName)
     break;
 
   case texturePNG:
+    _release();
     _textureBufferID = _loadPNG(fileName);
     break;
 
   case textureCHK:
+    _release();
     _textureBufferID = _loadCheckerBoard (64, 8);
     break;
     
@@ -70,82 +80,305 @@ void textureMgr::readFile(const textureType& type, const std::string& fileName)
   }
 }
 
+void textureMgr::readFileAsync(const textureType& type, const std::string& fileName) {
+
+  if (type != texturePNG) {
+    readFile(type, fileName);
+    return;
+  }
+
+  _release();
+
+  // Show the checkerboard until the real thing arrives.
+  textureLoader& loader = textureLoader::instance();
+  _textureBufferID = loader.placeholder();
+  _width = 64;
+  _height = 64;
+  _nLevels = 1;
+  _loading = true;
+
+  loader.request(this, fileName, _options);
+}
+
+void textureMgr::setImage(const textureImage& image) {
+
+  _release();
+
+  std::vector<textureImage> levels(1, image);
+  if (_options.useMipmaps() && !image.compressed) textureImage::addMipmaps(levels);
+
+  _setLevels(levels);
+  _textureBufferID = _upload(levels, _options);
+}
+
+textureMgr::~textureMgr() {
+  _release();
+}
+
+void textureMgr::_release() {
+
+  if (_loading) {
+    textureLoader::instance().cancel(this);
+    _loading = false;
+  } else if (_textureBufferID &&
+             !textureLoader::instance().isPlaceholder(_textureBufferID)) {
+    glDeleteTextures(1, &_textureBufferID);
+  }
+  _textureBufferID = 0;
+  _nLevels = 0;
+  _bytes = 0;
+}
+
+size_t textureMgr::getBytes() {
+  return _bytes;
+}
+
+void textureMgr::_setLevels(const std::vector<textureImage>& levels) {
+
+  _width = levels[0].width;
+  _height = levels[0].height;
+  _nLevels = levels.size();
+  _bytes = 0;
+  for (std::vector<textureImage>::const_iterator it = levels.begin();
+       it != levels.end(); it++) {
+    _bytes += it->getBytes();
+  }
+}
+
+void textureMgr::_finishLoad(const GLuint textureID,
+                             const std::vector<textureImage>& levels) {
+  _textureBufferID = textureID;
+  _setLevels(levels);
+  _loading = false;
+
+  // The loader used the options as they were when the load started;
+  // setOptions() may have changed them since.
+  glBindTexture(GL_TEXTURE_2D, _textureBufferID);
+  _options.apply(_nLevels);
+}
+
+void textureMgr::setOptions(const textureOptions& options) {
+
+  _options = options;
+
+  // The shared placeholder keeps its own settings.  A texture still
+  // loading gets these when it's done.
+  if (!_textureBufferID || _loading) return;
+
+  glBindTexture(GL_TEXTURE_2D, _textureBufferID);
+  _options.apply(_nLevels);
+}
+
+void textureOptions::apply(const int nLevels) const {
+
+  GLenum minFilter, magFilter = GL_LINEAR;
+  switch (filter) {
+  case GLFILTER_NEAREST:
+    minFilter = GL_NEAREST;
+    magFilter = GL_NEAREST;
+    break;
+  case GLFILTER_BILINEAR:
+    minFilter = (nLevels > 1) ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR;
+    break;
+  case GLFILTER_TRILINEAR:
+    minFilter = (nLevels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+    break;
+  default:
+    minFilter = GL_LINEAR;
+  }
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magFilter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, std::max(0, nLevels - 1));
+
+  if (GLEW_EXT_texture_filter_anisotropic) {
+    GLfloat maxAnisotropy = 1.0f;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                    std::max(1.0f, std::min(anisotropy, maxAnisotropy)));
+  }
+}
+
+GLuint textureMgr::_upload(const std::vector<textureImage>& levels,
+                           const textureOptions& options) {
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  for (size_t i = 0; i < levels.size(); i++) {
+    const textureImage& image = levels[i];
+    if (image.compressed) {
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, image.format,
+                             image.width, image.height, 0,
+                             image.pixels.size(), &image.pixels[0]);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, i, image.format, image.width, image.height,
+                   0, image.format, GL_UNSIGNED_BYTE, &image.pixels[0]);
+    }
+  }
+  options.apply(levels.size());
+
+  return texture;
+}
+
 GLuint textureMgr::_loadCheckerBoard (int size, int numFields) {
-  _width = size;
-  _height = size;
-  int fieldWidth = size/numFields;
 
-  GLubyte image[size][size][3];
+  std::vector<textureImage> levels(1);
+  levels[0].makeCheckerBoard(size, numFields);
+  if (_options.useMipmaps()) textureImage::addMipmaps(levels);
+
+  _setLevels(levels);
+  return _upload(levels, _options);
+}
+
+GLuint textureMgr::_loadPNG(const std::string imagePath) {
+
+  GLuint texture;
+  if (_streamPNG(imagePath, texture)) return texture;
+
+  std::vector<textureImage> levels(1);
+  if (!levels[0].readPNG(imagePath)) return 0;
+  if (_options.useMipmaps()) textureImage::addMipmaps(levels);
+
+  _setLevels(levels);
+  return _upload(levels, _options);
+}
+
+GLuint textureMgr::_loadDDS(const std::string imagePath) {
+
+  std::vector<textureImage> levels;
+  if (!textureImage::readDDS(imagePath, levels)) return 0;
+
+  // There's no decoding to fall back on, so the card has to take the
+  // blocks as they are.
+  bool supported;
+  switch (levels[0].format) {
+  case GL_COMPRESSED_RED_RGTC1:
+  case GL_COMPRESSED_RG_RGTC2:
+    supported = GLEW_VERSION_3_0 || GLEW_ARB_texture_compression_rgtc ||
+      GLEW_EXT_texture_compression_rgtc;
+    break;
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT:
+  case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+    supported = GLEW_EXT_texture_compression_s3tc && GLEW_EXT_texture_sRGB;
+    break;
+  default:
+    supported = GLEW_EXT_texture_compression_s3tc;
+  }
+  if (!supported) {
+    std::cerr << "** Caution: " << imagePath
+              << " is compressed in a format this OpenGL doesn't take." << std::endl;
+    return 0;
+  }
+
+  // The mipmaps are whatever the file has; we can't make more.
+  _setLevels(levels);
+  return _upload(levels, _options);
+}
+
+void textureImage::makeCheckerBoard(const int size, const int numFields) {
+
+  width = size;
+  height = size;
+  format = GL_RGB;
+  rowBytes = 3 * size;
+  rowBytes += 3 - ((rowBytes - 1) % 4);
+  pixels.assign(rowBytes * size, 0);
+
+  int fieldWidth = size/numFields;
 
   // Create a checkerboard pattern
   for ( int i = 0; i < size; i++ ) {
     for ( int j = 0; j < size; j++ ) {
       GLubyte c = 31;
       if ((i/fieldWidth)%2 == (j/fieldWidth)%2) {c = 255;}
-        image[i][j][0]  = c;
-        image[i][j][1]  = c;
-        image[i][j][2]  = c;
+        pixels[i * rowBytes + 3 * j]      = c;
+        pixels[i * rowBytes + 3 * j + 1]  = c;
+        pixels[i * rowBytes + 3 * j + 2]  = c;
       }
     }
+}
 
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, _width, _height,
-               0, GL_RGB, GL_UNSIGNED_BYTE, image);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  return texture;
+void textureImage::halve(textureImage &smaller) const {
+
+  int channels = (format == GL_RGBA) ? 4 : 3;
+
+  smaller.width = std::max(1, width / 2);
+  smaller.height = std::max(1, height / 2);
+  smaller.format = format;
+  smaller.rowBytes = channels * smaller.width;
+  smaller.rowBytes += 3 - ((smaller.rowBytes - 1) % 4);
+  smaller.pixels.assign(smaller.rowBytes * smaller.height, 0);
+
+  // Where a side is already one pixel, the "two" pixels averaged in
+  // that direction are the same one.
+  size_t dx = (width > 1) ? channels : 0;
+  size_t dy = (height > 1) ? rowBytes : 0;
+
+  for (int y = 0; y < smaller.height; y++) {
+    const unsigned char* row = &pixels[2 * y * rowBytes];
+    if (height == 1) row = &pixels[0];
+    unsigned char* out = &smaller.pixels[y * smaller.rowBytes];
+
+    // A plain loop over bytes, which the compiler can vectorize.
+    for (int x = 0; x < smaller.width; x++) {
+      const unsigned char* in = row + ((width > 1) ? 2 * x * channels : 0);
+      for (int c = 0; c < channels; c++) {
+        out[x * channels + c] =
+          (in[c] + in[c + dx] + in[c + dy] + in[c + dx + dy] + 2) >> 2;
+      }
+    }
+  }
 }
 
+void textureImage::addMipmaps(std::vector<textureImage> &levels) {
 
-GLuint textureMgr::_loadPNG(const std::string imagePath) {
+  while ((levels.back().width > 1) || (levels.back().height > 1)) {
+    levels.push_back(textureImage());
+    levels[levels.size() - 2].halve(levels.back());
+  }
+}
+
+bool pngFile::open(const std::string &imagePath) {
   
   // This function was originally written by David Grayson for
   // https://github.com/DavidEGrayson/ahrs-visualizer
 
   png_byte header[8];
 
-  FILE *fp = fopen(imagePath.c_str(), "rb");
-  if (fp == 0) {
+  _fp = fopen(imagePath.c_str(), "rb");
+  if (_fp == 0) {
     perror(imagePath.c_str());
-    return 0;
+    return false;
   }
 
   // read the header
-  fread(header, 1, 8, fp);
+  fread(header, 1, 8, _fp);
 
   if (png_sig_cmp(header, 0, 8)) {
     fprintf(stderr, "error: %s is not a PNG.\n", imagePath.c_str());
-    fclose(fp);
-    return 0;
+    return false;
   }
 
-  png_structp png_ptr =
-    png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr) {
+  _png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!_png) {
     fprintf(stderr, "error: png_create_read_struct returned 0.\n");
-    fclose(fp);
-    return 0;
+    return false;
   }
 
   // create png info struct
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr) {
+  _info = png_create_info_struct(_png);
+  if (!_info) {
     fprintf(stderr, "error: png_create_info_struct returned 0.\n");
-    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-    fclose(fp);
-    return 0;
+    return false;
   }
 
   // create png info struct
-  png_infop end_info = png_create_info_struct(png_ptr);
-  if (!end_info) {
+  _endInfo = png_create_info_struct(_png);
+  if (!_endInfo) {
     fprintf(stderr, "error: png_create_info_struct returned 0.\n");
-    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp) NULL);
-    fclose(fp);
-    return 0;
+    return false;
   }
 
   // the code in this if statement gets called if libpng encounters an error
@@ -157,34 +390,30 @@ GLuint textureMgr::_loadPNG(const std::string imagePath) {
   // }
 
   // init png reading
-  png_init_io(png_ptr, fp);
+  png_init_io(_png, _fp);
 
   // let libpng know you already read the first 8 bytes
-  png_set_sig_bytes(png_ptr, 8);
+  png_set_sig_bytes(_png, 8);
 
   // read all the info up to the image data
-  png_read_info(png_ptr, info_ptr);
+  png_read_info(_png, _info);
 
   // variables to pass to get info
-  int bit_depth, color_type;
+  int bit_depth, color_type, interlace_type;
   png_uint_32 temp_width, temp_height;
 
   // get info about png
-  png_get_IHDR(png_ptr, info_ptr, &temp_width, &temp_height,
+  png_get_IHDR(_png, _info, &temp_width, &temp_height,
                &bit_depth, &color_type,
-               NULL, NULL, NULL);
+               &interlace_type, NULL, NULL);
 
-  _width = temp_width;
-  _height = temp_height;
-  
   //printf("%s: %lux%lu %d\n", imagePath, temp_width, temp_height, color_type);
 
   if (bit_depth != 8) {
     fprintf(stderr, "%s: Unsupported bit depth %d.  Must be 8.\n", imagePath.c_str(), bit_depth);
-    return 0;
+    return false;
   }
 
-  GLint format;
   switch(color_type) {
   case PNG_COLOR_TYPE_RGB:
     format = GL_RGB;
@@ -194,67 +423,645 @@ GLuint textureMgr::_loadPNG(const std::string imagePath) {
     break;
   default:
     fprintf(stderr, "%s: Unknown libpng color type %d.\n", imagePath.c_str(), color_type);
-    return 0;
+    return false;
   }
 
+  // An interlaced image comes in several passes over the whole
+  // thing, so can only be read all at once.
+  interlaced = (interlace_type != PNG_INTERLACE_NONE);
+  if (interlaced) png_set_interlace_handling(_png);
+
   // Update the png info struct.
-  png_read_update_info(png_ptr, info_ptr);
+  png_read_update_info(_png, _info);
 
   // Row size in bytes.
-  int rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+  rowBytes = png_get_rowbytes(_png, _info);
+
+  width = temp_width;
+  height = temp_height;
+  return true;
+}
+
+bool textureImage::readPNG(const std::string &imagePath) {
+
+  pngFile file;
+  if (!file.open(imagePath)) return false;
+
+  format = file.format;
 
   // glTexImage2d requires rows to be 4-byte aligned
-  rowbytes += 3 - ((rowbytes-1) % 4);
+  rowBytes = file.rowBytes;
+  rowBytes += 3 - ((rowBytes-1) % 4);
 
-  // Allocate the image_data as a big block, to be given to opengl
-  png_byte * image_data = (png_byte *)malloc(rowbytes * temp_height * sizeof(png_byte)+15);
-  if (image_data == NULL) {
-    fprintf(stderr, "error: could not allocate memory for PNG image data\n");
-    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-    fclose(fp);
-    return 0;
+  // Allocate the image data as a big block, to be given to opengl
+  pixels.resize(rowBytes * file.height);
+
+  // row_pointers is for pointing to the image data for reading the png with libpng
+  std::vector<png_byte*> row_pointers(file.height);
+
+  // set the individual row_pointers to point at the correct offsets
+  // of the image data, so the rows come out bottom to top
+  for (int i = 0; i < file.height; i++) {
+    row_pointers[file.height - 1 - i] = &pixels[i * rowBytes];
+  }
+
+  // read the png into the image data through row_pointers
+  file.readImage(&row_pointers[0]);
+
+  width = file.width;
+  height = file.height;
+  return true;
+}
+
+// The size of one strip of a PNG being streamed into a texture.
+static const size_t pngStripBytes = 1 << 20;
+
+bool textureMgr::_streamPNG(const std::string imagePath, GLuint &texture) {
+
+  texture = 0;
+  if (!GLEW_VERSION_2_1 && !GLEW_ARB_pixel_buffer_object) return false;
+
+  pngFile file;
+  if (!file.open(imagePath)) return true;
+  if (file.interlaced || (file.width < 2) || (file.height < 2)) return false;
+
+  textureImage level0;
+  level0.width = file.width;
+  level0.height = file.height;
+  level0.format = file.format;
+  level0.rowBytes = file.rowBytes + 3 - ((file.rowBytes - 1) % 4);
+
+  // For mipmaps, each pair of rows is averaged into a row of the first
+  // mipmap as it goes by, the same way halve() would do it.  The rows
+  // come from the top of the image down, so the pair is filled in
+  // from the top.
+  bool mipmaps = _options.useMipmaps();
+  std::vector<textureImage> levels;
+  textureImage pair, halfRow;
+  if (mipmaps) {
+    levels.resize(1);
+    levels[0].width = level0.width / 2;
+    levels[0].height = level0.height / 2;
+    levels[0].format = level0.format;
+    levels[0].rowBytes = (level0.format == GL_RGBA ? 4 : 3) * levels[0].width;
+    levels[0].rowBytes += 3 - ((levels[0].rowBytes - 1) % 4);
+    levels[0].pixels.resize(levels[0].rowBytes * levels[0].height);
+
+    pair = level0;
+    pair.height = 2;
+    pair.pixels.resize(2 * pair.rowBytes);
+  }
+
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, level0.format, level0.width, level0.height,
+               0, level0.format, GL_UNSIGNED_BYTE, NULL);
+
+  // Two buffers, so one can be filled while the other is copied.
+  GLsizei stripRows = std::max((size_t)1, pngStripBytes / level0.rowBytes);
+  size_t stripBytes = stripRows * level0.rowBytes;
+  GLuint buffers[2];
+  glGenBuffers(2, buffers);
+
+  for (GLsizei row = 0, strip = 0; row < level0.height; row += stripRows, strip++) {
+
+    GLsizei nRows = std::min(stripRows, level0.height - row);
+
+    // Giving the buffer new storage means we don't have to wait for
+    // OpenGL to finish with the strip that was in it before.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[strip % 2]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, stripBytes, NULL, GL_STREAM_DRAW);
+    unsigned char* out =
+      (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (!out) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      glDeleteBuffers(2, buffers);
+      glDeleteTextures(1, &texture);
+      return false;
+    }
+
+    // The strip goes into the buffer bottom row first.
+    for (GLsizei i = 0; i < nRows; i++) {
+      unsigned char* dest = out + (nRows - 1 - i) * level0.rowBytes;
+      if (!mipmaps) {
+        file.readRow(dest);
+        continue;
+      }
+
+      // The mapped memory is slow to read back, so decode somewhere
+      // else and copy.
+      GLsizei glRow = level0.height - 1 - (row + i);
+      unsigned char* in = &pair.pixels[(glRow % 2) * pair.rowBytes];
+      file.readRow(in);
+      memcpy(dest, in, level0.rowBytes);
+
+      // An odd last row has no partner, and halve() drops it too.
+      if ((glRow % 2 == 0) && (glRow / 2 < levels[0].height)) {
+        pair.halve(halfRow);
+        memcpy(&levels[0].pixels[(glRow / 2) * levels[0].rowBytes],
+               &halfRow.pixels[0], levels[0].rowBytes);
+      }
+    }
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, level0.height - row - nRows,
+                    level0.width, nRows, level0.format, GL_UNSIGNED_BYTE, 0);
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(2, buffers);
+
+  // The rest of the mipmaps are small enough to make as usual.
+  if (mipmaps) {
+    textureImage::addMipmaps(levels);
+    for (size_t i = 0; i < levels.size(); i++) {
+      glTexImage2D(GL_TEXTURE_2D, i + 1, levels[i].format,
+                   levels[i].width, levels[i].height, 0, levels[i].format,
+                   GL_UNSIGNED_BYTE, &levels[i].pixels[0]);
+    }
+  }
+
+  // Note the sizes.  level0 has no pixels, but that's all right.
+  levels.insert(levels.begin(), level0);
+  _setLevels(levels);
+  _options.apply(levels.size());
+
+  return true;
+}
+
+// The kinds of block in a DDS file, which differ in how their rows
+// are laid out.
+typedef enum { DDSBC1, DDSBC2, DDSBC3, DDSBC4, DDSBC5 } DDSBLOCKTYPE;
+
+// Turns over the first nRows rows of one 4x4 block.  A color block
+// (BC1, and the second half of BC2 and BC3) has a byte of indices
+// per row, after the two endpoint colors.
+static void flipColorBlock(unsigned char* block, const int nRows) {
+  for (int i = 0; i < nRows / 2; i++) {
+    std::swap(block[4 + i], block[4 + nRows - 1 - i]);
+  }
+}
+
+// The BC2 alpha block is two bytes per row.
+static void flipExplicitAlphaBlock(unsigned char* block, const int nRows) {
+  for (int i = 0; i < nRows / 2; i++) {
+    std::swap(block[2 * i], block[2 * (nRows - 1 - i)]);
+    std::swap(block[2 * i + 1], block[2 * (nRows - 1 - i) + 1]);
+  }
+}
+
+// The BC3 alpha block, and BC4 and BC5 blocks, have two endpoints and
+// then 3-bit indices, 12 bits per row.
+static void flipInterpolatedBlock(unsigned char* block, const int nRows) {
+  uint64_t bits = 0;
+  for (int i = 0; i < 6; i++) bits |= (uint64_t)block[2 + i] << (8 * i);
+
+  uint64_t flipped = bits;
+  for (int i = 0; i < nRows; i++) {
+    uint64_t row = (bits >> (12 * (nRows - 1 - i))) & 0xfff;
+    flipped &= ~((uint64_t)0xfff << (12 * i));
+    flipped |= row << (12 * i);
+  }
+  for (int i = 0; i < 6; i++) block[2 + i] = (flipped >> (8 * i)) & 0xff;
+}
+
+// Can a compressed image be turned upside down?  Only if its rows
+// fill its blocks, or all fit in one.  Otherwise the padding rows at
+// the bottom of the last block would have to move to the top, and
+// take rows from the next block with them, which needs the blocks
+// decoded and made again.
+static bool canFlipBlocks(const textureImage &image) {
+  return (image.height <= 4) || (image.height % 4 == 0);
+}
+
+// Turns a compressed image upside down.  See canFlipBlocks().
+static void flipBlocks(textureImage &image, const DDSBLOCKTYPE type) {
+
+  GLsizei blocksHigh = (image.height + 3) / 4;
+  int nRows = std::min(image.height, 4);
+  size_t blockBytes = ((type == DDSBC1) || (type == DDSBC4)) ? 8 : 16;
+
+  // Swap the block rows, top for bottom.
+  std::vector<unsigned char> temp(image.rowBytes);
+  for (GLsizei i = 0; i < blocksHigh / 2; i++) {
+    unsigned char* a = &image.pixels[i * image.rowBytes];
+    unsigned char* b = &image.pixels[(blocksHigh - 1 - i) * image.rowBytes];
+    memcpy(&temp[0], a, image.rowBytes);
+    memcpy(a, b, image.rowBytes);
+    memcpy(b, &temp[0], image.rowBytes);
+  }
+
+  // And then the rows inside each block.
+  for (size_t i = 0; i < image.pixels.size(); i += blockBytes) {
+    unsigned char* block = &image.pixels[i];
+    switch (type) {
+    case DDSBC1:
+      flipColorBlock(block, nRows);
+      break;
+    case DDSBC2:
+      flipExplicitAlphaBlock(block, nRows);
+      flipColorBlock(block + 8, nRows);
+      break;
+    case DDSBC3:
+      flipInterpolatedBlock(block, nRows);
+      flipColorBlock(block + 8, nRows);
+      break;
+    case DDSBC4:
+      flipInterpolatedBlock(block, nRows);
+      break;
+    case DDSBC5:
+      flipInterpolatedBlock(block, nRows);
+      flipInterpolatedBlock(block + 8, nRows);
+      break;
+    }
   }
+}
+
+// Makes a four-character code, like 'DXT1', as it's stored in a file.
+static uint32_t fourCC(const char* code) {
+  return (uint32_t)code[0] | ((uint32_t)code[1] << 8) |
+    ((uint32_t)code[2] << 16) | ((uint32_t)code[3] << 24);
+}
+
+bool textureImage::readDDS(const std::string &imagePath,
+                           std::vector<textureImage> &levels) {
 
-  // row_pointers is for pointing to image_data for reading the png with libpng
-  png_byte ** row_pointers = (png_byte **)malloc(temp_height * sizeof(png_byte *));
-  if (row_pointers == NULL) {
-    fprintf(stderr, "error: could not allocate memory for PNG row pointers\n");
-    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-    free(image_data);
+  FILE *fp = fopen(imagePath.c_str(), "rb");
+  if (fp == 0) {
+    perror(imagePath.c_str());
+    return false;
+  }
+
+  // The magic number, then a 124-byte header, then maybe a 20-byte
+  // DX10 header, all made of little-endian 32-bit words.
+  uint32_t header[32];
+  uint32_t dx10[5];
+  if ((fread(header, 4, 32, fp) != 32) || (header[0] != fourCC("DDS ")) ||
+      (header[1] != 124)) {
+    fprintf(stderr, "%s: Not a DDS file.\n", imagePath.c_str());
     fclose(fp);
-    return 0;
+    return false;
   }
 
-  // set the individual row_pointers to point at the correct offsets of image_data
-  for (unsigned int i = 0; i < temp_height; i++) {
-    row_pointers[temp_height - 1 - i] = image_data + i * rowbytes;
+  GLsizei height = header[3];
+  GLsizei width = header[4];
+  // Only believe the mipmap count if the flag says it's there.
+  int nLevels = ((header[2] & 0x20000) && header[7]) ? header[7] : 1;
+  uint32_t pixelFlags = header[20];
+  uint32_t code = header[21];
+  bool cube = (header[28] & 0x200) != 0;
+
+  if (code == fourCC("DX10")) {
+    if (fread(dx10, 4, 5, fp) != 5) {
+      fprintf(stderr, "%s: Not a DDS file.\n", imagePath.c_str());
+      fclose(fp);
+      return false;
+    }
+    // A 2D texture, not a cube, and not an array.
+    cube = cube || (dx10[1] != 3) || (dx10[2] & 0x4) || (dx10[3] > 1);
   }
 
-  // read the png into image_data through row_pointers
-  png_read_image(png_ptr, row_pointers);
+  if (cube || (header[2] & 0x800000)) {
+    fprintf(stderr, "%s: Only flat 2D DDS textures are handled.\n",
+            imagePath.c_str());
+    fclose(fp);
+    return false;
+  }
 
-  // Generate the OpenGL texture object
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, format, temp_width, temp_height,
-               0, format, GL_UNSIGNED_BYTE, image_data);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  // clean up
-  png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-  free(image_data);
-  free(row_pointers);
+  DDSBLOCKTYPE type;
+  GLenum format;
+  if (code == fourCC("DXT1")) {
+    type = DDSBC1;
+    format = (pixelFlags & 0x1) ?
+      GL_COMPRESSED_RGBA_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+  } else if ((code == fourCC("DXT2")) || (code == fourCC("DXT3"))) {
+    type = DDSBC2;
+    format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+  } else if ((code == fourCC("DXT4")) || (code == fourCC("DXT5"))) {
+    type = DDSBC3;
+    format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  } else if ((code == fourCC("ATI1")) || (code == fourCC("BC4U"))) {
+    type = DDSBC4;
+    format = GL_COMPRESSED_RED_RGTC1;
+  } else if ((code == fourCC("ATI2")) || (code == fourCC("BC5U"))) {
+    type = DDSBC5;
+    format = GL_COMPRESSED_RG_RGTC2;
+  } else if (code == fourCC("DX10")) {
+    // These are DXGI_FORMAT values.
+    switch (dx10[0]) {
+    case 71: type = DDSBC1; format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; break;
+    case 72: type = DDSBC1; format = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT; break;
+    case 74: type = DDSBC2; format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; break;
+    case 75: type = DDSBC2; format = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT; break;
+    case 77: type = DDSBC3; format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+    case 78: type = DDSBC3; format = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT; break;
+    case 80: type = DDSBC4; format = GL_COMPRESSED_RED_RGTC1; break;
+    case 83: type = DDSBC5; format = GL_COMPRESSED_RG_RGTC2; break;
+    default:
+      fprintf(stderr, "%s: Unknown DDS format %u.\n", imagePath.c_str(), dx10[0]);
+      fclose(fp);
+      return false;
+    }
+  } else {
+    fprintf(stderr, "%s: Only block-compressed DDS files are handled.\n",
+            imagePath.c_str());
+    fclose(fp);
+    return false;
+  }
+
+  size_t blockBytes = ((type == DDSBC1) || (type == DDSBC4)) ? 8 : 16;
+
+  // DDS files run from the top row down, and OpenGL from the bottom
+  // up, except for those png2dds makes, which it marks in the first
+  // reserved word.
+  bool bottomUp = (header[8] == fourCC("BSGU"));
+
+  levels.clear();
+  for (int i = 0; i < nLevels; i++) {
+
+    levels.push_back(textureImage());
+    textureImage &level = levels.back();
+    level.width = std::max(1, width >> i);
+    level.height = std::max(1, height >> i);
+    level.format = format;
+    level.compressed = true;
+    level.rowBytes = blockBytes * ((level.width + 3) / 4);
+    level.pixels.resize(level.rowBytes * ((level.height + 3) / 4));
+
+    if (fread(&level.pixels[0], 1, level.pixels.size(), fp) != level.pixels.size()) {
+      fprintf(stderr, "%s: The DDS file is cut short.\n", imagePath.c_str());
+      fclose(fp);
+      levels.clear();
+      return false;
+    }
+  }
   fclose(fp);
+
+  if (bottomUp) return true;
+
+  if (!canFlipBlocks(levels[0])) {
+    std::cerr << "** Caution: " << imagePath << " is " << height
+              << " pixels high, not a multiple of four, so it is upside down."
+              << std::endl;
+    return true;
+  }
+
+  // A smaller level may not be flippable even when the first is, as
+  // when 24 halves to 12 and then 6.  That level, and the ones below
+  // it, are dropped; OpenGL is told there are fewer mipmaps, and makes
+  // do with the smallest one left.
+  for (size_t i = 0; i < levels.size(); i++) {
+    if (!canFlipBlocks(levels[i])) {
+      levels.resize(i);
+      break;
+    }
+    flipBlocks(levels[i], type);
+  }
+
+  return true;
+}
+
+textureLoader::textureLoader() :
+  _stopping(false), _bytesPerFrame(4 << 20), _placeholderID(0) {}
+
+textureLoader::~textureLoader() {
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _wake.notify_all();
+  for (std::vector<std::thread>::iterator it = _workers.begin();
+       it != _workers.end(); it++) {
+    it->join();
+  }
+
+  // There's probably no GL context left by now, so just drop any
+  // unfinished work on the floor.
+  for (std::list<job*>::iterator it = _jobs.begin(); it != _jobs.end(); it++) {
+    delete *it;
+  }
+}
+
+textureLoader& textureLoader::instance() {
+  static textureLoader loader;
+  return loader;
+}
+
+void textureLoader::request(textureMgr* mgr, const std::string& fileName,
+                            const textureOptions& options) {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // Leave a core for the rendering thread.
+  if (_workers.empty()) {
+    unsigned int nWorkers = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    for (unsigned int i = 0; i < nWorkers; i++) {
+      _workers.push_back(std::thread(&textureLoader::_work, this));
+    }
+  }
+
+  job* newJob = new job(mgr, fileName, options);
+  _jobs.push_back(newJob);
+  _waiting.push_back(newJob);
+  _wake.notify_one();
+}
+
+void textureLoader::cancel(textureMgr* mgr) {
+
+  // The job itself is cleaned up on the rendering thread, since it
+  // may already own a texture.
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (std::list<job*>::iterator it = _jobs.begin(); it != _jobs.end(); it++) {
+    if ((*it)->mgr == mgr) (*it)->mgr = NULL;
+  }
+}
+
+void textureLoader::_work() {
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true) {
+
+    while (!_stopping && _waiting.empty()) _wake.wait(lock);
+    if (_stopping) return;
+
+    job* current = _waiting.front();
+    _waiting.pop_front();
+
+    // The decoding is the slow part, and touches nothing shared.
+    lock.unlock();
+    current->levels.resize(1);
+    current->decoded = current->levels[0].readPNG(current->fileName);
+    if (current->decoded && current->options.useMipmaps()) {
+      textureImage::addMipmaps(current->levels);
+    }
+    lock.lock();
+
+    _ready.push_back(current);
+  }
+}
+
+size_t textureLoader::uploadPending() {
+
+  size_t out = 0;
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_ready.empty() && (out < _bytesPerFrame)) {
+
+    job* current = _ready.front();
+    std::vector<textureImage>& levels = current->levels;
+
+    bool done = !current->decoded || !current->mgr;
+    if (!done) {
+
+      // The mutex keeps cancel() from pulling the texture manager out
+      // from under us, but the GL calls don't need it.
+      lock.unlock();
+
+      if (!current->textureID) {
+        glGenTextures(1, &current->textureID);
+        glBindTexture(GL_TEXTURE_2D, current->textureID);
+        for (size_t i = 0; i < levels.size(); i++) {
+          glTexImage2D(GL_TEXTURE_2D, i, levels[i].format,
+                       levels[i].width, levels[i].height,
+                       0, levels[i].format, GL_UNSIGNED_BYTE, NULL);
+        }
+        current->options.apply(levels.size());
+      } else {
+        glBindTexture(GL_TEXTURE_2D, current->textureID);
+      }
+
+      // As many rows as fit in what's left of the budget, but at
+      // least one.  The mipmaps follow the full-size image.
+      textureImage& image = levels[current->levelsUploaded];
+      GLsizei rows = std::max((size_t)1, (_bytesPerFrame - out) / image.rowBytes);
+      rows = std::min(rows, image.height - current->rowsUploaded);
+      glTexSubImage2D(GL_TEXTURE_2D, current->levelsUploaded,
+                      0, current->rowsUploaded,
+                      image.width, rows, image.format, GL_UNSIGNED_BYTE,
+                      &image.pixels[current->rowsUploaded * image.rowBytes]);
+      current->rowsUploaded += rows;
+      out += rows * image.rowBytes;
+
+      if (current->rowsUploaded == image.height) {
+        current->levelsUploaded++;
+        current->rowsUploaded = 0;
+      }
+
+      lock.lock();
+      done = (current->levelsUploaded == levels.size());
+    }
+
+    if (!done) continue;
+
+    if (current->mgr) {
+      if (current->decoded) {
+        current->mgr->_finishLoad(current->textureID, levels);
+      } else {
+        // Leave the checkerboard in place.
+        current->mgr->_loading = false;
+      }
+    } else if (current->textureID) {
+      glDeleteTextures(1, &current->textureID);
+    }
+
+    _ready.pop_front();
+    _jobs.remove(current);
+    delete current;
+  }
+
+  bsgStats::bytesUploaded += out;
+  return out;
+}
+
+size_t textureLoader::pending() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _jobs.size();
+}
+
+GLuint textureLoader::placeholder() {
+
+  if (!_placeholderID) {
+    std::vector<textureImage> levels(1);
+    levels[0].makeCheckerBoard(64, 8);
+    textureOptions options;
+    options.filter = GLFILTER_NEAREST;
+    _placeholderID = textureMgr::_upload(levels, options);
+  }
+  return _placeholderID;
+}
+
+textureCache::textureCache() {
+
+  // The loader must be made first, so that it is destroyed after the
+  // cache, since the cached textures may need to cancel their loads.
+  textureLoader::instance();
+}
+
+textureCache& textureCache::instance() {
+  static textureCache cache;
+  return cache;
+}
+
+bsgPtr<textureMgr> textureCache::get(const textureType &type,
+                                     const std::string &fileName,
+                                     const textureOptions &options,
+                                     const bool async) {
+
+  std::string path = fileName;
+  char* canonical = realpath(fileName.c_str(), NULL);
+  if (canonical) {
+    path = std::string(canonical);
+    free(canonical);
+  }
+
+  std::stringstream key;
+  key << type << " " << options.filter << " " << options.anisotropy
+      << " " << path;
+
+  std::map<std::string, bsgPtr<textureMgr> >::iterator it =
+    _textures.find(key.str());
+  if (it != _textures.end()) return it->second;
+
+  bsgPtr<textureMgr> texture = new textureMgr(options);
+  if (async) {
+    texture->readFileAsync(type, path);
+  } else {
+    texture->readFile(type, path);
+  }
+  _textures[key.str()] = texture;
   return texture;
 }
 
-void textureMgr::load(const GLuint programID) {
+size_t textureCache::collect() {
+
+  size_t out = 0;
+  std::map<std::string, bsgPtr<textureMgr> >::iterator it = _textures.begin();
+  while (it != _textures.end()) {
+    if (it->second.useCount() == 1) {
+      _textures.erase(it++);
+      out++;
+    } else {
+      it++;
+    }
+  }
+  return out;
+}
+
+size_t textureCache::getBytes() {
+
+  size_t out = 0;
+  for (std::map<std::string, bsgPtr<textureMgr> >::iterator it = _textures.begin();
+       it != _textures.end(); it++) {
+    out += it->second->getBytes();
+  }
+  return out;
+}
+
+void textureMgr::load(shaderMgr &shader) {
 
   // Get a handle for the texture uniform.
-  _textureAttribID = glGetUniformLocation(programID,
-                                          _textureAttribName.c_str());
+  _textureAttribID = shader.getUniformID(_textureAttribName);
 }
 
 void textureMgr::draw() {
@@ -265,6 +1072,7 @@ void textureMgr::draw() {
   
   // Set our "myTextureSampler" sampler to user Texture Unit 0
   glUniform1i(_textureAttribID, 0);
+  bsgStats::textureSwitches++;
 
   // The data is actually loaded into the buffer in the loadXX() method.
 }
@@ -302,44 +1110,208 @@ std::string shaderMgr::_getProgramInfoLog(GLuint obj) {
   }
 }
   
-void shaderMgr::addShader(const GLSHADERTYPE type,
-                          const std::string& shaderFile) {
+std::map<std::string, shaderMgr::sharedProgram> shaderMgr::_programs;
+bool shaderMgr::_useProgramCache = true;
+std::string shaderMgr::_programCacheDir;
+std::vector<shaderMgr*> shaderMgr::_pending;
+double shaderMgr::_compileSeconds = 0.0;
+int shaderMgr::_numCompiled = 0;
+int shaderMgr::_numShared = 0;
+int shaderMgr::_numLoaded = 0;
+
+// A 64-bit FNV-1a hash.  The seed can be another hash, to continue it.
+static uint64_t hashString(const std::string &text,
+                           const uint64_t seed = 14695981039346656037ULL) {
+  uint64_t hash = seed;
+  for (std::string::const_iterator it = text.begin(); it != text.end(); it++) {
+    hash = (hash ^ (unsigned char)*it) * 1099511628211ULL;
+  }
+  return hash;
+}
 
-  // Read the shader code from the given file.
-  std::ifstream shaderStream(shaderFile.c_str(), std::ios::in);
-  if (shaderStream.is_open()) {
-    std::string line = "";
+// Before GLSL 3.30, "#line n" makes the next line n + 1, not n.
+static int lineShift(const std::string &versionLine) {
+  int version = 110;
+  sscanf(versionLine.c_str() + versionLine.find("#version") + 8, "%d", &version);
+  return (version < 330) ? 1 : 0;
+}
 
-    // Suck all the text into the appropriate _shaderText slot.
-    while(getline(shaderStream, line)) _shaderText[type] += "\n" + line;
+std::string shaderMgr::_readSource(const std::string &fileName,
+                                   std::vector<std::string> &files,
+                                   std::vector<std::string> &including,
+                                   int &shift) {
+
+  if (std::find(including.begin(), including.end(), fileName) != including.end())
+    throw std::runtime_error("Shader file includes itself: " + fileName);
+
+  std::ifstream shaderStream(fileName.c_str(), std::ios::in);
+  if (!shaderStream.is_open())
+    throw std::runtime_error("Cannot open: " + fileName);
+
+  int fileNumber = files.size();
+  files.push_back(fileName);
+  including.push_back(fileName);
+
+  // Included files are found relative to this one.
+  std::string dir = fileName.substr(0, fileName.find_last_of('/') + 1);
+
+  std::stringstream out;
+  std::string line;
+  int lineNumber = 0;
+  while (getline(shaderStream, line)) {
+    lineNumber++;
+
+    size_t start = line.find_first_not_of(" \t");
+    if ((start != std::string::npos) && (line.compare(start, 8, "#include") == 0)) {
+      size_t open = line.find('"', start);
+      size_t close = (open == std::string::npos) ? open : line.find('"', open + 1);
+      if (close == std::string::npos) {
+        std::stringstream msg;
+        msg << fileName << ":" << lineNumber << ": #include needs a \"file name\".";
+        throw std::runtime_error(msg.str());
+      }
 
-    // Close the stream.
-    shaderStream.close();
-    
-  } else {
-    throw std::runtime_error("Cannot open: " + shaderFile);
+      std::string includeName = line.substr(open + 1, close - open - 1);
+      if (includeName[0] != '/') includeName = dir + includeName;
+
+      // The #line directives keep the line numbers in error messages
+      // right, and say which file they're in.
+      out << "#line " << 1 - shift << " " << files.size() << std::endl;
+      out << _readSource(includeName, files, including, shift);
+      out << "#line " << lineNumber + 1 - shift << " " << fileNumber << std::endl;
+    } else {
+      if ((start != std::string::npos) && (line.compare(start, 8, "#version") == 0))
+        shift = lineShift(line);
+      out << line << std::endl;
+    }
   }
 
+  including.pop_back();
+  return out.str();
+}
+
+void shaderMgr::addShader(const GLSHADERTYPE type,
+                          const std::string& shaderFile) {
+
+  // Read the shader code from the given file, and whatever it includes.
+  std::vector<std::string> including;
+  int shift = 1;
+  _sourceFiles[type].clear();
+  _shaderText[type] = _readSource(shaderFile, _sourceFiles[type], including, shift);
   _shaderFiles[type] = shaderFile;
+}
+
+void shaderMgr::addDefine(const std::string &name, const std::string &value) {
+  if (_compiled)
+    throw std::runtime_error("Must add defines before compiling shader.");
+  _defines[name] = value;
+}
 
-  if (_lightList->getNumLights() > 0) {
-    // Edit the shader source to reflect the input number of lights.  If
-    // there is no 'XX' in the shader code, this will cause an ugly
-    // error we have to catch.
-    char numLightsAsString[5];
-    sprintf(numLightsAsString, "%d", _lightList->getNumLights());
-    try {
-      _shaderText[type].replace(_shaderText[type].find("XX"), 2,
-                                numLightsAsString);
-    } catch (...) {
+bsgPtr<shaderMgr> shaderMgr::makeVariant() {
+
+  bsgPtr<shaderMgr> variant = new shaderMgr();
+  variant->_shaderText = _shaderText;
+  variant->_shaderFiles = _shaderFiles;
+  variant->_sourceFiles = _sourceFiles;
+  variant->_defines = _defines;
+  variant->_lightList = _lightList;
+  variant->_texture = _texture;
+  variant->_textureLoaded = _textureLoaded;
+  return variant;
+}
+
+std::string shaderMgr::_preprocess(const GLSHADERTYPE type) {
+
+  const std::string &text = _shaderText[type];
+  if (text.empty()) return text;
+
+  std::stringstream defines;
+  int numLights = _lightList->getNumLights();
+  defines << "#define BSG_NUM_LIGHTS " << numLights << std::endl;
+  if (numLights > 0) {
+    // Older shaders have an 'XX' where the number of lights goes.
+    if ((text.find("XX") == std::string::npos) &&
+        (text.find("BSG_NUM_LIGHTS") == std::string::npos)) {
       std::cerr << "Caution: Shader ("
-                << shaderFile
+                << _shaderFiles[type]
                 << ") does not care about number of lights." << std::endl;
     }
+    defines << "#define XX BSG_NUM_LIGHTS" << std::endl;
+  }
+  if (_textureLoaded) defines << "#define BSG_HAS_TEXTURE" << std::endl;
+  for (std::map<std::string, std::string>::iterator it = _defines.begin();
+       it != _defines.end(); it++) {
+    defines << "#define " << it->first << " " << it->second << std::endl;
+  }
+
+  // The #version line has to come first, so the #defines go after it.
+  size_t insertAt = 0;
+  int line = 0;
+  size_t version = text.find("#version");
+  if (version != std::string::npos) {
+    insertAt = text.find('\n', version);
+    insertAt = (insertAt == std::string::npos) ? text.size() : insertAt + 1;
+    line = std::count(text.begin(), text.begin() + insertAt, '\n') + 1 -
+      lineShift(text.substr(version, insertAt - version));
   }
+  defines << "#line " << line << " 0" << std::endl;
+
+  return text.substr(0, insertAt) + defines.str() + text.substr(insertAt);
 }
 
-void shaderMgr::compileShaders() {
+std::string shaderMgr::getVariantKey() {
+  std::stringstream key;
+  key << std::hex << std::setfill('0') << std::setw(16) << _variantHash;
+  return key.str();
+}
+
+void shaderMgr::_releaseProgram() {
+
+  std::map<std::string, sharedProgram>::iterator it = _programs.find(_variantKey);
+  if ((it != _programs.end()) && (it->second.programID == _programID)) {
+    if (--it->second.users > 0) return;
+    _programs.erase(it);
+  }
+  glDeleteProgram(_programID);
+}
+
+bool shaderMgr::_findProgram(std::vector<std::string> &text) {
+
+  text.clear();
+  text.push_back(_preprocess(GLSHADER_VERTEX));
+  text.push_back(_preprocess(GLSHADER_FRAGMENT));
+  text.push_back(_preprocess(GLSHADER_GEOMETRY));
+
+  // If some other shaderMgr has compiled the same thing, use its
+  // program.
+  _variantKey = text[GLSHADER_VERTEX] + '\0' + text[GLSHADER_FRAGMENT] +
+    '\0' + text[GLSHADER_GEOMETRY];
+  _variantHash = hashString(_variantKey);
+
+  std::map<std::string, sharedProgram>::iterator shared = _programs.find(_variantKey);
+  if (shared != _programs.end()) {
+    _programID = shared->second.programID;
+    shared->second.users++;
+    _findLocations();
+    _compiled = true;
+    _numShared++;
+    return true;
+  }
+
+  // Next best is a program saved by an earlier run.
+  _cacheName = _binaryCacheName();
+  if (!_cacheName.empty() && _loadBinary(_cacheName)) {
+    _shareProgram();
+    _findLocations();
+    _compiled = true;
+    _numLoaded++;
+    return true;
+  }
+
+  return false;
+}
+
+void shaderMgr::_startCompile(const std::vector<std::string> &text) {
 
   // geom is true if there *is* a geometry shader in place.
   bool geom = (!_shaderText[GLSHADER_GEOMETRY].empty());
@@ -350,81 +1322,398 @@ void shaderMgr::compileShaders() {
 
   // The OpenGL calls don't really like the modern C++ types, so we
   // convert back to old-fashioned char*.
-  const char* vs = _shaderText[GLSHADER_VERTEX].c_str();
-  const char* fs = _shaderText[GLSHADER_FRAGMENT].c_str();
+  const char* vs = text[GLSHADER_VERTEX].c_str();
+  const char* fs = text[GLSHADER_FRAGMENT].c_str();
   const char* gs;
-  if (geom) gs = _shaderText[GLSHADER_GEOMETRY].c_str();
+  if (geom) gs = text[GLSHADER_GEOMETRY].c_str();
 
   // Feed the shader source to OpenGL.
   glShaderSource(_shaderIDs[GLSHADER_VERTEX], 1, &vs, NULL);
   glShaderSource(_shaderIDs[GLSHADER_FRAGMENT], 1, &fs, NULL);
   if (geom) glShaderSource(_shaderIDs[GLSHADER_GEOMETRY], 1, &gs, NULL);
 
-  // Compile the shader source.  If there are any errors, print them.
-  std::string errorLog;
-  glCompileShader(_shaderIDs[GLSHADER_VERTEX]);
-  errorLog = _getShaderInfoLog(_shaderIDs[GLSHADER_VERTEX]);
-  if (errorLog.size() > 1) {
-    std::cerr << "** Vertex compile error in "
-              << _shaderFiles[GLSHADER_VERTEX]
-              << std::endl << errorLog << std::endl;
-    //std::cerr << _shaderText[GLSHADER_VERTEX] << std::endl;
+  // Start compiling.  Asking how it went would make us wait for it,
+  // so that waits for _startLink().
+  glCompileShader(_shaderIDs[GLSHADER_VERTEX]);
+  glCompileShader(_shaderIDs[GLSHADER_FRAGMENT]);
+  if (geom) glCompileShader(_shaderIDs[GLSHADER_GEOMETRY]);
+}
+
+void shaderMgr::_startLink() {
+
+  bool geom = (!_shaderText[GLSHADER_GEOMETRY].empty());
+
+  // If there were any compile errors, print them.
+  std::string errorLog;
+  errorLog = _getShaderInfoLog(_shaderIDs[GLSHADER_VERTEX]);
+  if (errorLog.size() > 1) {
+    std::cerr << "** Vertex compile error in "
+              << _sourceNames(GLSHADER_VERTEX)
+              << std::endl << errorLog << std::endl;
+    //std::cerr << _shaderText[GLSHADER_VERTEX] << std::endl;
+  }
+  
+  errorLog = _getShaderInfoLog(_shaderIDs[GLSHADER_FRAGMENT]);
+  if (errorLog.size() > 1)
+    std::cerr << "** Fragment compile error in "
+              << _sourceNames(GLSHADER_FRAGMENT)
+              << std::endl << errorLog << std::endl;
+
+  if (geom) {
+    errorLog = _getShaderInfoLog(_shaderIDs[GLSHADER_GEOMETRY]);
+    if (errorLog.size() > 1)
+      std::cerr << "** Geometry compile error in "
+                << _sourceNames(GLSHADER_GEOMETRY)
+                << std::endl << errorLog << std::endl;
+  }
+
+  // Now create a program to contain our two (or three) shaders, and
+  // attach the shaders to it.
+  _programID = glCreateProgram();
+  glAttachShader(_programID, _shaderIDs[GLSHADER_VERTEX]);
+  glAttachShader(_programID, _shaderIDs[GLSHADER_FRAGMENT]);
+  if (geom) glAttachShader(_programID, _shaderIDs[GLSHADER_GEOMETRY]);
+
+  // Assemble the shaders into a single program with 'link', which
+  // will make sure that the inputs to the fragment shader correspond
+  // with outputs from the vertex shader, and so on.
+  if (!_cacheName.empty())
+    glProgramParameteri(_programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  glLinkProgram(_programID);
+}
+
+void shaderMgr::_finishLink() {
+
+  bool geom = (!_shaderText[GLSHADER_GEOMETRY].empty());
+
+  std::string errorLog = _getProgramInfoLog(_programID);
+  if (errorLog.size() > 1) {
+    std::cerr << "** Shader link error in"
+              << _shaderFiles[GLSHADER_VERTEX] << ", "
+              << _shaderFiles[GLSHADER_FRAGMENT] << ", "
+              << _shaderFiles[GLSHADER_GEOMETRY]
+              << std::endl << errorLog << std::endl;
+  } 
+
+  // The shaders are linked into the program, so we can delete the raw
+  // shaders.
+  glDeleteShader(_shaderIDs[GLSHADER_VERTEX]);
+  glDeleteShader(_shaderIDs[GLSHADER_FRAGMENT]);
+  if (geom) glDeleteShader(_shaderIDs[GLSHADER_GEOMETRY]);
+
+  // Only a program that works is worth sharing, or saving.
+  GLint linked;
+  glGetProgramiv(_programID, GL_LINK_STATUS, &linked);
+  if (linked) {
+    _shareProgram();
+    if (!_cacheName.empty() && !_saveBinary(_cacheName))
+      std::cerr << "** Caution: could not write " << _cacheName << std::endl;
+  }
+
+  _findLocations();
+  _compiled = true;
+  _numCompiled++;
+}
+
+void shaderMgr::_compileBatch(const std::vector<shaderMgr*> &batch) {
+
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  double start = tp.tv_sec + tp.tv_usec / 1.0e6;
+
+  // Let the driver compile on as many threads as it wants.  GLEW
+  // only knows about this from 2.1 on.
+#ifdef GL_KHR_parallel_shader_compile
+  if (GLEW_KHR_parallel_shader_compile) glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+#endif
+
+  // Two shaders in the batch with the same code would both be
+  // compiled, since neither's program is done when the other looks
+  // for it.  So the second waits until the first is done, and then
+  // shares its program.
+  std::vector<shaderMgr*> compiling, waiting;
+  std::vector<std::vector<std::string> > waitingText;
+  std::vector<std::string> text;
+  for (std::vector<shaderMgr*>::const_iterator it = batch.begin();
+       it != batch.end(); it++) {
+    (*it)->_unregister();
+    if ((*it)->_findProgram(text)) continue;
+
+    bool duplicate = false;
+    for (std::vector<shaderMgr*>::iterator jt = compiling.begin();
+         jt != compiling.end(); jt++) {
+      if ((*jt)->_variantHash == (*it)->_variantHash &&
+          (*jt)->_variantKey == (*it)->_variantKey) {
+        duplicate = true;
+        break;
+      }
+    }
+    if (duplicate) {
+      waiting.push_back(*it);
+      waitingText.push_back(text);
+      continue;
+    }
+
+    (*it)->_startCompile(text);
+    compiling.push_back(*it);
+  }
+
+  for (std::vector<shaderMgr*>::iterator it = compiling.begin();
+       it != compiling.end(); it++) {
+    (*it)->_startLink();
+  }
+
+  for (std::vector<shaderMgr*>::iterator it = compiling.begin();
+       it != compiling.end(); it++) {
+    (*it)->_finishLink();
+  }
+
+  // If the first one's link failed, there is nothing to share, and
+  // these get their own try.
+  for (size_t i = 0; i < waiting.size(); i++) {
+    if (waiting[i]->_findProgram(text)) continue;
+    waiting[i]->_startCompile(waitingText[i]);
+    waiting[i]->_startLink();
+    waiting[i]->_finishLink();
+  }
+
+  gettimeofday(&tp, NULL);
+  _compileSeconds += tp.tv_sec + tp.tv_usec / 1.0e6 - start;
+}
+
+void shaderMgr::compileShaders() {
+  _compileBatch(std::vector<shaderMgr*>(1, this));
+}
+
+void shaderMgr::compileAll() {
+
+  // Only those with something to compile.  The ones still waiting for
+  // their code stay on the list.
+  std::vector<shaderMgr*> batch;
+  for (std::vector<shaderMgr*>::iterator it = _pending.begin();
+       it != _pending.end(); it++) {
+    if (!(*it)->_shaderText[GLSHADER_VERTEX].empty() &&
+        !(*it)->_shaderText[GLSHADER_FRAGMENT].empty())
+      batch.push_back(*it);
+  }
+
+  if (!batch.empty()) _compileBatch(batch);
+}
+
+void shaderMgr::_unregister() {
+  _pending.erase(std::remove(_pending.begin(), _pending.end(), this),
+                 _pending.end());
+}
+
+void shaderMgr::printCompileStats(std::ostream &os) {
+  os << "Shaders: " << _numCompiled << " compiled, "
+     << _numShared << " shared, " << _numLoaded << " read from disk, in "
+     << _compileSeconds * 1000.0 << " ms";
+#ifdef GL_KHR_parallel_shader_compile
+  if (GLEW_KHR_parallel_shader_compile) os << " (in parallel)";
+#endif
+  os << std::endl;
+}
+
+void shaderMgr::_shareProgram() {
+  sharedProgram &program = _programs[_variantKey];
+  program.programID = _programID;
+  program.users = 1;
+}
+
+// A saved program starts with this, then the driver description,
+// then the program binary.
+class programCacheHeader {
+ public:
+  char magic[8];
+  uint32_t version;
+  uint32_t format;
+  uint64_t sourceHash;
+  uint32_t driverLength;
+  uint32_t length;
+};
+
+static const char programCacheMagic[8] = { 'b', 's', 'g', 'p', 'r', 'o', 'g', 0 };
+
+// A binary is only good for the driver that made it.
+static std::string driverDescription() {
+  std::stringstream out;
+  out << glGetString(GL_VENDOR) << "\n" << glGetString(GL_RENDERER) << "\n"
+      << glGetString(GL_VERSION);
+  return out.str();
+}
+
+void shaderMgr::setProgramCache(const bool use, const std::string &dir) {
+  _useProgramCache = use;
+  _programCacheDir = dir;
+  if (!_programCacheDir.empty() && (*_programCacheDir.rbegin() != '/'))
+    _programCacheDir += "/";
+}
+
+std::string shaderMgr::_binaryCacheName() {
+
+  if (!_useProgramCache || !GLEW_ARB_get_program_binary) return "";
+
+  GLint nFormats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);
+  if (nFormats < 1) return "";
+
+  // The name has the driver in it too, so render nodes with different
+  // graphics cards can share a directory.
+  std::string base = _shaderFiles[GLSHADER_VERTEX];
+  if (!_programCacheDir.empty())
+    base = _programCacheDir + base.substr(base.find_last_of('/') + 1);
+
+  std::stringstream name;
+  name << base << "." << std::hex << std::setfill('0') << std::setw(16)
+       << hashString(driverDescription(), _variantHash) << ".bsgprog";
+  return name.str();
+}
+
+bool shaderMgr::_loadBinary(const std::string &cacheName) {
+
+  FILE* file = fopen(cacheName.c_str(), "rb");
+  if (!file) return false;
+
+  std::string driver = driverDescription();
+  programCacheHeader header;
+  std::vector<char> savedDriver;
+  std::vector<unsigned char> binary;
+  bool ok = (fread(&header, sizeof(header), 1, file) == 1) &&
+    (memcmp(header.magic, programCacheMagic, sizeof(header.magic)) == 0) &&
+    (header.version == 1) && (header.sourceHash == _variantHash) &&
+    (header.driverLength == driver.size());
+  if (ok) {
+    savedDriver.resize(header.driverLength);
+    binary.resize(header.length);
+    ok = (fread(&savedDriver[0], 1, savedDriver.size(), file) == savedDriver.size()) &&
+      (driver.compare(0, driver.size(), &savedDriver[0], savedDriver.size()) == 0) &&
+      (header.length > 0) &&
+      (fread(&binary[0], 1, binary.size(), file) == binary.size());
   }
-  
-  
-  glCompileShader(_shaderIDs[GLSHADER_FRAGMENT]);
-  errorLog = _getShaderInfoLog(_shaderIDs[GLSHADER_FRAGMENT]);
-  if (errorLog.size() > 1)
-    std::cerr << "** Fragment compile error in "
-              << _shaderFiles[GLSHADER_FRAGMENT]
-              << std::endl << errorLog << std::endl;
+  fclose(file);
+  if (!ok) return false;
 
-  if (geom) {
-    glCompileShader(_shaderIDs[GLSHADER_GEOMETRY]);
-    errorLog = _getShaderInfoLog(_shaderIDs[GLSHADER_GEOMETRY]);
-    if (errorLog.size() > 1)
-      std::cerr << "** Geometry compile error in "
-                << _shaderFiles[GLSHADER_GEOMETRY]
-                << std::endl << errorLog << std::endl;
+  _programID = glCreateProgram();
+  glProgramBinary(_programID, header.format, &binary[0], binary.size());
+
+  // The driver may turn it down, after an update, say.  Then it's
+  // compiled from scratch, and saved again.
+  GLint linked;
+  glGetProgramiv(_programID, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    glDeleteProgram(_programID);
+    _programID = 0;
+    remove(cacheName.c_str());
+    return false;
   }
+  return true;
+}
 
-  // Now create a program to contain our two (or three) shaders, and
-  // attach the shaders to it.
-  _programID = glCreateProgram();
-  glAttachShader(_programID, _shaderIDs[GLSHADER_VERTEX]);
-  glAttachShader(_programID, _shaderIDs[GLSHADER_FRAGMENT]);
-  if (geom) glAttachShader(_programID, _shaderIDs[GLSHADER_GEOMETRY]);
+bool shaderMgr::_saveBinary(const std::string &cacheName) {
+
+  GLint length = 0;
+  glGetProgramiv(_programID, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length < 1) return false;
+
+  std::vector<unsigned char> binary(length);
+  GLenum format;
+  glGetProgramBinary(_programID, length, &length, &format, &binary[0]);
+
+  std::string driver = driverDescription();
+  programCacheHeader header;
+  memcpy(header.magic, programCacheMagic, sizeof(header.magic));
+  header.version = 1;
+  header.format = format;
+  header.sourceHash = _variantHash;
+  header.driverLength = driver.size();
+  header.length = length;
+
+  // Write to a temporary file and rename it into place, as with the
+  // OBJ cache, since render nodes may all be writing it at once.
+  std::stringstream tempName;
+  tempName << cacheName << "." << getpid() << ".tmp";
+
+  FILE* file = fopen(tempName.str().c_str(), "wb");
+  if (!file) return false;
+
+  bool written = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+    (fwrite(driver.data(), 1, driver.size(), file) == driver.size()) &&
+    (fwrite(&binary[0], 1, length, file) == (size_t)length);
+
+  if ((fclose(file) != 0) || !written ||
+      (rename(tempName.str().c_str(), cacheName.c_str()) != 0)) {
+    remove(tempName.str().c_str());
+    return false;
+  }
+  return true;
+}
 
-  // Assemble the shaders into a single program with 'link', which
-  // will make sure that the inputs to the fragment shader correspond
-  // with outputs from the vertex shader, and so on.
-  glLinkProgram(_programID);
-  errorLog = _getProgramInfoLog(_programID);
-  if (errorLog.size() > 1) {
-    std::cerr << "** Shader link error in"
-              << _shaderFiles[GLSHADER_VERTEX] << ", "
-              << _shaderFiles[GLSHADER_FRAGMENT] << ", "
-              << _shaderFiles[GLSHADER_GEOMETRY]
-              << std::endl << errorLog << std::endl;
-  } 
+std::string shaderMgr::_sourceNames(const GLSHADERTYPE type) {
 
-  // The shaders are linked into the program, so we can delete the raw
-  // shaders.
-  glDeleteShader(_shaderIDs[GLSHADER_VERTEX]);
-  glDeleteShader(_shaderIDs[GLSHADER_FRAGMENT]);
-  if (geom) glDeleteShader(_shaderIDs[GLSHADER_GEOMETRY]);
+  std::stringstream names;
+  names << _shaderFiles[type];
+  for (size_t i = 1; i < _sourceFiles[type].size(); i++) {
+    names << ((i == 1) ? " (" : ", ") << i << ": " << _sourceFiles[type][i];
+  }
+  if (_sourceFiles[type].size() > 1) names << ")";
+  return names.str();
+}
 
-  _compiled = true;
+void shaderMgr::_findLocations() {
+
+  _uniformIDs.clear();
+  _attribIDs.clear();
+
+  GLint count, maxLength, size;
+  GLenum type;
+  std::vector<GLchar> name;
+
+  glGetProgramiv(_programID, GL_ACTIVE_UNIFORMS, &count);
+  glGetProgramiv(_programID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+  name.resize(maxLength + 1);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveUniform(_programID, i, name.size(), NULL, &size, &type, &name[0]);
+    std::string unifName(&name[0]);
+    GLint ID = glGetUniformLocation(_programID, unifName.c_str());
+    _uniformIDs[unifName] = ID;
+
+    // Arrays are listed by their first element, but are usually
+    // asked for by the plain name.
+    size_t n = unifName.size();
+    if ((n > 3) && (unifName.compare(n - 3, 3, "[0]") == 0))
+      _uniformIDs[unifName.substr(0, n - 3)] = ID;
+  }
+
+  glGetProgramiv(_programID, GL_ACTIVE_ATTRIBUTES, &count);
+  glGetProgramiv(_programID, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+  name.resize(maxLength + 1);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveAttrib(_programID, i, name.size(), NULL, &size, &type, &name[0]);
+    _attribIDs[&name[0]] = glGetAttribLocation(_programID, &name[0]);
+  }
 }
 
 GLuint shaderMgr::getAttribID(const std::string& attribName) {
-  glUseProgram(_programID);
-  return glGetAttribLocation(_programID, attribName.c_str());
+
+  std::map<std::string, GLint>::iterator it = _attribIDs.find(attribName);
+  if (it != _attribIDs.end()) return it->second;
+
+  GLint ID = glGetAttribLocation(_programID, attribName.c_str());
+  _attribIDs[attribName] = ID;
+  return ID;
 }
  
 GLuint shaderMgr::getUniformID(const std::string& unifName) {
-  glUseProgram(_programID);
-  return glGetUniformLocation(_programID, unifName.c_str());
+
+  std::map<std::string, GLint>::iterator it = _uniformIDs.find(unifName);
+  if (it != _uniformIDs.end()) return it->second;
+
+  // Probably an element of an array past the first, or a name the
+  // shader doesn't use.
+  GLint ID = glGetUniformLocation(_programID, unifName.c_str());
+  _uniformIDs[unifName] = ID;
+  return ID;
 }
 
 void shaderMgr::addLights(const bsgPtr<lightList> lightList) {
@@ -436,8 +1725,8 @@ void shaderMgr::addLights(const bsgPtr<lightList> lightList) {
 }
 
 void shaderMgr::load() {
-  _lightList->load(_programID);
-  if (_textureLoaded) _texture->load(_programID);
+  _lightList->load(*this);
+  if (_textureLoaded) _texture->load(*this);
 }
 
 void shaderMgr::draw() {
@@ -451,13 +1740,16 @@ void drawableObj::addData(const GLDATATYPE type,
 
   switch(type) {
   case(GLDATA_VERTICES):
-    _vertices = drawableObjData<glm::vec4>(name, data);
+    _vertices.name = name;
+    _vertices.setData(data);
     break;
   case(GLDATA_COLORS):
-    _colors = drawableObjData<glm::vec4>(name, data);
+    _colors.name = name;
+    _colors.setData(data);
     break;
   case(GLDATA_NORMALS):
-    _normals = drawableObjData<glm::vec4>(name, data);
+    _normals.name = name;
+    _normals.setData(data);
     break;
   case(GLDATA_TEXCOORDS):
     throw std::runtime_error("Do not use vec4 for texture coordinates.");
@@ -471,7 +1763,8 @@ void drawableObj::addData(const GLDATATYPE type,
 
   switch(type) {
   case(GLDATA_TEXCOORDS):
-    _uvs = drawableObjData<glm::vec2>(name, data);
+    _uvs.name = name;
+    _uvs.setData(data);
     break;
   case(GLDATA_COLORS):
   case(GLDATA_NORMALS):
@@ -482,13 +1775,51 @@ void drawableObj::addData(const GLDATATYPE type,
 }
 
 
+void drawableObj::setIndices(const std::vector<GLuint> &indices) {
+
+  GLuint maxIndex = 0;
+  for (std::vector<GLuint>::const_iterator it = indices.begin();
+       it != indices.end(); it++) {
+    maxIndex = std::max(maxIndex, *it);
+  }
+
+  if (indices.empty()) {
+    _indexType = GL_NONE;
+    _shortIndices.setData(std::vector<GLushort>());
+    _indices.setData(std::vector<GLuint>());
+  } else if (maxIndex <= 0xFFFF) {
+    _indexType = GL_UNSIGNED_SHORT;
+    _shortIndices.setData(std::vector<GLushort>(indices.begin(), indices.end()));
+    _indices.setData(std::vector<GLuint>());
+  } else {
+    _indexType = GL_UNSIGNED_INT;
+    _indices.setData(indices);
+    _shortIndices.setData(std::vector<GLushort>());
+  }
+}
   
+void drawableObj::transformUVs(const glm::vec2 &offset, const glm::vec2 &scale) {
+
+  std::vector<glm::vec2> uvs = _uvs.getData();
+  for (std::vector<glm::vec2>::iterator it = uvs.begin(); it != uvs.end(); it++) {
+    *it = offset + scale * (*it);
+  }
+  _uvs.setData(uvs);
+}
+
+bool drawableObj::_useVertexArrays = true;
+
 void drawableObj::prepare(GLuint programID) {
 
   bool badID = false;
   
-  // Figure out which buffers we need and get IDs for them.
-  glGenBuffers(1, &_vertices.bufferID);  
+  // Figure out which buffers we need and get IDs for them.  The
+  // interleaved layout needs only the one.
+  if (_layout == GLLAYOUT_INTERLEAVED) {
+    glGenBuffers(1, &_interleavedBufferID);
+  } else {
+    glGenBuffers(1, &_vertices.bufferID);
+  }
   _vertices.ID = glGetAttribLocation(programID, _vertices.name.c_str());
 
   // Check to make sure the ID awarded is sane.  If not, probably the
@@ -498,8 +1829,9 @@ void drawableObj::prepare(GLuint programID) {
     badID = true;
   }
   
-  if (!_colors.getData().empty()) {
-    glGenBuffers(1, &_colors.bufferID);
+  if (!_colors.getData().empty() || !_ranges.empty()) {
+    if ((_layout == GLLAYOUT_SEPARATE) && !_colors.getData().empty())
+      glGenBuffers(1, &_colors.bufferID);
     _colors.ID = glGetAttribLocation(programID, _colors.name.c_str());
     
     if (_colors.ID < 0) {
@@ -508,7 +1840,7 @@ void drawableObj::prepare(GLuint programID) {
     }
   }
   if (!_normals.getData().empty()) {
-    glGenBuffers(1, &_normals.bufferID);
+    if (_layout == GLLAYOUT_SEPARATE) glGenBuffers(1, &_normals.bufferID);
     _normals.ID = glGetAttribLocation(programID, _normals.name.c_str());
     
     if (_normals.ID < 0) {
@@ -517,7 +1849,7 @@ void drawableObj::prepare(GLuint programID) {
     }
   }
   if (!_uvs.getData().empty()) {
-    glGenBuffers(1, &_uvs.bufferID);
+    if (_layout == GLLAYOUT_SEPARATE) glGenBuffers(1, &_uvs.bufferID);
     _uvs.ID = glGetAttribLocation(programID, _uvs.name.c_str());
     
     if (_uvs.ID < 0) {
@@ -526,35 +1858,265 @@ void drawableObj::prepare(GLuint programID) {
     }
   }
 
+  // The indices, if any, have a buffer of their own, whatever the
+  // layout of the rest.
+  if (_indexType == GL_UNSIGNED_SHORT) {
+    glGenBuffers(1, &_shortIndices.bufferID);
+  } else if (_indexType == GL_UNSIGNED_INT) {
+    glGenBuffers(1, &_indices.bufferID);
+  }
+
   if (badID) {
     std::cerr << "This can be caused either by a spelling error, or by not using the" << std::endl << "attribute within the shader code." << std::endl;
   }
-  
+
+  if (_useVertexArrays && GLEW_ARB_vertex_array_object)
+    glGenVertexArrays(1, &_vertexArrayID);
+
   // Put the data in its buffers, for practice.
   load();
 
+  // Record the attribute setup, now that the layout is known.
+  if (_vertexArrayID) {
+    glBindVertexArray(_vertexArrayID);
+    _pointAttributes();
+    _vertexArrayDirty = false;
+  }
 }
 
-void drawableObj::load() {
+// Feed a component that is the same for every vertex to the shader
+// as a constant attribute value.
+static void setConstantAttrib(const GLint ID, const glm::vec4 &value) {
+  glVertexAttrib4fv(ID, &value.x);
+}
+static void setConstantAttrib(const GLint ID, const glm::vec2 &value) {
+  glVertexAttrib2fv(ID, &value.x);
+}
 
-  glBindBuffer(GL_ARRAY_BUFFER, _vertices.bufferID);
-  glBufferData(GL_ARRAY_BUFFER, _vertices.size(), &_vertices.getData()[0], GL_STATIC_DRAW);
+// Is every element of this data the same?
+template <class T>
+static bool isConstantData(const std::vector<T> &data) {
+  for (typename std::vector<T>::const_iterator it = data.begin();
+       it != data.end(); it++) {
+    if (*it != data[0]) return false;
+  }
+  return true;
+}
 
-  if (!_colors.getData().empty()) {
-    glBindBuffer(GL_ARRAY_BUFFER, _colors.bufferID);
-    glBufferData(GL_ARRAY_BUFFER, _colors.size(), &_colors.getData()[0], GL_STATIC_DRAW);
+template <class T>
+void drawableObj::_addToLayout(const GLDATATYPE type,
+                               const drawableObjData<T> &data) {
+
+  if (!data.getData().empty() &&
+      data.getData().size() != _vertices.getData().size())
+    throw std::runtime_error("The interleaved layout needs one of each component per vertex.");
+
+  // The vertices themselves are never left out.
+  _constant[type] = (type != GLDATA_VERTICES) && isConstantData(data.getData());
+  _offsets[type] = _stride;
+  if (!_constant[type]) _stride += sizeof(T);
+}
+
+template <class T>
+void drawableObj::_packComponent(const GLDATATYPE type,
+                                 const drawableObjData<T> &data,
+                                 const size_t begin, const size_t end,
+                                 std::vector<GLfloat> &buffer) {
+  if (_constant[type]) return;
+
+  // The buffer holds vertices [begin, end).
+  GLsizei stride = _stride / sizeof(GLfloat);
+  GLfloat* out = &buffer[_offsets[type] / sizeof(GLfloat)];
+  for (size_t i = begin; i < end; i++, out += stride) {
+    memcpy(out, &data.getData()[i], sizeof(T));
   }
-  if (!_normals.getData().empty()) {
-    glBindBuffer(GL_ARRAY_BUFFER, _normals.bufferID);
-    glBufferData(GL_ARRAY_BUFFER, _normals.size(), &_normals.getData()[0], GL_STATIC_DRAW);
+}
+
+size_t drawableObj::_loadInterleaved() {
+
+  if (!_vertices.isDirty() && !_colors.isDirty() &&
+      !_normals.isDirty() && !_uvs.isDirty()) return 0;
+
+  size_t nVertices = _vertices.getData().size();
+
+  // We have to rearrange the whole buffer if this is the first time
+  // through, if the number of vertices has changed, or if one of the
+  // components we had left out has been changed.  Otherwise we only
+  // need to repack the range of vertices that changed.
+  bool relayout = (_interleavedSize == 0) || (nVertices * _stride != _interleavedSize) ||
+    (_constant[GLDATA_COLORS] && _colors.isDirty()) ||
+    (_constant[GLDATA_NORMALS] && _normals.isDirty()) ||
+    (_constant[GLDATA_TEXCOORDS] && _uvs.isDirty());
+
+  size_t begin = 0, end = nVertices;
+  if (relayout) {
+    _vertexArrayDirty = true;
+    _stride = 0;
+    _addToLayout(GLDATA_VERTICES, _vertices);
+    _addToLayout(GLDATA_COLORS, _colors);
+    _addToLayout(GLDATA_NORMALS, _normals);
+    _addToLayout(GLDATA_TEXCOORDS, _uvs);
+  } else {
+    begin = nVertices;
+    end = 0;
+    if (_vertices.isDirty()) {
+      begin = std::min(begin, _vertices.dirtyBegin());
+      end = std::max(end, _vertices.dirtyEnd());
+    }
+    if (_colors.isDirty()) {
+      begin = std::min(begin, _colors.dirtyBegin());
+      end = std::max(end, _colors.dirtyEnd());
+    }
+    if (_normals.isDirty()) {
+      begin = std::min(begin, _normals.dirtyBegin());
+      end = std::max(end, _normals.dirtyEnd());
+    }
+    if (_uvs.isDirty()) {
+      begin = std::min(begin, _uvs.dirtyBegin());
+      end = std::max(end, _uvs.dirtyEnd());
+    }
   }
-  if (!_uvs.getData().empty()) {
-    glBindBuffer(GL_ARRAY_BUFFER, _uvs.bufferID);
-    glBufferData(GL_ARRAY_BUFFER, _uvs.size(), &_uvs.getData()[0], GL_STATIC_DRAW);
+
+  std::vector<GLfloat> buffer((end - begin) * _stride / sizeof(GLfloat));
+  size_t out = buffer.size() * sizeof(GLfloat);
+  if (out > 0) {
+    _packComponent(GLDATA_VERTICES, _vertices, begin, end, buffer);
+    _packComponent(GLDATA_COLORS, _colors, begin, end, buffer);
+    _packComponent(GLDATA_NORMALS, _normals, begin, end, buffer);
+    _packComponent(GLDATA_TEXCOORDS, _uvs, begin, end, buffer);
+
+    glBindBuffer(GL_ARRAY_BUFFER, _interleavedBufferID);
+    if (relayout) {
+      glBufferData(GL_ARRAY_BUFFER, out, &buffer[0], GL_STATIC_DRAW);
+      _interleavedSize = out;
+    } else {
+      glBufferSubData(GL_ARRAY_BUFFER, begin * _stride, out, &buffer[0]);
+    }
   }
+
+  _vertices.markClean();
+  _colors.markClean();
+  _normals.markClean();
+  _uvs.markClean();
+
+  bsgStats::bytesUploaded += out;
+  return out;
 }
 
-void drawableObj::draw() {
+size_t drawableObj::load() {
+
+  // setIndices() can switch between 16- and 32-bit indices after
+  // prepare(), and then the new kind needs a buffer of its own, and
+  // the old kind's buffer isn't needed any more.  The vertex array
+  // object has to be told about either.
+  bool prepared = (_vertices.bufferID != 0) || (_interleavedBufferID != 0);
+  if (prepared) {
+    bool useShort = (_indexType == GL_UNSIGNED_SHORT);
+    bool useInt = (_indexType == GL_UNSIGNED_INT);
+    if (useShort && (_shortIndices.bufferID == 0)) {
+      glGenBuffers(1, &_shortIndices.bufferID);
+      _vertexArrayDirty = true;
+    } else if (!useShort && (_shortIndices.bufferID != 0)) {
+      _shortIndices.deleteBuffer();
+      _vertexArrayDirty = true;
+    }
+    if (useInt && (_indices.bufferID == 0)) {
+      glGenBuffers(1, &_indices.bufferID);
+      _vertexArrayDirty = true;
+    } else if (!useInt && (_indices.bufferID != 0)) {
+      _indices.deleteBuffer();
+      _vertexArrayDirty = true;
+    }
+  }
+
+  // The index buffer binding belongs to whatever vertex array object
+  // is bound, so make sure it's ours, or none.
+  if (GLEW_ARB_vertex_array_object &&
+      (_shortIndices.isDirty() || _indices.isDirty()))
+    glBindVertexArray(_vertexArrayID);
+
+  // Each of these is a no-op unless its data has changed since the
+  // last time through, or is empty.
+  size_t out = _shortIndices.load(GL_ELEMENT_ARRAY_BUFFER) +
+    _indices.load(GL_ELEMENT_ARRAY_BUFFER);
+
+  if (_layout == GLLAYOUT_INTERLEAVED) return out + _loadInterleaved();
+
+  return out + _vertices.load() + _colors.load() + _normals.load() + _uvs.load();
+}
+
+void drawableObj::_drawElements(const GLsizei instances) {
+
+  if (instances < 1) return;
+
+  if (!_ranges.empty() && (_indexType != GL_NONE)) {
+
+    GLsizei indexSize = (_indexType == GL_UNSIGNED_SHORT) ?
+      sizeof(GLushort) : sizeof(GLuint);
+
+    if (_colors.ID >= 0) glDisableVertexAttribArray(_colors.ID);
+    for (std::vector<drawableObjRange>::iterator it = _ranges.begin();
+         it != _ranges.end(); it++) {
+      if (_colors.ID >= 0) setConstantAttrib(_colors.ID, it->color);
+      if (instances > 1) {
+        glDrawElementsInstancedARB(_drawType, it->count, _indexType,
+                                   (GLvoid*)((size_t)it->first * indexSize),
+                                   instances);
+      } else {
+        glDrawElements(_drawType, it->count, _indexType,
+                       (GLvoid*)((size_t)it->first * indexSize));
+      }
+    }
+
+  } else if (_indexType != GL_NONE) {
+    if (instances > 1) {
+      glDrawElementsInstancedARB(_drawType, _count, _indexType, 0, instances);
+    } else {
+      glDrawElements(_drawType, _count, _indexType, 0);
+    }
+  } else {
+    if (instances > 1) {
+      glDrawArraysInstancedARB(_drawType, 0, _count, instances);
+    } else {
+      glDrawArrays(_drawType, 0, _count);
+    }
+  }
+}
+
+template <class T>
+void drawableObj::_pointInterleaved(const GLDATATYPE type,
+                                    drawableObjData<T> &data) {
+
+  if (data.getData().empty() || (data.ID < 0)) return;
+
+  if (_constant[type]) {
+    glDisableVertexAttribArray(data.ID);
+    setConstantAttrib(data.ID, data.getData()[0]);
+  } else {
+    glEnableVertexAttribArray(data.ID);
+    glVertexAttribPointer(data.ID, data.intSize(), GL_FLOAT, 0, _stride,
+                          (GLvoid*)((size_t)_offsets[type]));
+  }
+}
+
+void drawableObj::_pointAttributes() {
+
+  if (_indexType == GL_UNSIGNED_SHORT) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _shortIndices.bufferID);
+  } else if (_indexType == GL_UNSIGNED_INT) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indices.bufferID);
+  }
+
+  if (_layout == GLLAYOUT_INTERLEAVED) {
+
+    // One buffer, one stride, each component at its own offset.
+    glBindBuffer(GL_ARRAY_BUFFER, _interleavedBufferID);
+    _pointInterleaved(GLDATA_VERTICES, _vertices);
+    _pointInterleaved(GLDATA_COLORS, _colors);
+    _pointInterleaved(GLDATA_NORMALS, _normals);
+    _pointInterleaved(GLDATA_TEXCOORDS, _uvs);
+    return;
+  }
 
   glBindBuffer(GL_ARRAY_BUFFER, _vertices.bufferID);
   glEnableVertexAttribArray(_vertices.ID);
@@ -575,11 +2137,104 @@ void drawableObj::draw() {
     glEnableVertexAttribArray(_uvs.ID);
     glVertexAttribPointer(_uvs.ID, _uvs.intSize(), GL_FLOAT, 0, 0, 0);
   }
+}
+
+void drawableObj::_disableAttributes() {
+
+  if (_vertices.ID >= 0) glDisableVertexAttribArray(_vertices.ID);
+  if (!_colors.getData().empty() && (_colors.ID >= 0))
+    glDisableVertexAttribArray(_colors.ID);
+  if (!_normals.getData().empty() && (_normals.ID >= 0))
+    glDisableVertexAttribArray(_normals.ID);
+  if (!_uvs.getData().empty() && (_uvs.ID >= 0))
+    glDisableVertexAttribArray(_uvs.ID);
+}
+
+void drawableObj::_setConstants() {
+
+  if (_layout != GLLAYOUT_INTERLEAVED) return;
+
+  if (_constant[GLDATA_COLORS] && !_colors.getData().empty() && (_colors.ID >= 0))
+    setConstantAttrib(_colors.ID, _colors.getData()[0]);
+  if (_constant[GLDATA_NORMALS] && !_normals.getData().empty() && (_normals.ID >= 0))
+    setConstantAttrib(_normals.ID, _normals.getData()[0]);
+  if (_constant[GLDATA_TEXCOORDS] && !_uvs.getData().empty() && (_uvs.ID >= 0))
+    setConstantAttrib(_uvs.ID, _uvs.getData()[0]);
+}
+
+void drawableObj::draw() {
+
+  if (_vertexArrayID) {
+
+    // The vertex array object has everything but the constants,
+    // unless the layout has changed since it was made.
+    glBindVertexArray(_vertexArrayID);
+    if (_vertexArrayDirty) {
+      _pointAttributes();
+      _vertexArrayDirty = false;
+    } else {
+      _setConstants();
+    }
+
+    _drawElements();
+    return;
+  }
+
+  // Without one, set it all up, and take it down again so the next
+  // object doesn't inherit arrays it doesn't have.  If other objects
+  // do have vertex array objects, don't disturb theirs.
+  if (GLEW_ARB_vertex_array_object) glBindVertexArray(0);
+  _pointAttributes();
+  _drawElements();
+  _disableAttributes();
+}
+
+void drawableObj::drawInstanced(const GLsizei instances, const GLint matrixID,
+                                const GLuint matrixBufferID) {
+
+  if (_vertexArrayID) {
+    glBindVertexArray(_vertexArrayID);
+    if (_vertexArrayDirty) {
+      _pointAttributes();
+      _vertexArrayDirty = false;
+    } else {
+      _setConstants();
+    }
+  } else {
+    if (GLEW_ARB_vertex_array_object) glBindVertexArray(0);
+    _pointAttributes();
+  }
+
+  // A mat4 attribute takes four locations, one per column, and each
+  // steps along once per copy instead of once per vertex.  With a
+  // vertex array object, this is remembered along with the rest, but
+  // the buffer may have moved, so it is set each time.
+  if (matrixID >= 0) {
+    glBindBuffer(GL_ARRAY_BUFFER, matrixBufferID);
+    for (int i = 0; i < 4; i++) {
+      glEnableVertexAttribArray(matrixID + i);
+      glVertexAttribPointer(matrixID + i, 4, GL_FLOAT, 0, sizeof(glm::mat4),
+                            (GLvoid*)(i * sizeof(glm::vec4)));
+      glVertexAttribDivisorARB(matrixID + i, 1);
+    }
+  }
 
-  glDrawArrays(_drawType, 0, _count);
+  _drawElements(instances);
+
+  if (!_vertexArrayID) {
+    _disableAttributes();
+    if (matrixID >= 0) {
+      for (int i = 0; i < 4; i++) {
+        glVertexAttribDivisorARB(matrixID + i, 0);
+        glDisableVertexAttribArray(matrixID + i);
+      }
+    }
+  }
 }
 
-glm::mat4 drawableMulti::getModelMatrix() {
+const glm::mat4& drawableMulti::getModelMatrix() {
+
+  if (!_worldMatrixNeedsReset) return _worldMatrix;
 
   if (_modelMatrixNeedsReset) {
     glm::mat4 translationMatrix = glm::translate(glm::mat4(1.0f), _position);
@@ -598,11 +2253,32 @@ glm::mat4 drawableMulti::getModelMatrix() {
   }
 
   // If there is a parent, get the parent transformation (model)
-  // matrix and use it with this one.
+  // matrix and use it with this one.  The parent's is kept too, so
+  // its siblings won't work it out again.
   if (_parent) 
-    return _parent->getModelMatrix() * _modelMatrix;
+    _worldMatrix = _parent->getModelMatrix() * _modelMatrix;
   else
-    return _modelMatrix;
+    _worldMatrix = _modelMatrix;
+
+  _worldMatrixNeedsReset = false;
+  return _worldMatrix;
+}
+
+void drawableCompound::setLayout(const GLLAYOUTTYPE layout) {
+
+  for (std::list<drawableObj>::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    it->setLayout(layout);
+  }
+}
+
+void drawableCompound::transformUVs(const glm::vec2 &offset,
+                                    const glm::vec2 &scale) {
+
+  for (std::list<drawableObj>::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    it->transformUVs(offset, scale);
+  }
 }
 
 void drawableCompound::prepare() {
@@ -624,7 +2300,8 @@ void drawableCompound::prepare() {
   
 void drawableCompound::load() {
 
-  _pShader->useProgram();
+  // This only looks up uniform locations, which doesn't need the
+  // program in use.
   _pShader->load();
 
   // Review the current state of the transformation matrices, and pack
@@ -662,10 +2339,33 @@ void drawableCompound::draw(const glm::mat4& viewMatrix,
   // std::cout << "model" << glm::to_string(_modelMatrix) << std::endl;
   // std::cout << "proj" << glm::to_string(projMatrix) << std::endl;
   
+  // Both sides of a two-sided object are visible, so we can't cull
+  // either of them.  Put the culling back the way we found it.
+  GLboolean culling = GL_FALSE;
+  if (_twoSided) {
+    culling = glIsEnabled(GL_CULL_FACE);
+    if (culling) glDisable(GL_CULL_FACE);
+  }
+  
+  _drawObjects();
+
+  if (culling) glEnable(GL_CULL_FACE);
+}
+
+void drawableCompound::_drawObjects() {
+
   for (std::list<drawableObj>::iterator it = _objects.begin();
        it != _objects.end(); it++) {
     it->draw();
-  }  
+  }
+}
+
+void drawableCompound::enqueue(renderQueue &queue) {
+
+  for (std::list<drawableObj>::iterator it = _objects.begin();
+       it != _objects.end(); it++) {
+    queue.add(this, &(*it));
+  }
 }
 
 drawableCollection::drawableCollection() {
@@ -788,6 +2488,177 @@ void drawableCollection::draw(const glm::mat4 &viewMatrix,
 }
 
 
+void drawableCollection::_markWorldDirty() {
+
+  // If this one's flag is already set, so are all those below it.
+  if (_worldMatrixNeedsReset) return;
+
+  _worldMatrixNeedsReset = true;
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->_markWorldDirty();
+  }
+}
+
+void drawableCollection::enqueue(renderQueue &queue) {
+
+  for (CollectionMap::iterator it =  _collection.begin();
+       it != _collection.end(); it++) {
+    it->second->enqueue(queue);
+  }
+}
+
+void drawableMulti::enqueue(renderQueue &queue) {
+  queue.add(this);
+}
+
+void renderQueue::add(drawableCompound* compound, drawableObj* obj) {
+
+  renderItem item;
+  item.compound = compound;
+  item.obj = obj;
+
+  // Program, then texture, then buffer, 16, 16, and 32 bits of each.
+  // Should an ID be too big for its bits, the order is a bit off, but
+  // nothing is drawn wrong, since draw() compares the real things.
+  shaderMgr* shader = &(*compound->_pShader);
+  uint64_t texture = shader->_textureLoaded ? shader->_texture->getTextureID() : 0;
+  uint64_t buffer = obj->_vertexArrayID ? obj->_vertexArrayID :
+    (obj->_layout == GLLAYOUT_INTERLEAVED) ? obj->_interleavedBufferID :
+    obj->_vertices.bufferID;
+  item.key = ((uint64_t)(shader->getProgram() & 0xffff) << 48) |
+    ((texture & 0xffff) << 32) | (buffer & 0xffffffff);
+
+  _items.push_back(item);
+}
+
+void renderQueue::add(drawableMulti* multi) {
+
+  // These go first, in the order added.
+  renderItem item;
+  item.multi = multi;
+  _items.push_back(item);
+}
+
+void renderQueue::sort() {
+
+  size_t n = _items.size();
+  if (n < 2) return;
+  _sorted.resize(n);
+
+  for (int shift = 0; shift < 64; shift += 8) {
+
+    size_t counts[256];
+    memset(counts, 0, sizeof(counts));
+    for (std::vector<renderItem>::iterator it = _items.begin();
+         it != _items.end(); it++) {
+      counts[(it->key >> shift) & 0xff]++;
+    }
+
+    // If every key has the same byte here, this pass would change
+    // nothing.  Usually only a few of the bytes differ.
+    if (counts[(_items[0].key >> shift) & 0xff] == n) continue;
+
+    size_t total = 0;
+    for (int i = 0; i < 256; i++) {
+      size_t count = counts[i];
+      counts[i] = total;
+      total += count;
+    }
+
+    for (std::vector<renderItem>::iterator it = _items.begin();
+         it != _items.end(); it++) {
+      _sorted[counts[(it->key >> shift) & 0xff]++] = *it;
+    }
+    _items.swap(_sorted);
+  }
+}
+
+void renderQueue::draw(const glm::mat4 &viewMatrix, const glm::mat4 &projMatrix) {
+
+  // Culling is turned off for two-sided objects, and put back the way
+  // we found it at the end.
+  GLboolean culling = glIsEnabled(GL_CULL_FACE);
+  GLboolean culled = culling;
+
+  // What was set for the last item.  Lights, textures, and matrices
+  // are uniforms, which belong to the program, so a new program
+  // means sending them all again.
+  bool programSet = false;
+  GLuint programID = 0;
+  lightList* lights = 0;
+  textureMgr* texture = 0;
+  drawableCompound* compound = 0;
+  bool viewSet = false;
+  GLuint viewID = 0, projID = 0;
+
+  for (std::vector<renderItem>::iterator it = _items.begin();
+       it != _items.end(); it++) {
+
+    if (it->multi) {
+      if (culled != culling) {
+        if (culling) glEnable(GL_CULL_FACE); else glDisable(GL_CULL_FACE);
+        culled = culling;
+      }
+      it->multi->draw(viewMatrix, projMatrix);
+      programSet = false;
+      continue;
+    }
+
+    drawableCompound* c = it->compound;
+    shaderMgr* shader = &(*c->_pShader);
+
+    if (!programSet || (shader->getProgram() != programID)) {
+      shader->useProgram();
+      programSet = true;
+      programID = shader->getProgram();
+      lights = 0;
+      texture = 0;
+      compound = 0;
+      viewSet = false;
+    }
+
+    if (&(*shader->_lightList) != lights) {
+      lights = &(*shader->_lightList);
+      lights->draw();
+    }
+    if (shader->_textureLoaded && (&(*shader->_texture) != texture)) {
+      texture = &(*shader->_texture);
+      texture->draw();
+    }
+
+    if (c != compound) {
+      compound = c;
+
+      // The view and projection matrices are the same for everyone,
+      // unless they go by other names.
+      if (!viewSet || (c->_viewMatrixID != viewID) || (c->_projMatrixID != projID)) {
+        glUniformMatrix4fv(c->_viewMatrixID, 1, false, &viewMatrix[0][0]);
+        glUniformMatrix4fv(c->_projMatrixID, 1, false, &projMatrix[0][0]);
+        viewSet = true;
+        viewID = c->_viewMatrixID;
+        projID = c->_projMatrixID;
+      }
+
+      glUniformMatrix4fv(c->_modelMatrixID, 1, false, &c->_totalModelMatrix[0][0]);
+      c->_normalMatrix = glm::transpose(glm::inverse(viewMatrix * c->_totalModelMatrix));
+      glUniformMatrix4fv(c->_normalMatrixID, 1, false, &c->_normalMatrix[0][0]);
+
+      GLboolean cull = culling && !c->_twoSided;
+      if (cull != culled) {
+        if (cull) glEnable(GL_CULL_FACE); else glDisable(GL_CULL_FACE);
+        culled = cull;
+      }
+    }
+
+    it->obj->draw();
+  }
+
+  if (culled != culling) {
+    if (culling) glEnable(GL_CULL_FACE); else glDisable(GL_CULL_FACE);
+  }
+}
+
 /// \brief Adjust camera position according to input Euler angles.
 ///
 /// We use quaternions in the implementation because they provide a
@@ -832,13 +2703,26 @@ glm::mat4 scene::getViewMatrix() {
   
 void scene::load() {
 
+  bsgStats::newFrame();
+  textureLoader::instance().uploadPending();
+  textureCache::instance().collect();
   _sceneRoot.load();
+
+  if (_useRenderQueue) {
+    _queue.clear();
+    _sceneRoot.enqueue(_queue);
+    _queue.sort();
+  }
 }
 
 void scene::draw(const glm::mat4 &viewMatrix,
                  const glm::mat4 &projMatrix) {
 
-  _sceneRoot.draw(viewMatrix, projMatrix);
+  if (_useRenderQueue) {
+    _queue.draw(viewMatrix, projMatrix);
+  } else {
+    _sceneRoot.draw(viewMatrix, projMatrix);
+  }
 }  
   
 }
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdexcept>
 #include <memory.h>
+#include <stdint.h>
 #include <math.h>
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -14,8 +15,15 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <deque>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // Include GLM
 #include <glm/glm.hpp>
@@ -37,6 +45,11 @@ typedef enum {
   GLDATA_TEXCOORDS  = 3
 } GLDATATYPE;
 
+typedef enum {
+  GLLAYOUT_SEPARATE    = 0,
+  GLLAYOUT_INTERLEAVED = 1
+} GLLAYOUTTYPE;
+
 typedef enum {
   GLSHADER_VERTEX   = 0,
   GLSHADER_FRAGMENT = 1,
@@ -114,6 +127,9 @@ class bsgPtrRC {
   
   // Decrement and return count.
   int release() { return --count; }
+
+  /// The number of pointers sharing the object.
+  int getCount() const { return count; }
 };  
 
 /// \brief A smart pointer to a bsg object.
@@ -138,6 +154,15 @@ class bsgPtr {
     _reference->addRef();
   }
 
+  /// Copies a pointer to a derived class into a pointer to its base,
+  /// sharing the count, as with a bsgPtr<virtualTexture> passed to
+  /// shaderMgr::addTexture().
+  template <class U>
+  bsgPtr(const bsgPtr<U> &sp) : _pData(sp._pData), _reference(sp._reference) {
+    _reference->addRef();
+  }
+  template <class U> friend class bsgPtr;
+
   /// Destructor.  Decrement the reference count.  If the count
   /// becomes zero, delete the data.
   ~bsgPtr() {
@@ -148,6 +173,10 @@ class bsgPtr {
   }
 
   operator bool() const { return _pData != 0; };
+
+  /// The number of bsgPtr objects pointing at this object, this one
+  /// included.
+  int useCount() const { return _reference->getCount(); };
   
   T& operator*() { return *_pData; };
   T* operator->() const { return _pData; };
@@ -178,39 +207,150 @@ class bsgUtils {
   static void printMat(const std::string &name, const glm::mat4 &mat);
 };
 
+/// \brief Counters for the work done in a frame.
+///
+/// The scene resets these at the top of its load() method, so after a
+/// frame has been drawn, they describe that frame.  They are static
+/// because the objects doing the work don't know which scene they
+/// belong to.
+class bsgStats {
+ public:
+  /// Bytes sent to the graphics card with glBufferData or
+  /// glBufferSubData, and by the textureLoader.
+  static size_t bytesUploaded;
+
+  /// Calls to shaderMgr::useProgram(), and textures bound for
+  /// drawing.  A renderQueue keeps these down.
+  static size_t programSwitches;
+  static size_t textureSwitches;
+
+  /// Reset the per-frame counters.
+  static void newFrame();
+};
+
 /// \brief Some data for an object.
 ///
 /// We package the data needed for a piece of data belonging to an
 /// object.  The name is the same as the variable name in the shader
 /// that will use it, and the ID is the index number by which we can
 /// refer to that buffer in the C++ code.
+///
+/// The data also keeps track of which elements have changed since it
+/// was last sent to its buffer, so that load() only sends what it
+/// must.  Most data never changes after the first load, and costs
+/// nothing after that.
 template <class T>
 class drawableObjData {
  private:
   std::vector<T> _data;
-  
+
+  /// The range of elements changed since the last load(), as
+  /// [_dirtyBegin, _dirtyEnd).  An empty range means the buffer is
+  /// up to date.
+  size_t _dirtyBegin, _dirtyEnd;
+
+  /// The size in bytes of the buffer as last allocated with
+  /// glBufferData.  If the data size is unchanged, we can overwrite
+  /// the changed part with glBufferSubData instead.
+  size_t _bufferSize;
+
  public:
- drawableObjData(): name("") {
-    _data.reserve(50); 
-    ID = 0; bufferID = 0;
+ drawableObjData(): name(""), ID(0), bufferID(0) {
+    _data.reserve(50);
+    _bufferSize = 0;
+    markClean();
   };
  drawableObjData(const std::string inName, const std::vector<T> inData) :
-  name(inName), _data(inData) {}
+  _data(inData), name(inName), ID(0), bufferID(0) {
+    _bufferSize = 0;
+    markDirty();
+  };
 
   // Copy constructor
  drawableObjData(const drawableObjData &objData) :
-  _data(objData.getData()), name(objData.name), ID(objData.ID),
+  _data(objData.getData()),
+    _dirtyBegin(objData._dirtyBegin), _dirtyEnd(objData._dirtyEnd),
+    _bufferSize(objData._bufferSize), name(objData.name), ID(objData.ID),
     bufferID(objData.bufferID) {};
-    
+
   /// The name of that data inside a shader.
   std::string name;
 
-  std::vector<T> getData() const { return _data; };
-  void addData(T d) { _data.push_back(d); };
-  
+  const std::vector<T>& getData() const { return _data; };
+
+  /// \brief Replace all the data.
+  void setData(const std::vector<T> &data) {
+    _data = data;
+    markDirty();
+  };
+  /// \brief Replace a single element of the data.
+  void setData(const int &i, const T &d) {
+    _data[i] = d;
+    markDirty(i, i + 1);
+  };
+  void addData(T d) {
+    _data.push_back(d);
+    markDirty(_data.size() - 1, _data.size());
+  };
+
+  /// \brief Note that elements [begin, end) have changed.
+  void markDirty(const size_t begin, const size_t end) {
+    if (_dirtyEnd > _dirtyBegin) {
+      _dirtyBegin = std::min(_dirtyBegin, begin);
+      _dirtyEnd = std::max(_dirtyEnd, end);
+    } else {
+      _dirtyBegin = begin;
+      _dirtyEnd = end;
+    }
+  };
+  /// \brief Note that all the data has changed.
+  void markDirty() { _dirtyBegin = 0; _dirtyEnd = _data.size(); };
+  void markClean() { _dirtyBegin = 0; _dirtyEnd = 0; };
+  bool isDirty() const { return _dirtyEnd > _dirtyBegin; };
+  size_t dirtyBegin() const { return _dirtyBegin; };
+  size_t dirtyEnd() const { return _dirtyEnd; };
+
+  /// \brief Send whatever has changed to the buffer.
+  ///
+  /// If the size of the data is unchanged since the last time, only
+  /// the changed range is sent, otherwise the buffer is reallocated.
+  /// The bytes sent are added to bsgStats::bytesUploaded, and also
+  /// returned.
+  size_t load(const GLenum target = GL_ARRAY_BUFFER) {
+    if (!isDirty() || _data.empty()) {
+      markClean();
+      return 0;
+    }
+
+    size_t out;
+    glBindBuffer(target, bufferID);
+    if (size() != _bufferSize) {
+      glBufferData(target, size(), &_data[0], GL_STATIC_DRAW);
+      _bufferSize = out = size();
+    } else {
+      out = (_dirtyEnd - _dirtyBegin) * sizeof(T);
+      glBufferSubData(target, _dirtyBegin * sizeof(T), out, &_data[_dirtyBegin]);
+    }
+
+    markClean();
+    bsgStats::bytesUploaded += out;
+    return out;
+  };
+
+  /// \brief Deletes the buffer, if there is one.
+  ///
+  /// A new one must be made before the next load(), which then sends
+  /// all the data.
+  void deleteBuffer() {
+    if (bufferID) glDeleteBuffers(1, &bufferID);
+    bufferID = 0;
+    _bufferSize = 0;
+    markDirty();
+  };
+
   // The ID that goes with that name.
   GLint ID;
-  
+
   /// The ID of the buffer containing that data.
   GLuint bufferID;
 
@@ -221,6 +361,8 @@ class drawableObjData {
   int intSize() { return sizeof(T) / sizeof(float); };
 };
 
+class shaderMgr;
+
 /// \class lightList
 /// \brief A class to manage a list of lights in a scene.
 ///
@@ -249,8 +391,8 @@ class lightList {
   /// The default names of things in the shaders, put here for easy
   /// comparison or editing.  If you're mucking around with the
   /// shaders, don't forget that these are names of arrays inside the
-  /// shader, and that the size of the arrays is set with 'XX', see
-  /// the shader constructors below.
+  /// shader, and that the size of the arrays is set with
+  /// BSG_NUM_LIGHTS, see shaderMgr::addLights().
   void _setupDefaultNames() {
     setNames("lightPositionWS", "lightColor");
   }
@@ -288,23 +430,23 @@ class lightList {
   // We have mutators and accessors for all the pieces...
   std::vector<glm::vec4> getPositions() { return _lightPositions.getData(); };
   void setPositions(const std::vector<glm::vec4> positions) {
-    _lightPositions.getData() = positions;
+    _lightPositions.setData(positions);
   };
   GLuint getPositionID() { return _lightPositions.ID; };
 
   std::vector<glm::vec4> getColors() { return _lightColors.getData(); };
-  void setColors(const std::vector<glm::vec4> &colors) { _lightColors.getData() = colors; };
+  void setColors(const std::vector<glm::vec4> &colors) { _lightColors.setData(colors); };
   GLuint getColorID() { return _lightColors.ID; };
 
   /// ... and also for individual lights.
   void setPosition(const int &i, const glm::vec4 &position) {
-    _lightPositions.getData()[i] = position;
+    _lightPositions.setData(i, position);
   };
   glm::vec4 getPosition(const int &i) { return _lightPositions.getData()[i]; };
 
   /// \brief Change a light's color.
   void setColor(const int &i, const glm::vec4 &color) {
-    _lightColors.getData()[i] = color; };
+    _lightColors.setData(i, color); };
   glm::vec4 getColor(const int &i) { return _lightColors.getData()[i]; };
 
   /// \brief Link the light data with whatever shader is in use.
@@ -312,9 +454,7 @@ class lightList {
   /// Load these lights for use with this program.  This should be
   /// called inside the load() method of the manager object of the
   /// shader that uses them.
-  //
-  // This must be preceded by a glUseProgram(programID) call.
-  void load(const GLint programID);
+  void load(shaderMgr &shader);
 
   /// \brief "Draw" these lights.
   ///
@@ -335,15 +475,161 @@ typedef enum {
 } textureType;
 
 
+/// \brief An image decoded into memory, ready to be sent to OpenGL.
+///
+/// The rows run from the bottom of the image up, as OpenGL wants
+/// them, and each row is padded to a multiple of four bytes, which is
+/// OpenGL's default unpack alignment.  Nothing here touches OpenGL,
+/// so an image can be decoded on any thread.
+///
+/// A compressed image holds 4x4 pixel blocks instead of pixels, in the
+/// form OpenGL takes them, and rowBytes is the size of one row of
+/// blocks.  Those are only ever passed along to OpenGL as they are.
+class textureImage {
+ public:
+  GLsizei width, height;
+  /// GL_RGB or GL_RGBA, or for a compressed image, one of the
+  /// GL_COMPRESSED_* formats.
+  GLenum format;
+  bool compressed;
+  size_t rowBytes;
+  std::vector<unsigned char> pixels;
+
+ textureImage() : width(0), height(0), format(GL_RGB), compressed(false),
+    rowBytes(0) {};
+
+  /// \brief Decodes a PNG file.
+  ///
+  /// Returns false, after complaining, if the file can't be read or
+  /// is in a format we don't handle.
+  bool readPNG(const std::string &imagePath);
+
+  /// \brief Reads a DDS file of compressed blocks.
+  ///
+  /// The blocks are not decoded; each mipmap level in the file becomes
+  /// one compressed image in the levels list, full size first.  BC1,
+  /// BC2, and BC3 (DXT1, DXT3, DXT5), and BC4 and BC5 (ATI1, ATI2),
+  /// are read, with either the old or the DX10 header.  The rows are
+  /// turned over, by swapping the rows within each block, so the file
+  /// comes out right side up like a PNG; files from png2dds are stored
+  /// that way already.  A level whose height is more than four and
+  /// not a multiple of four can't be turned over, so if the first is
+  /// like that, the image is left upside down, with a warning, and if
+  /// a smaller one is, it and those below it are left out.  Returns
+  /// false, after complaining, if the file can't be read or is in
+  /// some other format.
+  static bool readDDS(const std::string &imagePath,
+                      std::vector<textureImage> &levels);
+
+  /// \brief About how much video memory this will take as a texture.
+  size_t getBytes() const {
+    return compressed ? pixels.size() : 4 * (size_t)width * height;
+  };
+
+  /// \brief Draws a checkerboard, size pixels on a side.
+  void makeCheckerBoard(const int size, const int numFields);
+
+  /// \brief Makes the next smaller mipmap level of this image.
+  ///
+  /// Each pixel of the result is the average of a two by two box of
+  /// pixels here.  An odd width or height is rounded down, so the
+  /// last column or row is dropped, and a side of one stays one.
+  void halve(textureImage &smaller) const;
+
+  /// \brief Fills out a mipmap chain.
+  ///
+  /// Given a list holding a full-size image, halves the last one
+  /// until it is one pixel square, adding each new level to the list.
+  static void addMipmaps(std::vector<textureImage> &levels);
+};
+
+/// \brief An open PNG file, to be read all at once or a row at a time.
+///
+/// The rows come out from the top of the image down, unpadded.  This
+/// is for reading images too big to hold in memory, a row at a time;
+/// for anything else, textureImage::readPNG() is easier.
+class pngFile {
+ public:
+  GLsizei width, height;
+  /// GL_RGB or GL_RGBA.
+  GLenum format;
+  /// The size of a row, not padded.
+  size_t rowBytes;
+  /// An interlaced image comes in several passes over the whole
+  /// thing, so can only be read all at once, with readImage().
+  bool interlaced;
+
+  pngFile() : _fp(NULL), _png(NULL), _info(NULL), _endInfo(NULL) {};
+  ~pngFile() {
+    if (_png) png_destroy_read_struct(&_png, &_info, &_endInfo);
+    if (_fp) fclose(_fp);
+  };
+
+  /// \brief Reads the header.
+  ///
+  /// Returns false, after complaining, if the file can't be read or
+  /// is in a format we don't handle.
+  bool open(const std::string &imagePath);
+
+  void readRow(png_bytep row) { png_read_row(_png, row, NULL); };
+  void readImage(png_bytepp rows) { png_read_image(_png, rows); };
+
+ private:
+  FILE* _fp;
+  png_structp _png;
+  png_infop _info, _endInfo;
+};
+
+/// How a texture is sampled.  GLFILTER_NEAREST and GLFILTER_LINEAR
+/// read only the full-size image; GLFILTER_BILINEAR and
+/// GLFILTER_TRILINEAR also use a chain of smaller copies (mipmaps),
+/// so textures seen from far away are cheaper to draw and don't
+/// shimmer.  Trilinear blends between the two nearest mipmaps.
+typedef enum {
+  GLFILTER_NEAREST   = 0,
+  GLFILTER_LINEAR    = 1,
+  GLFILTER_BILINEAR  = 2,
+  GLFILTER_TRILINEAR = 3
+} GLFILTERTYPE;
+
+/// \brief Choices for how a texture is read and sampled.
+class textureOptions {
+ public:
+  GLFILTERTYPE filter;
+
+  /// The most samples taken along a surface seen at a slant.  One
+  /// turns this off.  It is held to what the hardware allows, and
+  /// ignored without the EXT_texture_filter_anisotropic extension.
+  GLfloat anisotropy;
+
+ textureOptions() : filter(GLFILTER_TRILINEAR), anisotropy(1.0f) {};
+
+  /// Does this filter need mipmaps?
+  bool useMipmaps() const {
+    return (filter == GLFILTER_BILINEAR) || (filter == GLFILTER_TRILINEAR);
+  };
+
+  /// \brief Sets the sampling parameters of the bound texture.
+  ///
+  /// nLevels is the number of mipmap levels it has, counting the
+  /// full-size image.  With only one, the mipmap filters fall back to
+  /// GL_LINEAR, since OpenGL won't draw a texture whose mipmaps are
+  /// missing.
+  void apply(const int nLevels) const;
+};
+
+class textureLoader;
+
 /// \brief A manager of textures and texture files.
 ///
 ///  A class to hold a texture and take care of loading it into the
 ///  OpenGL slots where it belongs.
 ///
 class textureMgr {
- private:
+ protected:
   GLfloat _width, _height;
 
+ private:
   GLuint _textureAttribID;
   std::string _textureAttribName;
 
@@ -353,23 +639,251 @@ class textureMgr {
 
   GLuint _textureBufferID;
 
+  textureOptions _options;
+  // The number of mipmap levels in the texture, counting the first,
+  // and their total size.
+  int _nLevels;
+  size_t _bytes;
+
+  // True while a readFileAsync() is still in progress.
+  bool _loading;
+
+  // Deletes the texture, unless it's the shared placeholder.
+  void _release();
+
   GLuint _loadPNG(const std::string imagePath);
+  bool _streamPNG(const std::string imagePath, GLuint &texture);
+  GLuint _loadDDS(const std::string imagePath);
   GLuint _loadCheckerBoard (int size, int numFields);
+
+  // Makes a texture from a decoded image and its mipmaps, if any.
+  static GLuint _upload(const std::vector<textureImage> &levels,
+                        const textureOptions &options);
+
+  // Notes the size of the texture, once loaded.
+  void _setLevels(const std::vector<textureImage> &levels);
+
+  // Called by the textureLoader when an asynchronous load is done.
+  friend class textureLoader;
+  void _finishLoad(const GLuint textureID,
+                   const std::vector<textureImage> &levels);
+
+  // Each textureMgr owns its OpenGL texture, so copying one would
+  // delete the texture twice.  Share them through a bsgPtr instead.
+  textureMgr(const textureMgr &) = delete;
+  textureMgr& operator=(const textureMgr &) = delete;
   
  public:
-  textureMgr() { _setupDefaultNames(); };
+ textureMgr() : _width(0), _height(0), _textureBufferID(0), _nLevels(0),
+    _bytes(0), _loading(false) {
+    _setupDefaultNames();
+  };
+ textureMgr(const textureOptions &options) :
+  _width(0), _height(0), _textureBufferID(0), _options(options), _nLevels(0),
+    _bytes(0), _loading(false) {
+    _setupDefaultNames();
+  };
+  /// Deletes the OpenGL texture too.
+  virtual ~textureMgr();
 
+  /// \brief Changes how the texture is sampled.
+  ///
+  /// This can be done before or after reading the file, but mipmaps
+  /// are only made when the file is read, so switching to a mipmap
+  /// filter afterwards gets GL_LINEAR until the file is read again.
+  /// During a readFileAsync(), the new options take effect when the
+  /// texture arrives, though the mipmaps are made, or not, as the
+  /// options said when the read started.
+  void setOptions(const textureOptions &options);
+  const textureOptions& getOptions() { return _options; };
+
+  /// \brief Reads a texture file.
+  ///
+  /// PNG files are decoded a strip of rows at a time, straight into a
+  /// pixel buffer that OpenGL copies from while the next strip is
+  /// decoded, so a big image is never held in memory all at once.  If
+  /// mipmaps are wanted, they're made from the rows on the way past,
+  /// and kept until the end, which takes a third of the image's size.
+  /// Interlaced PNGs, which can't be decoded a row at a time, are read
+  /// all at once.
   void readFile(const textureType &type, const std::string &fileName);
+
+  /// \brief Reads a texture file in the background.
+  ///
+  /// The file is decoded on a worker thread, and sent to OpenGL a
+  /// piece at a time, on the rendering thread, by the textureLoader.
+  /// Until it is all there, the texture is a checkerboard.  Only PNG
+  /// files are read this way; other types are read at once, as with
+  /// readFile().
+  void readFileAsync(const textureType &type, const std::string &fileName);
+
+  /// \brief Uses an image already in memory as the texture.
+  ///
+  /// Mipmaps are made for it if the options call for them.  This is
+  /// how a textureAtlas page becomes a texture.
+  void setImage(const textureImage &image);
+
+  /// \brief Is an asynchronous read still going on?
+  bool isLoading() { return _loading; };
   
-  void load(const GLuint programID);
-  void draw();
+  /// Finds the sampler uniform in the shader's program.
+  virtual void load(shaderMgr &shader);
+  virtual void draw();
 
   GLuint getTextureID() { return _textureBufferID; };
 
+  /// \brief About how much video memory the texture takes up.
+  ///
+  /// This assumes four bytes per pixel for uncompressed textures,
+  /// since that's how most drivers store them, and the block size for
+  /// compressed ones.
+  virtual size_t getBytes();
+
   GLfloat getWidth() { return _width; };
   GLfloat getHeight() { return _height; };
 };
 
+/// \brief Decodes texture files in the background.
+///
+/// Image decoding is slow, and OpenGL calls must be made on the
+/// rendering thread, so asynchronous texture reads are done in two
+/// halves.  A pool of worker threads decodes the files into
+/// textureImage objects.  Then uploadPending(), called once per frame
+/// on the rendering thread (scene::load() does this), sends them to
+/// OpenGL in row strips, no more than a set number of bytes per
+/// frame, so that a big image doesn't cause a long frame.
+///
+/// There is one of these, made when first used.  The worker threads
+/// are started with the first request.
+class textureLoader {
+ private:
+  // One texture on its way in.
+  class job {
+  public:
+    // Null if the texture manager was deleted before we got to it.
+    textureMgr* mgr;
+    std::string fileName;
+    textureOptions options;
+    // The image, followed by its mipmaps, if the options want them.
+    std::vector<textureImage> levels;
+    bool decoded;
+    GLuint textureID;
+    // Where the upload has got to.
+    size_t levelsUploaded;
+    GLsizei rowsUploaded;
+
+  job(textureMgr* m, const std::string &f, const textureOptions &o) :
+    mgr(m), fileName(f), options(o), decoded(false), textureID(0),
+      levelsUploaded(0), rowsUploaded(0) {};
+  };
+
+  std::vector<std::thread> _workers;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  bool _stopping;
+
+  // Jobs wait to be decoded, and then wait to be uploaded.  The
+  // first job in the ready list may be partly uploaded.
+  std::deque<job*> _waiting;
+  std::deque<job*> _ready;
+  // Everything not yet finished, for cancel().
+  std::list<job*> _jobs;
+
+  size_t _bytesPerFrame;
+  GLuint _placeholderID;
+
+  void _work();
+
+  textureLoader();
+  textureLoader(const textureLoader&);
+  textureLoader& operator=(const textureLoader&);
+
+ public:
+  ~textureLoader();
+
+  /// The one and only.
+  static textureLoader& instance();
+
+  /// \brief Queues a PNG file to be decoded for this texture manager.
+  ///
+  /// Mipmaps are made on the worker thread too, if the options call
+  /// for them.
+  void request(textureMgr* mgr, const std::string &fileName,
+               const textureOptions &options);
+
+  /// \brief Forgets any load in progress for this texture manager.
+  void cancel(textureMgr* mgr);
+
+  /// \brief Sends decoded images to OpenGL.
+  ///
+  /// Sends at most the per-frame byte limit (but always at least one
+  /// row, so progress is made), and returns the number of bytes sent.
+  /// Must be called on the rendering thread.
+  size_t uploadPending();
+
+  /// \brief Sets the most bytes uploadPending() will send at a time.
+  void setBytesPerFrame(const size_t bytes) { _bytesPerFrame = bytes; };
+  size_t getBytesPerFrame() { return _bytesPerFrame; };
+
+  /// \brief The number of textures not yet completely loaded.
+  size_t pending();
+
+  /// \brief The checkerboard shown until a texture arrives.
+  GLuint placeholder();
+  bool isPlaceholder(const GLuint textureID) {
+    return textureID && (textureID == _placeholderID);
+  };
+};
+
+/// \brief Shares textures read from the same file.
+///
+/// Asking the cache for a texture file gives back the texture manager
+/// already made for that file, if there is one, so each image is
+/// decoded and sent to OpenGL once, no matter how many objects use it.
+/// Files are identified by their canonical path, so "../data/a.png"
+/// and "/home/me/data/a.png" are the same file, and also by the
+/// texture options, since a different filter may need mipmaps the
+/// other one doesn't have.
+///
+/// The cache holds on to each texture only until no one else does.
+/// Textures that nothing outside the cache points to any more are
+/// deleted by collect(), which scene::load() calls once per frame.
+///
+/// Since the textures are shared, don't change their options with
+/// textureMgr::setOptions(); ask for a texture with different options
+/// instead.  This is all meant to be used from the rendering thread.
+class textureCache {
+ private:
+  std::map<std::string, bsgPtr<textureMgr> > _textures;
+
+  textureCache();
+  textureCache(const textureCache&);
+  textureCache& operator=(const textureCache&);
+
+ public:
+  /// The one and only.
+  static textureCache& instance();
+
+  /// \brief Returns the texture for a file, reading it if need be.
+  ///
+  /// With async set, a file not already in the cache is read with
+  /// textureMgr::readFileAsync(), otherwise with readFile().
+  bsgPtr<textureMgr> get(const textureType &type, const std::string &fileName,
+                         const textureOptions &options = textureOptions(),
+                         const bool async = false);
+
+  /// \brief Deletes the textures no one is using.
+  ///
+  /// Returns the number deleted.
+  size_t collect();
+
+  /// The number of textures in the cache.
+  size_t size() { return _textures.size(); };
+
+  /// About how much video memory the cached textures take up.
+  size_t getBytes();
+};
+
 
 ///  /brief A collection of shaders that work together as a shader program.
 ///
@@ -386,6 +900,13 @@ class shaderMgr {
   std::vector<std::string> _shaderFiles;
   std::vector<std::string> _shaderLog;
   std::vector<GLint> _shaderIDs;
+
+  /// The files each shader #includes, by the source string number
+  /// that compile errors in them are reported with.
+  std::vector<std::vector<std::string> > _sourceFiles;
+
+  /// Extra #defines for the shader code, by name.
+  std::map<std::string, std::string> _defines;
   
   std::string _linkLog;
   
@@ -402,6 +923,82 @@ class shaderMgr {
   std::string _getShaderInfoLog(GLuint obj);
   std::string _getProgramInfoLog(GLuint obj);
 
+  // Reads a shader file, pasting in the files it #includes.  The
+  // files list is the files read so far, whose positions are their
+  // source string numbers; the including list is the ones still
+  // being read, to catch a file that includes itself.  The shift
+  // is for #line directives, which changed meaning in GLSL 3.30, and
+  // is set by the #version line.
+  static std::string _readSource(const std::string &fileName,
+                                 std::vector<std::string> &files,
+                                 std::vector<std::string> &including,
+                                 int &shift);
+
+  // The shader code as it goes to OpenGL, with the #defines put in.
+  std::string _preprocess(const GLSHADERTYPE type);
+  // The shader's file name, and the numbers of the files it includes,
+  // for error messages.
+  std::string _sourceNames(const GLSHADERTYPE type);
+
+  // Linked programs, shared by every shaderMgr whose shader code
+  // comes out the same after preprocessing, and how many use each.
+  class sharedProgram {
+  public:
+    GLuint programID;
+    int users;
+  };
+  static std::map<std::string, sharedProgram> _programs;
+  std::string _variantKey;
+  uint64_t _variantHash;
+
+  // Stops using the program, deleting it if no one else is.
+  void _releaseProgram();
+  // Offers the program to other shaderMgrs with the same code.
+  void _shareProgram();
+
+  // Linked programs are saved to disk, when the driver allows, so
+  // later runs needn't compile them.
+  static bool _useProgramCache;
+  static std::string _programCacheDir;
+  // The file to save this program in, or "" if it can't be saved.
+  std::string _binaryCacheName();
+  bool _loadBinary(const std::string &cacheName);
+  bool _saveBinary(const std::string &cacheName);
+
+  // The locations of the program's uniforms and attributes, by name.
+  // The active ones are found when the program is linked; anything
+  // else asked for is looked up then, and remembered too.
+  std::map<std::string, GLint> _uniformIDs;
+  std::map<std::string, GLint> _attribIDs;
+  void _findLocations();
+
+  // The render queue draws the lights and texture separately, to skip
+  // the ones already drawn.
+  friend class renderQueue;
+
+  // Shaders not compiled yet, for compileAll().
+  static std::vector<shaderMgr*> _pending;
+  void _unregister();
+
+  // Compiling goes in stages, so a batch of shaders can each have
+  // their turn at a stage before any goes on to the next, and the
+  // driver can be compiling one while we hand it the next.  The first
+  // finds the program already made, here or on disk, if it can, and
+  // returns true if so; otherwise it leaves the preprocessed code in
+  // text.  The second only hands the code to OpenGL, and the third
+  // only starts the link, after the compiles are done.  The last
+  // finishes up.  None of them but the last waits on the driver.
+  bool _findProgram(std::vector<std::string> &text);
+  void _startCompile(const std::vector<std::string> &text);
+  void _startLink();
+  void _finishLink();
+  std::string _cacheName;
+  static void _compileBatch(const std::vector<shaderMgr*> &batch);
+
+  // For printCompileStats().
+  static double _compileSeconds;
+  static int _numCompiled, _numShared, _numLoaded;
+
  public:
   shaderMgr() {
     // Easiest way to initialize a non-static three-element
@@ -418,23 +1015,28 @@ class shaderMgr {
     _shaderFiles.push_back("");
     _shaderFiles.push_back("");
     _shaderFiles.push_back("");
+    _sourceFiles.resize(3);
     _lightList = new lightList();
     _compiled = false;
     _textureLoaded = false;
+    _variantHash = 0;
+    _pending.push_back(this);
   };
   ~shaderMgr() {
-    if (_compiled) glDeleteProgram(_programID);
+    if (_compiled) _releaseProgram();
+    else _unregister();
   }
 
   
   /// \brief Add lights to the shader.
   ///
-  /// This should be done before adding the shader code itself, unless
-  /// the shader does not depend on the number of lights.  The shader
-  /// manager class will edit any 'XX' string in the shader and
-  /// replace it with the number of lights in this list.  If your
-  /// shader ignores lighting, as many do, this will not do anything
-  /// besides issue a polite warning that the shader doesn't care.
+  /// This must be done before compiling the shaders, unless the
+  /// shader does not depend on the number of lights.  The number of
+  /// lights in this list is given to the shader code as
+  /// BSG_NUM_LIGHTS, and also as XX, which is how older shaders
+  /// asked for it.  If your shader ignores lighting, as many do,
+  /// this will not do anything besides issue a polite warning that
+  /// the shader doesn't care.
   void addLights(const bsgPtr<lightList> lightList);
 
   /// \brief Add a texture to the shader.
@@ -450,19 +1052,105 @@ class shaderMgr {
   /// \brief Add a shader to the program.
   ///
   /// You must specify at least a vertex and fragment shader.  The
-  /// geometry shader is optional.
+  /// geometry shader is optional.  A line like
+  ///
+  ///     #include "lighting.glsl"
+  ///
+  /// is replaced with the contents of that file, found relative to
+  /// the file it's in.  Included files shouldn't have a #version
+  /// line.  Compile errors in them are reported with the file's
+  /// number in place of the 0 that means the main file.
   void addShader(const GLSHADERTYPE type, const std::string &shaderFile);
 
+  /// \brief Add a #define to the shader code.
+  ///
+  /// It goes right after the #version line of each shader, when they
+  /// are compiled.  Some are put in automatically: BSG_NUM_LIGHTS,
+  /// and BSG_HAS_TEXTURE if a texture was added before compiling.
+  /// Use this for the rest, like BSG_TWO_SIDED, to make variants of
+  /// one shader with #ifdef.
+  void addDefine(const std::string &name, const std::string &value = "");
+
+  /// \brief Has this #define been added?
+  bool hasDefine(const std::string &name) { return _defines.count(name) > 0; };
+
+  /// \brief A new shader with the same code, #defines, lights, and
+  /// texture, not yet compiled.
+  ///
+  /// Add #defines to it to make a variant of this shader without
+  /// changing this one, or anything else drawn with it.  A variant
+  /// that comes out the same as another shader shares its program;
+  /// see compileShaders().
+  bsgPtr<shaderMgr> makeVariant();
+
   /// \brief Compile and link the loaded shaders.
   ///
   /// You need to have specified at least a vertex and fragment
   /// shader.  The geometry shader is optional.
+  ///
+  /// If another shaderMgr has already compiled the same code, with
+  /// the same #defines, its program is used instead of compiling
+  /// another copy.  Shaders that share a program share its uniform
+  /// values, too, so set any uniform of your own before each draw,
+  /// as the lights, texture, and matrices are.
   void compileShaders();
 
-  /// Get the ID number for an attribute name that appears in a shader.
+  /// \brief Compile and link every shader not yet compiled.
+  ///
+  /// Does for every shaderMgr with code added but not compiled what
+  /// compileShaders() does for one, but in a batch: all the shaders
+  /// are handed to OpenGL before any is checked, and all the programs
+  /// linked before any is checked, so the driver isn't kept waiting
+  /// on us between them.  Where the driver has
+  /// KHR_parallel_shader_compile, it is told to use as many threads
+  /// as it likes, and the compiles run side by side.  With many
+  /// shaders, this is much quicker than compiling them one by one.
+  static void compileAll();
+
+  /// \brief The seconds spent compiling and linking, so far.
+  ///
+  /// This counts compileShaders() and compileAll(), including the
+  /// programs shared or read from disk.
+  static double getCompileTime() { return _compileSeconds; };
+
+  /// \brief Prints the compile time, and how the programs were made.
+  static void printCompileStats(std::ostream &os);
+
+  /// \brief Names this shader variant.
+  ///
+  /// This is a hash of the code as compiled, so two shaders with the
+  /// same key can use the same program.  Only meaningful after
+  /// compileShaders().
+  std::string getVariantKey();
+
+  /// \brief How many different programs are in use, across all shaders.
+  static size_t getNumPrograms() { return _programs.size(); };
+
+  /// \brief Controls the saving of compiled programs.
+  ///
+  /// When the driver can hand back a linked program (with
+  /// ARB_get_program_binary), compileShaders() saves it, and later
+  /// runs load that instead of compiling.  The file is named for the
+  /// vertex shader, with a hash of the preprocessed code and of the
+  /// driver's vendor, renderer, and version added, so a new driver
+  /// or an edited shader just makes a new file.  A file the driver
+  /// won't take is deleted and the program compiled from scratch.
+  ///
+  /// The files go beside the vertex shader, unless a directory is
+  /// given here; it must exist.  Saving is on by default.
+  static void setProgramCache(const bool use, const std::string &dir = "");
+
+  /// \brief Get the ID number for an attribute name that appears in a shader.
+  ///
+  /// The IDs are all found when the shaders are linked, so this
+  /// doesn't have to ask OpenGL.  Like glGetAttribLocation(), it
+  /// returns -1 for a name the program doesn't use.
   GLuint getAttribID(const std::string &attribName);
 
-  /// Get the ID number for a uniform name that appears in a shader.
+  /// \brief Get the ID number for a uniform name that appears in a shader.
+  ///
+  /// As with getAttribID(), this comes from a table made at link time.
+  /// An array can be named with or without its "[0]".
   GLuint getUniformID(const std::string &unifName);
 
   /// \brief Returns the program ID of the compiled shader.
@@ -474,7 +1162,10 @@ class shaderMgr {
   /// on this shader program, like enabling a buffer or loading an
   /// attribute's data.  OpenGL uses "state", and this call puts the
   /// GPU in a state of being ready to use this shader.
-  void useProgram() { glUseProgram(_programID); };
+  void useProgram() {
+    glUseProgram(_programID);
+    bsgStats::programSwitches++;
+  };
 
   /// \brief Sanity check could go here.
   ///
@@ -494,6 +1185,19 @@ class shaderMgr {
   void draw();
 };
 
+/// \brief A stretch of a drawableObj's indices drawn in one color.
+///
+/// See drawableObj::setRanges().
+class drawableObjRange {
+ public:
+  GLuint first;
+  GLsizei count;
+  glm::vec4 color;
+
+ drawableObjRange(const GLuint f, const GLsizei c, const glm::vec4 &col) :
+  first(f), count(c), color(col) {};
+};
+
 /// \brief The information necessary to draw an object.
 ///
 /// This object contains a set of vertices, colors, normals, texture
@@ -519,12 +1223,74 @@ class drawableObj {
   drawableObjData<glm::vec4> _colors;
   drawableObjData<glm::vec4> _normals;
   drawableObjData<glm::vec2> _uvs;
-  
+
+  // An optional list of indices into the components above.  If there
+  // are indices, the object is drawn with glDrawElements, otherwise
+  // glDrawArrays.  Only one of these two is used, depending on how
+  // many vertices there are; the 16-bit version is half the size, but
+  // can only address 65536 vertices.
+  drawableObjData<GLushort> _shortIndices;
+  drawableObjData<GLuint> _indices;
+  GLenum _indexType;
+
+  // If these are given, the indices are drawn a range at a time, with
+  // a constant color for each, instead of all at once.
+  std::vector<drawableObjRange> _ranges;
+
+  // How the components are arranged in buffers.  See setLayout().
+  GLLAYOUTTYPE _layout;
+
+  // For the interleaved layout, this is the one buffer holding all
+  // the components, the size of one vertex in it, and where each
+  // component sits inside a vertex.  These are indexed by GLDATATYPE.
+  // A component that is the same for every vertex is left out of the
+  // buffer, marked constant, and fed to the shader as a constant
+  // attribute value instead.
+  GLuint _interleavedBufferID;
+  size_t _interleavedSize;
+  GLsizei _stride;
+  GLsizei _offsets[4];
+  bool _constant[4];
+
+  template <class T>
+  void _addToLayout(const GLDATATYPE type, const drawableObjData<T> &data);
+  template <class T>
+  void _packComponent(const GLDATATYPE type, const drawableObjData<T> &data,
+                      const size_t begin, const size_t end,
+                      std::vector<GLfloat> &buffer);
+  template <class T>
+  void _pointInterleaved(const GLDATATYPE type, drawableObjData<T> &data);
+  size_t _loadInterleaved();
+
+  // The vertex array object that remembers which buffers go with which
+  // attributes, so a draw needn't say it all again, or 0 if we aren't
+  // using one.  It has to be made again when the interleaved layout
+  // changes.
+  GLuint _vertexArrayID;
+  bool _vertexArrayDirty;
+  static bool _useVertexArrays;
+
+  // Points each attribute at its buffer, and turns off the ones we
+  // enabled.
+  void _pointAttributes();
+  void _disableAttributes();
+  // The constant attributes aren't part of a vertex array object, so
+  // they are set on every draw.
+  void _setConstants();
+
+  // Issues the draw call, indexed or not, for one copy or many.
+  void _drawElements(const GLsizei instances = 1);
+
+  // The render queue sorts on our buffers.
+  friend class renderQueue;
+
   std::string print() const { return std::string("drawableObj"); };
   friend std::ostream &operator<<(std::ostream &os, const drawableObj &obj);
   
  public:
-  drawableObj() {};
+ drawableObj() : _indexType(GL_NONE), _layout(GLLAYOUT_SEPARATE),
+    _interleavedBufferID(0), _interleavedSize(0), _stride(0),
+    _vertexArrayID(0), _vertexArrayDirty(false) {};
 
   /// \brief Specify the draw type of the shape.
   ///
@@ -533,9 +1299,18 @@ class drawableObj {
   ///
   /// This is a nice intro:
   /// http://www.falloutsoftware.com/tutorials/gl/gl3.htm
+  ///
+  /// If there are indices, the count is the number of indices,
+  /// otherwise the number of vertices.
   void setDrawType(const GLenum drawType) {
     _drawType = drawType;
-    _count = _vertices.size();
+    if (_indexType == GL_UNSIGNED_SHORT) {
+      _count = _shortIndices.getData().size();
+    } else if (_indexType == GL_UNSIGNED_INT) {
+      _count = _indices.getData().size();
+    } else {
+      _count = _vertices.getData().size();
+    }
   };
 
   /// \brief Specify the draw type and the vertex count.
@@ -562,6 +1337,65 @@ class drawableObj {
                const std::string &name,
                const std::vector<glm::vec2> &data);
 
+  /// \brief Add a list of indices into the vertex data.
+  ///
+  /// With indices, each distinct vertex need only be stored once, no
+  /// matter how many triangles use it, and the shape is drawn with
+  /// glDrawElements.  If the indices address no more than 65536
+  /// vertices, they are stored as 16-bit values, otherwise as 32-bit
+  /// values.  Call setDrawType() after this, so the count is right.
+  /// It can be called again after prepare(); the new indices are sent
+  /// with the next load().
+  void setIndices(const std::vector<GLuint> &indices);
+
+  /// \brief Moves and scales the texture coordinates.
+  ///
+  /// Each (u, v) becomes offset + scale * (u, v).  This is how a shape
+  /// is pointed at its own piece of a texture atlas.  It can be done
+  /// before or after prepare(); the new coordinates are sent with the
+  /// next load().
+  void transformUVs(const glm::vec2 &offset, const glm::vec2 &scale);
+
+  /// \brief Draw the indices in ranges, each with its own color.
+  ///
+  /// Each range is drawn with a separate glDrawElements call, and
+  /// while it is drawn, the shader attribute called colorName is
+  /// given the range's color as a constant value.  This is how to
+  /// draw a shape made of several materials from one set of buffers,
+  /// without a per-vertex color stream.  Don't add color data as
+  /// well.  Call this after setIndices() and before prepare().
+  void setRanges(const std::string &colorName,
+                 const std::vector<drawableObjRange> &ranges) {
+    _colors.name = colorName;
+    _ranges = ranges;
+  };
+
+  /// \brief Choose how the data is arranged in buffers.
+  ///
+  /// The default, GLLAYOUT_SEPARATE, keeps each component (vertices,
+  /// colors, normals, texture coordinates) in its own buffer.  With
+  /// GLLAYOUT_INTERLEAVED, all the components for one vertex sit
+  /// next to each other in a single buffer, so a draw binds one
+  /// buffer instead of four, and the GPU reads each vertex from one
+  /// place.  Components that are the same for every vertex (a
+  /// single color, say) are left out of the buffer entirely.  The
+  /// interleaved layout needs one of each component per vertex.
+  ///
+  /// Set this before prepare().
+  void setLayout(const GLLAYOUTTYPE layout) { _layout = layout; };
+  GLLAYOUTTYPE getLayout() { return _layout; };
+
+  /// \brief Choose whether to use vertex array objects.
+  ///
+  /// Where ARB_vertex_array_object is available, prepare() records
+  /// the buffer and attribute setup of each shape in a vertex array
+  /// object, and a draw just binds that, instead of binding each
+  /// buffer and pointing each attribute again.  This is on by
+  /// default; turning it off, for comparison, affects only the shapes
+  /// prepared afterward.
+  static void setUseVertexArrays(const bool use) { _useVertexArrays = use; };
+  static bool getUseVertexArrays() { return _useVertexArrays; };
+
   /// \brief One-time-only draw preparation.
   ///
   /// This generates the proper number of buffers for the shape data
@@ -584,16 +1418,37 @@ class drawableObj {
   /// data into those buffers.  The load step is separate from the
   /// draw step because you might want to draw several times, for
   /// example for a stereo display where you have to draw twice.
-  void load();
+  ///
+  /// Only the data that has changed since the last load is sent, so
+  /// for an object whose shape doesn't change, this is nearly free
+  /// after the first frame.  Returns the number of bytes sent.
+  size_t load();
 
   /// \brief This is the actual step of drawing the object.
   ///
-  /// The method binds each OpenGL buffer, then enables the arrays.
-  /// We assume the data we want to draw is already in the buffer, via
-  /// the load() method.
+  /// The method binds the object's vertex array object, or, without
+  /// one, binds each OpenGL buffer and enables the arrays, and
+  /// disables them again after.  We assume the data we want to draw
+  /// is already in the buffer, via the load() method.
+  ///
+  /// The vertex array object is left bound, since the next draw will
+  /// bind its own.  Code of your own that sets up attributes should
+  /// bind vertex array 0 first, so as not to change ours.
   void draw();
+
+  /// \brief Draws many copies of the object in one call.
+  ///
+  /// This is draw() with glDrawElementsInstanced, for
+  /// drawableInstances.  If matrixID is an attribute, it is a mat4
+  /// taking one matrix per copy from matrixBufferID, which takes
+  /// ARB_instanced_arrays.  Otherwise the shader must tell the copies
+  /// apart by gl_InstanceID, which takes ARB_draw_instanced.
+  void drawInstanced(const GLsizei instances, const GLint matrixID = -1,
+                     const GLuint matrixBufferID = 0);
 };
 
+class renderQueue;
+
 /// \brief An abstract class to handle transformation matrices.
 ///
 /// This class is the common root of drawableCompound and
@@ -629,12 +1484,24 @@ class drawableMulti {
   glm::mat4 _modelMatrix;
   bool _modelMatrixNeedsReset;
 
+  /// The model matrix times those of all the parents, and its flag.
+  /// The flag is set when this one's model matrix changes, or any
+  /// parent's does, so each is worked out only once per change.  If
+  /// a node's flag is set, so are those of everything under it.
+  glm::mat4 _worldMatrix;
+  bool _worldMatrixNeedsReset;
+
+  /// Sets the world matrix flag, here and, for a collection, on down.
+  virtual void _markWorldDirty() { _worldMatrixNeedsReset = true; };
+  friend class drawableCollection;
+
   void _init() {
     _position = glm::vec3(0.0f, 0.0f, 0.0f);
     _scale = glm::vec3(1.0f, 1.0f, 1.0f);
     // The glm::quat constructor initializes orientation to be zero
     // rotation by default, so need not be mentioned here.
     _modelMatrixNeedsReset = true;
+    _worldMatrixNeedsReset = true;
   };
   
  public:
@@ -642,7 +1509,10 @@ class drawableMulti {
  drawableMulti(std::string name) : _parent(0), _name(name) { _init(); };
   virtual ~drawableMulti() {};
   
-  void setParent(drawableMulti* p) { _parent = p; }
+  void setParent(drawableMulti* p) {
+    _parent = p;
+    _markWorldDirty();
+  }
 
   void setName(const std::string name) { _name = name; };
   std::string getName() { return _name; };
@@ -650,14 +1520,16 @@ class drawableMulti {
   /// \brief Calculate the model matrix.
   ///
   /// Uses the current position, rotation, and scale to calculate a
-  /// new model matrix.  There is an internal flag used to set whether
-  /// the model matrix needs to be recalculated or not.
-  glm::mat4 getModelMatrix();
+  /// new model matrix, and multiplies it by the parents'.  The result
+  /// is kept until this object or one of its parents is moved, so
+  /// asking again, or asking for a child's, costs nothing more.
+  const glm::mat4& getModelMatrix();
 
     /// \brief Set the model position using a vector.
   void setPosition(glm::vec3 position) {
     _position = position;
     _modelMatrixNeedsReset = true;
+    _markWorldDirty();
   };
   /// \brief Set the model position using three floats.
   void setPosition(GLfloat x, GLfloat y, GLfloat z) {
@@ -667,23 +1539,27 @@ class drawableMulti {
   void setScale(glm::vec3 scale) {
     _scale = scale;
     _modelMatrixNeedsReset = true;
+    _markWorldDirty();
   };
   /// \brief Set the scale using a single float, applied in three dimensions.
   void setScale(float scale) {
     _scale = glm::vec3(scale, scale, scale);
     _modelMatrixNeedsReset = true;
+    _markWorldDirty();
   };
   /// \brief Set the rotation with a quaternion.
   void setOrientation(glm::quat orientation) {
     _orientation = orientation;
     _modelMatrixNeedsReset = true;
+    _markWorldDirty();
   };
   /// \brief Set the rotation with Euler angles.
   ///
   /// Uses a 3-vector of (pitch, yaw, roll) in radians.
   void setRotation(glm::vec3 pitchYawRoll) {
-    _orientation = glm::quat(pitchYawRoll);      
+    _orientation = glm::quat(pitchYawRoll);
     _modelMatrixNeedsReset = true;
+    _markWorldDirty();
   };
 
   /// \brief Returns the vector position.
@@ -711,7 +1587,13 @@ class drawableMulti {
   /// Just executes draw() using the given view and projection matrices.
   virtual void draw(const glm::mat4 &viewMatrix,
                     const glm::mat4 &projMatrix) = 0;
-  
+
+  /// \brief Adds the object's pieces to a render queue.
+  ///
+  /// Call this after load().  By default, the object is added as a
+  /// whole, and the queue calls its draw(); drawableCompound and
+  /// drawableCollection add their pieces, so they can be sorted.
+  virtual void enqueue(renderQueue &queue);
 };
 
   
@@ -776,6 +1658,17 @@ class drawableCompound : public drawableMulti {
 
   std::string _projMatrixName;
   GLuint _projMatrixID;
+
+  /// Whether both sides of the objects are drawn.  See setTwoSided().
+  bool _twoSided;
+
+  // The render queue draws our objects, with our matrices.
+  friend class renderQueue;
+
+  /// Draws the component objects, once the shader and matrices are
+  /// set up.  A compound that draws its objects some other way, like
+  /// drawableInstances, replaces this.
+  virtual void _drawObjects();
   
  public:
  drawableCompound(bsgPtr<shaderMgr> pShader) :
@@ -785,7 +1678,8 @@ class drawableCompound : public drawableMulti {
     _modelMatrixName("modelMatrix"),
     _normalMatrixName("normalMatrix"),
     _viewMatrixName("viewMatrix"),
-    _projMatrixName("projMatrix") {
+    _projMatrixName("projMatrix"),
+    _twoSided(false) {
   };
  drawableCompound(const std::string name, bsgPtr<shaderMgr> pShader) :
   drawableMulti(name),
@@ -794,7 +1688,8 @@ class drawableCompound : public drawableMulti {
     _modelMatrixName("modelMatrix"),
     _normalMatrixName("normalMatrix"),
     _viewMatrixName("viewMatrix"),
-    _projMatrixName("projMatrix") {
+    _projMatrixName("projMatrix"),
+    _twoSided(false) {
   };
 
   /// \brief Set the name of one of the matrices.
@@ -829,8 +1724,39 @@ class drawableCompound : public drawableMulti {
     _objects.push_back(obj);
   };    
 
+  /// \brief Adds copies of another compound's objects.
+  ///
+  /// This is how a shape from the menagerie, or a model, becomes the
+  /// mesh of a drawableInstances.  Do it before either is prepared.
+  void addObjects(const drawableCompound &other) {
+    _objects.insert(_objects.end(), other._objects.begin(), other._objects.end());
+  };
+
   int getNumObjects() { return _objects.size(); };
 
+  /// \brief Draw both sides of the component objects.
+  ///
+  /// Ordinarily, when GL_CULL_FACE is enabled, triangles facing away
+  /// from the camera are not drawn.  A two-sided compound turns off
+  /// culling while it is drawn, so the back sides show too.  The
+  /// shader can use gl_FrontFacing to flip the normal for the back
+  /// side, see textureShader.fp.  This replaces keeping a second copy
+  /// of the geometry with the winding reversed and the normals
+  /// negated, at half the memory and half the draw calls.
+  void setTwoSided(const bool twoSided) { _twoSided = twoSided; };
+  bool getTwoSided() { return _twoSided; };
+
+  /// \brief Set the buffer layout of all the component objects.
+  ///
+  /// See drawableObj::setLayout().  Use this before prepare().
+  void setLayout(const GLLAYOUTTYPE layout);
+
+  /// \brief Moves and scales the texture coordinates of all the
+  /// component objects.
+  ///
+  /// See drawableObj::transformUVs().
+  void transformUVs(const glm::vec2 &offset, const glm::vec2 &scale);
+
   /// \brief Gets ready for the drawing sequence.
   ///
   void prepare();
@@ -847,7 +1773,9 @@ class drawableCompound : public drawableMulti {
   /// Just executes draw() using the given view and projection matrices.
   void draw(const glm::mat4 &viewMatrix,
             const glm::mat4 &projMatrix);
-  
+
+  /// \brief Adds each component object to the queue.
+  void enqueue(renderQueue &queue);
 };
 
 /// \brief A collection of drawable objects.
@@ -874,6 +1802,9 @@ class drawableCollection : public drawableMulti {
   /// use it here.
   typedef std::map<std::string, bsgPtr<drawableMulti> > CollectionMap;
   CollectionMap _collection;
+
+  // Moving a collection moves everything in it.
+  void _markWorldDirty();
   
  public:
   drawableCollection();
@@ -922,7 +1853,79 @@ class drawableCollection : public drawableMulti {
   /// matrices.
   void draw(const glm::mat4 &viewMatrix,
             const glm::mat4 &projMatrix);
-  
+
+  /// \brief Adds all the objects in the collection to the queue.
+  void enqueue(renderQueue &queue);
+};
+
+/// \brief One thing for a renderQueue to draw.
+class renderItem {
+ public:
+  /// What it is sorted by.
+  uint64_t key;
+  /// A component object, and the compound it belongs to...
+  drawableCompound* compound;
+  drawableObj* obj;
+  /// ... or else an object that draws itself.
+  drawableMulti* multi;
+
+ renderItem() : key(0), compound(0), obj(0), multi(0) {};
+};
+
+/// \brief The objects of a scene, sorted to be drawn with the fewest
+/// state changes.
+///
+/// Drawing the scene graph as it stands visits the objects in the
+/// order of their names, and each compound object switches to its
+/// shader, sends its lights, binds its texture, and sends all four
+/// matrices, whether or not the one before used the same ones.  A
+/// render queue instead collects every component object in the graph,
+/// sorts them by program, then texture, then buffer, so that objects
+/// that share things are drawn together, and then draws them, sending
+/// only what differs from the object before.  The view and projection
+/// matrices are sent once per program.  The bsgStats counters of
+/// program and texture switches show the difference.
+///
+/// The scene uses one of these by default, filled in load() and drawn
+/// in draw(), so that a stereo display sorts only once per frame.
+/// Since the order changes, objects that must be drawn in a certain
+/// order, like transparent ones, want scene::setUseRenderQueue(false).
+class renderQueue {
+ private:
+  std::vector<renderItem> _items;
+  // Room for sorting.
+  std::vector<renderItem> _sorted;
+
+ public:
+  /// \brief Empties the queue, for the next frame.
+  void clear() { _items.clear(); };
+
+  /// \brief Adds a component object of a compound object.
+  ///
+  /// The compound must have been loaded, since its model matrix is
+  /// used as it is when the queue is drawn.
+  void add(drawableCompound* compound, drawableObj* obj);
+
+  /// \brief Adds an object that draws itself.
+  ///
+  /// It isn't sorted with the others, and nothing is assumed about
+  /// what it leaves bound.
+  void add(drawableMulti* multi);
+
+  /// \brief Sorts the queue.
+  ///
+  /// This is a radix sort on the keys, a byte at a time, skipping the
+  /// bytes that are the same in every key.  Items with the same key
+  /// stay in the order they were added.
+  void sort();
+
+  /// \brief Draws everything in the queue.
+  ///
+  /// This can be done more than once, as for the two eyes of a stereo
+  /// display, without sorting again.
+  void draw(const glm::mat4 &viewMatrix, const glm::mat4 &projMatrix);
+
+  size_t size() { return _items.size(); };
 };
  
 /// \brief A collection of drawableCompound objects that make up a
@@ -936,6 +1939,10 @@ class scene {
  private:
 
   drawableCollection _sceneRoot;
+
+  // The objects to draw, sorted, filled by load().
+  renderQueue _queue;
+  bool _useRenderQueue;
   
   glm::mat4 _viewMatrix;
   glm::mat4 _projMatrix;
@@ -956,6 +1963,7 @@ class scene {
     _aspect = 1.0f;
     _nearClip = 0.1f;
     _farClip = 100.0f;
+    _useRenderQueue = true;
   }
 
   void setCameraPosition(const glm::vec3 cameraPosition) {
@@ -1000,6 +2008,14 @@ class scene {
   /// member compound elements.
   void prepare();
 
+  /// \brief Choose whether to draw through a renderQueue.
+  ///
+  /// With the queue, the default, the objects are drawn sorted by
+  /// program and texture.  Without, they are drawn in the order of
+  /// the scene graph.
+  void setUseRenderQueue(const bool use) { _useRenderQueue = use; };
+  bool getUseRenderQueue() { return _useRenderQueue; };
+
   /// \brief Generates a projection matrix.
   ///
   /// From the field of view and clip planes.  For use in desktop and
@@ -1014,6 +2030,12 @@ class scene {
   glm::mat4 getViewMatrix();
   
   /// \brief Loads all the compound elements.
+  ///
+  /// This is the start of a frame, so the bsgStats counters are reset
+  /// here.  Textures that have been decoded in the background are
+  /// sent to OpenGL here too; see textureLoader.  And unused cached
+  /// textures are deleted; see textureCache.  The render queue is
+  /// filled and sorted here, too.
   void load();
   
   /// \brief Generates a view matrix and draws all the compound elements.
@@ -0,0 +1,137 @@
+#include "bsgInstances.h"
+
+namespace bsg {
+
+drawableInstances::drawableInstances(bsgPtr<shaderMgr> pShader) :
+  drawableCompound(pShader), _mode(GLINSTANCE_ARRAYS), _batchSize(1) {}
+
+drawableInstances::drawableInstances(bsgPtr<shaderMgr> pShader,
+                                     const GLINSTANCETYPE mode) :
+  drawableCompound(pShader), _mode(mode), _batchSize(1) {}
+
+GLINSTANCETYPE drawableInstances::getBestMode() {
+  if (GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced)
+    return GLINSTANCE_ARRAYS;
+  if (GLEW_ARB_draw_instanced) return GLINSTANCE_UNIFORMS;
+  return GLINSTANCE_SINGLE;
+}
+
+void drawableInstances::_setMode() {
+
+  // Asking for more than the card can do gets what it can.
+  _mode = std::max(_mode, getBestMode());
+  _batchSize = 1;
+
+  // A shader set up by hand for some other mode would end up with
+  // two, and a shader that doesn't compile.
+  if (((_mode != GLINSTANCE_ARRAYS) && _pShader->hasDefine("BSG_INSTANCE_ARRAYS")) ||
+      ((_mode != GLINSTANCE_UNIFORMS) && _pShader->hasDefine("BSG_INSTANCE_BATCH")) ||
+      ((_mode != GLINSTANCE_SINGLE) && _pShader->hasDefine("BSG_INSTANCE_SINGLE"))) {
+    throw std::runtime_error("drawableInstances: The shader already has a different instancing mode defined.");
+  }
+
+  // The mode goes into a copy of the shader, so the one given, and
+  // whatever else is drawn with it, are left alone.
+  _pShader = _pShader->makeVariant();
+
+  switch (_mode) {
+  case GLINSTANCE_ARRAYS:
+    _instances.name = "instanceMatrix";
+    _pShader->addDefine("BSG_INSTANCE_ARRAYS");
+    break;
+
+  case GLINSTANCE_UNIFORMS: {
+    // Each matrix takes 16 of the vertex shader's uniform components.
+    // OpenGL 2.1 promises only 512, and the shader needs some for its
+    // other uniforms.
+    GLint maxComponents = 512;
+    glGetIntegerv(GL_MAX_VERTEX_UNIFORM_COMPONENTS, &maxComponents);
+    _batchSize = std::max(1, std::min(128, (maxComponents - 256) / 16));
+
+    std::stringstream batch;
+    batch << _batchSize;
+    _instances.name = "instanceMatrices";
+    _pShader->addDefine("BSG_INSTANCE_BATCH", batch.str());
+    break;
+  }
+
+  case GLINSTANCE_SINGLE:
+    _instances.name = "instanceMatrices";
+    _pShader->addDefine("BSG_INSTANCE_SINGLE");
+    break;
+  }
+
+  _pShader->compileShaders();
+}
+
+int drawableInstances::addInstance(const glm::mat4 &matrix) {
+  _instances.addData(matrix);
+  return _instances.getData().size() - 1;
+}
+
+void drawableInstances::prepare() {
+
+  _setMode();
+  drawableCompound::prepare();
+
+  if (_mode == GLINSTANCE_ARRAYS) {
+    glGenBuffers(1, &_instances.bufferID);
+    _instances.ID = _pShader->getAttribID(_instances.name);
+  } else {
+    _instances.ID = _pShader->getUniformID(_instances.name);
+  }
+
+  if (_instances.ID < 0) {
+    std::cerr << "** Caution: The shader has no '" << _instances.name
+              << "'; see instanceShader.vp." << std::endl;
+  }
+}
+
+void drawableInstances::load() {
+
+  drawableCompound::load();
+
+  // Only the arrays mode keeps the matrices in a buffer; the others
+  // send them as they draw.
+  if (_mode == GLINSTANCE_ARRAYS) {
+    _instances.load();
+  } else {
+    _instances.markClean();
+  }
+}
+
+void drawableInstances::_drawObjects() {
+
+  const std::vector<glm::mat4> &matrices = _instances.getData();
+  GLsizei nInstances = matrices.size();
+  if ((nInstances == 0) || (_instances.ID < 0)) return;
+
+  switch (_mode) {
+  case GLINSTANCE_ARRAYS:
+    for (std::list<drawableObj>::iterator it = _objects.begin();
+         it != _objects.end(); it++) {
+      it->drawInstanced(nInstances, _instances.ID, _instances.bufferID);
+    }
+    break;
+
+  case GLINSTANCE_UNIFORMS:
+  case GLINSTANCE_SINGLE:
+    // A batch of matrices, and then every object for that batch.
+    for (GLsizei first = 0; first < nInstances; first += _batchSize) {
+      GLsizei count = std::min(_batchSize, nInstances - first);
+      glUniformMatrix4fv(_instances.ID, count, false, &matrices[first][0][0]);
+
+      for (std::list<drawableObj>::iterator it = _objects.begin();
+           it != _objects.end(); it++) {
+        if (_mode == GLINSTANCE_UNIFORMS) {
+          it->drawInstanced(count);
+        } else {
+          it->draw();
+        }
+      }
+    }
+    break;
+  }
+}
+
+}
@@ -0,0 +1,111 @@
+#include "bsg.h"
+
+namespace bsg {
+
+typedef enum {
+  GLINSTANCE_ARRAYS   = 0,
+  GLINSTANCE_UNIFORMS = 1,
+  GLINSTANCE_SINGLE   = 2
+} GLINSTANCETYPE;
+
+/// \brief Many copies of one shape, drawn together.
+///
+/// A scene with the same tree or tile or marker in it thousands of
+/// times would otherwise have thousands of compound objects, each
+/// with its own draw calls and matrix uploads.  This is one compound
+/// object, with one set of buffers, and a list of matrices, one per
+/// copy, and it draws all the copies at once.  Each copy's matrix is
+/// applied first, then the model matrix of the whole, so moving the
+/// whole moves every copy.
+///
+/// How the copies are drawn depends on the graphics card:
+///
+///  - GLINSTANCE_ARRAYS: The matrices are kept in a buffer, and the
+///    shader gets its copy's as an attribute.  Each object is one
+///    draw call for all the copies.  This takes ARB_instanced_arrays
+///    and ARB_draw_instanced.
+///
+///  - GLINSTANCE_UNIFORMS: The matrices are sent as a uniform array,
+///    a batch at a time, and the copies in a batch are one draw call.
+///    This takes ARB_draw_instanced.
+///
+///  - GLINSTANCE_SINGLE: Each copy is drawn by itself, with its matrix
+///    sent as a uniform.  This works anywhere, and still skips the
+///    work a compound object per copy would do.
+///
+/// The best one available is used, unless a worse one is asked for;
+/// the choice is made in prepare(), when there is an OpenGL context to
+/// ask.  The shader has to be written for this; instanceShader.vp is
+/// textureShader.vp adapted, and shows how.  The mode is passed to the
+/// shader as a #define, in a copy of the shader made and compiled in
+/// prepare() (see shaderMgr::makeVariant()), so the shader given is
+/// left alone, and other objects can be drawn with it as usual.
+/// Add its lights and texture before prepare(), so the copy has them:
+///
+///     shader->addShader(bsg::GLSHADER_VERTEX, "instanceShader.vp");
+///     shader->addShader(bsg::GLSHADER_FRAGMENT, "textureShader.fp");
+///     bsg::drawableObjModel tree(shader, "tree.obj");
+///     bsg::bsgPtr<bsg::drawableInstances> forest =
+///       new bsg::drawableInstances(shader);
+///     forest->addObjects(tree);
+///     for (...) forest->addInstance(glm::translate(glm::mat4(1.0f), where));
+///     bsg::shaderMgr::compileAll();
+///     scene.addObject(forest);
+///
+/// The copies are drawn in the order added, and aren't sorted or
+/// culled, so all of them cost something, even out of sight.
+class drawableInstances : public drawableCompound {
+ private:
+  GLINSTANCETYPE _mode;
+  // How many matrices are sent at a time, with GLINSTANCE_UNIFORMS.
+  int _batchSize;
+
+  // The matrices, one per copy.  The ID is of the attribute, or of
+  // the uniform array, depending on the mode.
+  drawableObjData<glm::mat4> _instances;
+
+  // Settles the mode, and makes and compiles the shader for it.
+  void _setMode();
+  void _drawObjects();
+
+ public:
+  drawableInstances(bsgPtr<shaderMgr> pShader);
+  drawableInstances(bsgPtr<shaderMgr> pShader, const GLINSTANCETYPE mode);
+
+  /// \brief The best mode this graphics card can do.
+  static GLINSTANCETYPE getBestMode();
+  /// The mode asked for, until prepare(), and then the one used.
+  GLINSTANCETYPE getMode() { return _mode; };
+
+  /// \brief Adds a copy, placed by the given matrix.
+  ///
+  /// Returns its index, for setInstance().
+  int addInstance(const glm::mat4 &matrix);
+
+  /// \brief Adds a copy at the given position, with no rotation.
+  int addInstance(const glm::vec3 &position) {
+    return addInstance(glm::translate(glm::mat4(1.0f), position));
+  };
+
+  /// \brief Moves a copy.
+  ///
+  /// Only the changed matrices are sent, in the next load().
+  void setInstance(const int index, const glm::mat4 &matrix) {
+    _instances.setData(index, matrix);
+  };
+
+  /// \brief Replaces all the copies.
+  void setInstances(const std::vector<glm::mat4> &matrices) {
+    _instances.setData(matrices);
+  };
+
+  size_t getNumInstances() { return _instances.getData().size(); };
+
+  void prepare();
+  void load();
+
+  /// \brief The copies are drawn by this object, not a render queue.
+  void enqueue(renderQueue &queue) { queue.add(this); };
+};
+
+}
@@ -17,10 +17,6 @@ namespace bsg {
     std::vector<glm::vec4> frontFaceColors = std::vector<glm::vec4>(nEntries);
     std::vector<glm::vec4> frontFaceNormals = std::vector<glm::vec4>(nEntries);
     std::vector<glm::vec2> frontFaceUVs = std::vector<glm::vec2>(nEntries);
-    std::vector<glm::vec4> backFaceVertices = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec4> backFaceColors = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec4> backFaceNormals = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec2> backFaceUVs = std::vector<glm::vec2>(nEntries);
 
     for (int j = 0; j < nDivs; j++) {
       for (int i = 0; i <= nDivs; i++) {
@@ -38,20 +34,6 @@ namespace bsg {
                                     0.0 + (i * 1.0/nDivs));
         frontFaceUVs[k + 1] = glm::vec2(((j + 1) * 1.0/nDivs),
                                         0.0 + (i * 1.0/nDivs));
-        
-        backFaceVertices[k] = glm::vec4(-w + ((j + 1) * wdiv),
-                                        -h + (i * hdiv), 0.0f, 1.0f);
-        backFaceVertices[k + 1] = glm::vec4(-w + (j * wdiv),
-                                            -h + (i * hdiv), 0.0f, 1.0f);
-        backFaceColors[k] = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-        backFaceColors[k + 1] = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
-        backFaceNormals[k] = glm::vec4(0.0f, 0.0f,-1.0f, 0.0f);
-        backFaceNormals[k + 1] = glm::vec4(0.0f, 0.0f,-1.0f, 0.0f);
-        backFaceUVs[k] = glm::vec2(((j + 1) * 1.0/nDivs),
-                                   0.0 + (i * 1.0/nDivs));
-        backFaceUVs[k + 1] = glm::vec2(0.0 + (j * 1.0/nDivs),
-                                       0.0 + (i * 1.0/nDivs));
-
       }
       
       _frontFace.addData(bsg::GLDATA_VERTICES, "position", frontFaceVertices);
@@ -60,15 +42,11 @@ namespace bsg {
       _frontFace.addData(bsg::GLDATA_TEXCOORDS, "texture", frontFaceUVs);
       _frontFace.setDrawType(GL_TRIANGLE_STRIP, frontFaceVertices.size());  
 
-      _backFace.addData(bsg::GLDATA_VERTICES, "position", backFaceVertices);
-      _backFace.addData(bsg::GLDATA_COLORS, "color", backFaceColors);
-      _backFace.addData(bsg::GLDATA_NORMALS, "normal", backFaceNormals);
-      _backFace.addData(bsg::GLDATA_TEXCOORDS, "texture", backFaceUVs);
-      _backFace.setDrawType(GL_TRIANGLE_STRIP, backFaceVertices.size());  
-
       addObject(_frontFace);
-      addObject(_backFace);
     }
+
+    // The back of the rectangle is drawn with the same strips.
+    setTwoSided(true);
   }
     
   drawableRectangle::drawableRectangle(bsgPtr<shaderMgr> pShader,
@@ -117,48 +95,10 @@ namespace bsg {
     // The vertices above are arranged into a set of triangles.
     _frontFace.setDrawType(GL_TRIANGLE_STRIP);  
 
-    // Same thing for the other rectangle.
-    std::vector<glm::vec4> backFaceVertices;
-
-    backFaceVertices.push_back(glm::vec4( -w, -h, 0.0f, 1.0f));
-    backFaceVertices.push_back(glm::vec4( -w,  h, 0.0f, 1.0f));
-    backFaceVertices.push_back(glm::vec4(  w, -h, 0.0f, 1.0f));
-    backFaceVertices.push_back(glm::vec4(  w,  h, 0.0f, 1.0f));
-
-    _backFace.addData(bsg::GLDATA_VERTICES, "position", backFaceVertices);
-
-    // And the corresponding colors for the above vertices.
-    std::vector<glm::vec4> backFaceColors;
-    backFaceColors.push_back(glm::vec4( 1.0f, 1.0f, 1.0f, 1.0f));
-    backFaceColors.push_back(glm::vec4( 0.0f, 1.0f, 0.0f, 1.0f));
-    backFaceColors.push_back(glm::vec4( 1.0f, 0.0f, 0.0f, 1.0f));
-    backFaceColors.push_back(glm::vec4( 0.0f, 0.0f, 1.0f, 1.0f));
-
-    _backFace.addData(bsg::GLDATA_COLORS, "color", backFaceColors);
-
-    std::vector<glm::vec4> backFaceNormals;
-
-    backFaceNormals.push_back(glm::vec4( 0.0f, 0.0f,-1.0f, 0.0f));
-    backFaceNormals.push_back(glm::vec4( 0.0f, 0.0f,-1.0f, 0.0f));
-    backFaceNormals.push_back(glm::vec4( 0.0f, 0.0f,-1.0f, 0.0f));
-    backFaceNormals.push_back(glm::vec4( 0.0f, 0.0f,-1.0f, 0.0f));
-
-    _backFace.addData(bsg::GLDATA_NORMALS, "normal", backFaceNormals);
-
-    std::vector<glm::vec2> backFaceUVs;
-
-    backFaceUVs.push_back(glm::vec2( 0.0f, 0.0f));
-    backFaceUVs.push_back(glm::vec2( 0.0f, 1.0f));
-    backFaceUVs.push_back(glm::vec2( 1.0f, 0.0f));
-    backFaceUVs.push_back(glm::vec2( 1.0f, 1.0f));
-
-    _backFace.addData(bsg::GLDATA_TEXCOORDS, "texture", backFaceUVs);
-    
-    // The vertices above are arranged into a set of triangles.
-    _backFace.setDrawType(GL_TRIANGLE_STRIP);  
-
     addObject(_frontFace);
-    addObject(_backFace);
+
+    // The back of the rectangle is drawn with the same triangles.
+    setTwoSided(true);
   }
 
   drawableAxes::drawableAxes(bsgPtr<shaderMgr> pShader, const float length) :
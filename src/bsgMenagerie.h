@@ -7,7 +7,7 @@ class drawableRectangle : public drawableCompound {
 
   float _width, _height;
 
-  drawableObj _frontFace, _backFace;
+  drawableObj _frontFace;
 
  public:
   drawableRectangle(bsgPtr<shaderMgr> pShader,
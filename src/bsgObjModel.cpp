@@ -1,200 +1,1143 @@
 #include "bsgObjModel.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <functional>
+#include <sstream>
+#include <stdint.h>
 
 namespace bsg {
 
-  drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string& fileName) :
-    drawableCompound(pShader), _fileName(fileName){
+  // A hash table from a triple of ints to a sequence number, used to
+  // find the distinct (position, texture, normal) combinations in a
+  // face list.  It uses open addressing in flat arrays, so there is
+  // no allocation per entry, and it never shrinks or deletes.  The
+  // capacity must be given up front, and must be at least the number
+  // of distinct triples that will be inserted.
+  class tripleIndex {
+  private:
+    std::vector<int> _keys;
+    std::vector<GLuint> _values;
+    size_t _mask;
+    GLuint _count;
 
-    std::vector<float> vert_list;
-    std::vector<float> normal_list;
-    std::vector<float> uv_list;
-    std::vector<int> front_face_list;
-    std::vector<int> back_face_list;
-
-    std::ifstream fileObject(_fileName.c_str(), std::ios::in);
-    std::string fileObjectLine;
-
-    if (fileObject.is_open()) {
-        while (! fileObject.eof() ){
-            getline(fileObject, fileObjectLine);
-            //std::cout << fileObjectLine << std::endl;
-            if (fileObjectLine.c_str()[0] == 'v'){
-                if (fileObjectLine.c_str()[1] == ' '){
-
-                    float x, y, z;
-                    fileObjectLine[0] = ' ';						
-                    sscanf(fileObjectLine.c_str(),"%f %f %f ", &x, &y, &z);		
-                    vert_list.push_back(x);						
-                    vert_list.push_back(y);						
-                    vert_list.push_back(z);
-                }
-
-                if (fileObjectLine.c_str()[1] == 'n'){
-                    float nx, ny, nz;
-                    fileObjectLine[0] = ' ';
-                    fileObjectLine[1] = ' ';
-                    sscanf(fileObjectLine.c_str(),"%f %f %f ", &nx, &ny, &nz);		
-                    normal_list.push_back(nx);						
-                    normal_list.push_back(ny);
-                    normal_list.push_back(nz);
-                }
-
-                if (fileObjectLine.c_str()[1] == 't'){
-                    float u, v;
-                    fileObjectLine[0] = ' ';
-                    fileObjectLine[1] = ' ';
-                    sscanf(fileObjectLine.c_str(),"%f %f", &u, &v);
-                    uv_list.push_back(u);
-                    uv_list.push_back(v);
-                }
+  public:
+    tripleIndex(const size_t capacity) : _count(0) {
+      size_t size = 16;
+      while (size < 2 * capacity) size *= 2;
+      _mask = size - 1;
+      _keys.resize(3 * size);
+      _values.resize(size, ~0u);
+    };
 
-            }
-            if (fileObjectLine.c_str()[0] == 'f'){				
-                int v1, vn1=0, vt1=0, v2, vn2=0, vt2=0, v3, vn3=0, vt3, v4=0, vn4=0, vt4=0;
-
-        char temp[20] = "";
-                fileObjectLine[0] = ' ';
-                std::size_t numSlash = std::count(fileObjectLine.begin(), fileObjectLine.end(), '/');
-		std::size_t doubleSlash = fileObjectLine.find("//");
-		if (numSlash == 0) {
-            sscanf(fileObjectLine.c_str(),"%d %d %d %s", &v1, &v2, &v3, temp);
-			if (!temp[0] == 0) {
-				sscanf(temp, "%d", &v4);
-			}
-
-		} else if (numSlash == 3) {
-
-			sscanf(fileObjectLine.c_str(),"%d/%d %d/%d %d/%d", &v1, &vt1, &v2, &vt2, &v3, &vt3);
-		} else if (numSlash == 4) {
-			sscanf(fileObjectLine.c_str(),"%d/%d %d/%d %d/%d %d/%d", &v1, &vt1, &v2, &vt2, &v3, &vt3, &v4, &vt4);
-		} else if (numSlash == 6) {
-			if (doubleSlash == -1){
-				sscanf(fileObjectLine.c_str(),"%d/%d/%d %d/%d/%d %d/%d/%d", &v1, &vt1, &vn1, &v2, &vt2, &vn2, &v3, &vt3, &vn3);
-			} else {
-				sscanf(fileObjectLine.c_str(),"%d//%d %d//%d %d//%d", &v1, &vn1, &v2, &vn2, &v3, &vn3);
-			}
-		} else if (numSlash == 8) {
-			if (doubleSlash == -1){
-				sscanf(fileObjectLine.c_str(),"%d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d", &v1, &vt1, &vn1, &v2, &vt2, &vn2, &v3, &vt3, &vn3, &v4, &vt4, &vn4);
-			} else {
-				sscanf(fileObjectLine.c_str(),"%d//%d %d//%d %d//%d %d//%d", &v1, &vn1, &v2, &vn2, &v3, &vn3, &v4, &vn4);
-			}
-		}		
-                		
-                front_face_list.push_back(v1-1);				
-                front_face_list.push_back(vn1-1);					
-                front_face_list.push_back(vt1-1);
-                front_face_list.push_back(v2-1);					
-                front_face_list.push_back(vn2-1);					
-                front_face_list.push_back(vt2-1);
-                front_face_list.push_back(v3-1);					
-                front_face_list.push_back(vn3-1);				
-                front_face_list.push_back(vt3-1);
-
-		back_face_list.push_back(v1-1);					
-                back_face_list.push_back(vn1-1);					
-                back_face_list.push_back(vt1-1);
-                back_face_list.push_back(v3-1);						
-                back_face_list.push_back(vn3-1);			
-                back_face_list.push_back(vt3-1);
-                back_face_list.push_back(v2-1);				
-                back_face_list.push_back(vn2-1);				
-                back_face_list.push_back(vt2-1);
-
-
-		if (!temp[0] == 0 || numSlash == 4 || numSlash == 8) {
-
-			front_face_list.push_back(v1-1);				
-		        front_face_list.push_back(vn1-1);			
-		        front_face_list.push_back(vt1-1);
-		        front_face_list.push_back(v3-1);			
-		        front_face_list.push_back(vn3-1);		
-		        front_face_list.push_back(vt3-1);
-		        front_face_list.push_back(v4-1);			
-		        front_face_list.push_back(vn4-1);				
-		        front_face_list.push_back(vt4-1);
-
-			back_face_list.push_back(v1-1);				
-		        back_face_list.push_back(vn1-1);				
-		        back_face_list.push_back(vt1-1);
-		        back_face_list.push_back(v4-1);					
-		        back_face_list.push_back(vn4-1);		
-		        back_face_list.push_back(vt4-1);
-		        back_face_list.push_back(v3-1);				
-		        back_face_list.push_back(vn3-1);		
-		        back_face_list.push_back(vt3-1);
-		}
-            }
+    /// \brief Look up a triple.
+    ///
+    /// If the triple has been seen before, returns the number it was
+    /// given then.  Otherwise it gets the next number in sequence.
+    GLuint insert(const int a, const int b, const int c) {
+
+      size_t h = ((size_t)(unsigned)a * 73856093u) ^
+        ((size_t)(unsigned)b * 19349663u) ^ ((size_t)(unsigned)c * 83492791u);
+
+      for (h &= _mask; _values[h] != ~0u; h = (h + 1) & _mask) {
+        if ((_keys[3 * h] == a) && (_keys[3 * h + 1] == b) &&
+            (_keys[3 * h + 2] == c)) return _values[h];
+      }
+
+      _keys[3 * h] = a;
+      _keys[3 * h + 1] = b;
+      _keys[3 * h + 2] = c;
+      return _values[h] = _count++;
+    };
+
+    GLuint size() { return _count; };
+  };
+
+  // The bits of a float, for hashing.
+  static int floatBits(const float f) {
+    int out;
+    memcpy(&out, &f, sizeof(int));
+    return out;
+  }
+
+  // The OBJ parser.  It works on one block of text, usually the whole
+  // file mapped into memory, and walks it with a pointer.  Numbers are
+  // scanned by hand, since sscanf and strtod are much slower than the
+  // rest of the job, and nothing is allocated per line.
+
+  // Spaces and tabs separate the fields of a record.
+  static inline const char* skipSpace(const char* p, const char* end) {
+    while ((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+    return p;
+  }
+
+  // Returns the start of the next line.
+  static inline const char* skipLine(const char* p, const char* end) {
+    const char* newline = (const char*)memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+  }
+
+  static inline bool isDigit(const char c) {
+    return (c >= '0') && (c <= '9');
+  }
+
+  // Is this the end of the useful part of a record?
+  static inline bool isEndOfRecord(const char* p, const char* end) {
+    return (p == end) || (*p == '\n') || (*p == '\r') || (*p == '#');
+  }
+
+  // Scans an integer, with an optional sign.  Returns the position
+  // after it, or p itself if there is no integer there.
+  static const char* scanInt(const char* p, const char* end, int& out) {
+
+    const char* q = p;
+    bool negative = false;
+    if ((q < end) && ((*q == '-') || (*q == '+'))) {
+      negative = (*q == '-');
+      q++;
+    }
+
+    if ((q == end) || !isDigit(*q)) return p;
+
+    int value = 0;
+    while ((q < end) && isDigit(*q)) value = 10 * value + (*q++ - '0');
+
+    out = negative ? -value : value;
+    return q;
+  }
+
+  // Scans a floating point number, in the usual decimal notation with
+  // an optional exponent.  The digits are gathered into an integer,
+  // and then scaled by one multiply or divide, which is correctly
+  // rounded to double when there are fewer than 16 significant digits
+  // and the exponent is modest.  That is then rounded again to float,
+  // so once in a great while the result is one bit off from what
+  // strtof() would give.  Anything else (very long numbers, "nan",
+  // "inf") goes to strtod.  Returns the position after the number, or
+  // p itself if there is no number there.
+  static const char* scanFloat(const char* p, const char* end, float& out) {
+
+    static const double powersOfTen[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    const char* q = p;
+    bool negative = false;
+    if ((q < end) && ((*q == '-') || (*q == '+'))) {
+      negative = (*q == '-');
+      q++;
+    }
+
+    unsigned long long mantissa = 0;
+    int nSignificant = 0;
+    int nDigits = 0;
+    int exponent = 0;
+
+    for (; (q < end) && isDigit(*q); q++, nDigits++) {
+      if (mantissa || (*q != '0')) nSignificant++;
+      if (nSignificant <= 18) {
+        mantissa = 10 * mantissa + (*q - '0');
+      } else {
+        exponent++;
+      }
+    }
+
+    if ((q < end) && (*q == '.')) {
+      for (q++; (q < end) && isDigit(*q); q++, nDigits++) {
+        if (mantissa || (*q != '0')) nSignificant++;
+        if (nSignificant <= 18) {
+          mantissa = 10 * mantissa + (*q - '0');
+          exponent--;
         }
+      }
     }
 
-    int nEntries = front_face_list.size()/3;
+    if (nDigits > 0 && (q < end) && ((*q == 'e') || (*q == 'E'))) {
+      int e;
+      const char* r = scanInt(q + 1, end, e);
+      if (r != q + 1) {
+        exponent += e;
+        q = r;
+      }
+    }
 
-    std::vector<glm::vec4> frontFaceVertices = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec4> frontFaceColors = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec4> frontFaceNormals = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec2> frontFaceUVs = std::vector<glm::vec2>(nEntries);
-    std::vector<glm::vec4> backFaceVertices = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec4> backFaceColors = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec4> backFaceNormals = std::vector<glm::vec4>(nEntries);
-    std::vector<glm::vec2> backFaceUVs = std::vector<glm::vec2>(nEntries);
+    if ((nDigits > 0) && (nSignificant <= 15) &&
+        (exponent >= -22) && (exponent <= 22)) {
+      double value = (double)mantissa;
+      if (exponent < 0) {
+        value /= powersOfTen[-exponent];
+      } else {
+        value *= powersOfTen[exponent];
+      }
+      out = (float)(negative ? -value : value);
+      return q;
+    }
 
-    for(int i=0; i < front_face_list.size(); i+=3) {
+    // The slow way.  The text isn't null-terminated, so copy the
+    // number out first.
+    char buffer[64];
+    size_t length = 0;
+    for (q = p; (q < end) && (length < sizeof(buffer) - 1) &&
+           (*q != ' ') && (*q != '\t') && (*q != '\r') && (*q != '\n');
+         q++) {
+      buffer[length++] = *q;
+    }
+    buffer[length] = '\0';
 
-        int iv = front_face_list[i]*3;
-        frontFaceVertices[i/3] = glm::vec4(vert_list[iv], vert_list[iv+1], vert_list[iv+2], 1.0f);
-        iv = back_face_list[i]*3;
+    char* stop;
+    double value = strtod(buffer, &stop);
+    if (stop == buffer) return p;
 
-        backFaceVertices[i/3] = (glm::vec4(vert_list[iv], vert_list[iv+1], vert_list[iv+2], 1.0f));
+    out = (float)value;
+    return p + (stop - buffer);
+  }
 
-            int ivn = front_face_list[i+1]*3;
-        if (ivn > -1) {
-            frontFaceNormals[i/3] = (glm::vec4(normal_list[ivn], normal_list[ivn+1], normal_list[ivn+2], 1.0f));
-            ivn = back_face_list[i+1]*3;
-            backFaceNormals[i/3] = (glm::vec4(-normal_list[ivn], -normal_list[ivn+1], -normal_list[ivn+2], 1.0f));
-        } else {
-            if (i%9 == 6) {
-                glm::vec3 a = glm::vec3(frontFaceVertices[(i/3)-2]) - glm::vec3(frontFaceVertices[(i/3)-1]);
-                glm::vec3 b = glm::vec3(frontFaceVertices[(i/3)-2]) - glm::vec3(frontFaceVertices[(i/3)]);
-                glm::vec3 normal = glm::normalize(glm::cross(a,b));
-                glm::vec4 n4 = glm::vec4(normal, 1.0f);
-                frontFaceNormals[i/3-2] = (n4);
-                frontFaceNormals[i/3-1] = (n4);
-                frontFaceNormals[i/3] = (n4);
-                backFaceNormals[i/3-2] = (-n4);
-                backFaceNormals[i/3-1] = (-n4);
-                backFaceNormals[i/3] = (-n4);
+  // Scans up to n floats from a record into the list, and fills any
+  // that are missing with zeros.
+  static const char* scanFloats(const char* p, const char* end, const int n,
+                                std::vector<float>& list) {
+    for (int i = 0; i < n; i++) {
+      float value = 0.0f;
+      p = scanFloat(skipSpace(p, end), end, value);
+      list.push_back(value);
+    }
+    return p;
+  }
+
+  // Does the record at p start with this keyword?
+  static inline bool isKeyword(const char* p, const char* end,
+                               const char* keyword) {
+    size_t length = strlen(keyword);
+    return ((size_t)(end - p) > length) && (memcmp(p, keyword, length) == 0) &&
+      ((p[length] == ' ') || (p[length] == '\t'));
+  }
+
+  // Returns the rest of the record, trimmed, for names, which may have
+  // spaces in them.
+  static std::string restOfRecord(const char* p, const char* end) {
+    p = skipSpace(p, end);
+    const char* q = p;
+    while ((q < end) && (*q != '\n') && (*q != '\r')) q++;
+    while ((q > p) && ((q[-1] == ' ') || (q[-1] == '\t'))) q--;
+    return std::string(p, q);
+  }
+
+  // Turns an index from the file into one counting from zero.  OBJ
+  // indices count from one, and negative ones count back from the
+  // most recent record of that type.  Zero means missing.  A negative
+  // index reaching back past the first record comes out negative, and
+  // is caught in objMesh::build(), but never as objFileData::missing.
+  static inline int resolveIndex(const int index, const size_t count) {
+    if (index > 0) return index - 1;
+    if (index < 0) return std::max((int)count + index, objFileData::missing + 1);
+    return objFileData::missing;
+  }
+
+  // Parses the records in [p, end) onto the end of the data.  A
+  // negative index is resolved against what is already in the data,
+  // and where it lands in the corner list is added to 'relative', so
+  // that a chunk parsed on its own can be fixed up later, once we know
+  // how many records came before it.
+  static void parseRecords(const char* p, const char* end, objFileData& data,
+                           std::vector<size_t>& relative) {
+
+    // One polygon corner: position, normal, texture, and a bit for
+    // each of those that was given as a negative index.
+    int first[4], previous[4], corner[4];
+
+    while (p < end) {
+
+      p = skipSpace(p, end);
+      if (p == end) break;
+
+      if ((p[0] == 'v') && (p + 1 < end)) {
+
+        if ((p[1] == ' ') || (p[1] == '\t')) {
+          p = scanFloats(p + 1, end, 3, data.positions);
+        } else if ((p[1] == 'n') && (p + 2 < end) &&
+                   ((p[2] == ' ') || (p[2] == '\t'))) {
+          p = scanFloats(p + 2, end, 3, data.normals);
+        } else if ((p[1] == 't') && (p + 2 < end) &&
+                   ((p[2] == ' ') || (p[2] == '\t'))) {
+          p = scanFloats(p + 2, end, 2, data.uvs);
+        }
+
+      } else if ((p[0] == 'f') && (p + 1 < end) &&
+                 ((p[1] == ' ') || (p[1] == '\t'))) {
+
+        // Each corner is v, v/vt, v//vn, or v/vt/vn.
+        int nCorners = 0;
+        p = skipSpace(p + 1, end);
+        while (!isEndOfRecord(p, end)) {
+
+          int v = 0, vt = 0, vn = 0;
+          const char* q = scanInt(p, end, v);
+          if (q == p) break;
+          if ((q < end) && (*q == '/')) {
+            q = scanInt(q + 1, end, vt);
+            if ((q < end) && (*q == '/')) q = scanInt(q + 1, end, vn);
+          }
+          p = skipSpace(q, end);
+
+          corner[0] = resolveIndex(v, data.positions.size() / 3);
+          corner[1] = resolveIndex(vn, data.normals.size() / 3);
+          corner[2] = resolveIndex(vt, data.uvs.size() / 2);
+          corner[3] = (v < 0) | ((vn < 0) << 1) | ((vt < 0) << 2);
+
+          if (nCorners == 0) {
+            memcpy(first, corner, sizeof(corner));
+          } else if (nCorners >= 2) {
+            int* triangle[3] = { first, previous, corner };
+            for (int i = 0; i < 3; i++) {
+              for (int j = 0; j < 3; j++) {
+                if (triangle[i][3] & (1 << j)) relative.push_back(data.corners.size() + j);
+              }
+              data.corners.insert(data.corners.end(), triangle[i], triangle[i] + 3);
             }
+          }
+          memcpy(previous, corner, sizeof(corner));
+          nCorners++;
+        }
+
+        if (nCorners >= 3) data.nFaces++;
+
+      } else if (isKeyword(p, end, "usemtl")) {
+        data.materialUses.push_back(std::make_pair(restOfRecord(p + 6, end),
+                                                   data.corners.size() / 9));
+      } else if (isKeyword(p, end, "mtllib")) {
+        // There may be several files, separated by spaces.
+        p = skipSpace(p + 6, end);
+        while (!isEndOfRecord(p, end)) {
+          const char* q = p;
+          while ((q < end) && (*q != ' ') && (*q != '\t') &&
+                 (*q != '\n') && (*q != '\r')) q++;
+          data.materialLibraries.push_back(std::string(p, q));
+          p = skipSpace(q, end);
         }
+      }
+
+      p = skipLine(p, end);
+    }
+  }
+
+  // A piece of a file being parsed in parallel, and where its results
+  // go in the whole.
+  struct objChunk {
+    const char* begin;
+    const char* end;
+    objFileData data;
+    std::vector<size_t> relative;
+
+    size_t positionOffset, normalOffset, uvOffset, cornerOffset;
+  };
+
+  static void parseChunk(objChunk* chunk) {
+    parseRecords(chunk->begin, chunk->end, chunk->data, chunk->relative);
+  }
+
+  // Copies a parsed chunk into its place in the whole, and moves its
+  // negative indices up by the number of records before it.
+  static void placeChunk(objChunk* chunk, objFileData* out) {
+
+    objFileData& data = chunk->data;
+    std::copy(data.positions.begin(), data.positions.end(),
+              out->positions.begin() + chunk->positionOffset);
+    std::copy(data.normals.begin(), data.normals.end(),
+              out->normals.begin() + chunk->normalOffset);
+    std::copy(data.uvs.begin(), data.uvs.end(),
+              out->uvs.begin() + chunk->uvOffset);
+    std::copy(data.corners.begin(), data.corners.end(),
+              out->corners.begin() + chunk->cornerOffset);
+
+    int base[3] = { (int)(chunk->positionOffset / 3),
+                    (int)(chunk->normalOffset / 3),
+                    (int)(chunk->uvOffset / 2) };
+    for (std::vector<size_t>::iterator it = chunk->relative.begin();
+         it != chunk->relative.end(); it++) {
+      out->corners[chunk->cornerOffset + *it] += base[*it % 3];
+    }
+
+    // The chunk is done with; give its memory back now.
+    chunk->data = objFileData();
+    chunk->relative.clear();
+  }
+
+  void objFileData::parse(const char* begin, const char* end, int nThreads) {
+
+    if (nThreads < 1) nThreads = std::max(1u, std::thread::hardware_concurrency());
 
-        frontFaceColors[i/3] = (glm::vec4(1.0f, 0.2f, 0.2f, 1.0f));
-        backFaceColors[i/3] = (glm::vec4(0.2f, 1.0f, 0.2f, 1.0f));
+    // Chunks smaller than this aren't worth a thread.
+    const size_t minChunkSize = 1 << 20;
+    size_t nChunks = std::min((size_t)nThreads,
+                              std::max((size_t)1, (end - begin) / minChunkSize));
 
-        int ivt = front_face_list[i+2]*2;
-        if (ivt > -1) {
-            frontFaceUVs[i/3] = (glm::vec2(uv_list[ivt], uv_list[ivt+1]));
-            ivt = back_face_list[i+2]*2;
-            backFaceUVs[i/3] = (glm::vec2(uv_list[ivt], uv_list[ivt+1]));
+    std::vector<size_t> relative;
+    if (nChunks == 1) {
+      parseRecords(begin, end, *this, relative);
+      return;
+    }
+
+    // Cut the text into roughly equal pieces, at line boundaries.
+    std::vector<objChunk> chunks(nChunks);
+    const char* p = begin;
+    for (size_t i = 0; i < nChunks; i++) {
+      chunks[i].begin = p;
+      if (i == nChunks - 1) {
+        p = end;
+      } else {
+        p = std::max(p, begin + (i + 1) * ((end - begin) / nChunks));
+        if (p < end) p = skipLine(p, end);
+      }
+      chunks[i].end = p;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nChunks; i++) {
+      threads.push_back(std::thread(parseChunk, &chunks[i]));
+    }
+    for (size_t i = 0; i < nChunks; i++) threads[i].join();
+
+    // Each chunk's records go after those of the chunks before it.
+    size_t positionOffset = positions.size(), normalOffset = normals.size();
+    size_t uvOffset = uvs.size(), cornerOffset = corners.size();
+    for (size_t i = 0; i < nChunks; i++) {
+      chunks[i].positionOffset = positionOffset;
+      chunks[i].normalOffset = normalOffset;
+      chunks[i].uvOffset = uvOffset;
+      chunks[i].cornerOffset = cornerOffset;
+      positionOffset += chunks[i].data.positions.size();
+      normalOffset += chunks[i].data.normals.size();
+      uvOffset += chunks[i].data.uvs.size();
+      cornerOffset += chunks[i].data.corners.size();
+      nFaces += chunks[i].data.nFaces;
+
+      // The material records are few, so they are merged here.
+      objFileData& data = chunks[i].data;
+      materialLibraries.insert(materialLibraries.end(),
+                               data.materialLibraries.begin(),
+                               data.materialLibraries.end());
+      for (size_t j = 0; j < data.materialUses.size(); j++) {
+        materialUses.push_back(std::make_pair(data.materialUses[j].first,
+                                              data.materialUses[j].second +
+                                              chunks[i].cornerOffset / 9));
+      }
+    }
+    positions.resize(positionOffset);
+    normals.resize(normalOffset);
+    uvs.resize(uvOffset);
+    corners.resize(cornerOffset);
+
+    threads.clear();
+    for (size_t i = 0; i < nChunks; i++) {
+      threads.push_back(std::thread(placeChunk, &chunks[i], this));
+    }
+    for (size_t i = 0; i < nChunks; i++) threads[i].join();
+  }
+
+  void objFileData::readFile(const std::string& fileName, int nThreads) {
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open: " + fileName);
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0) {
+      close(fd);
+      throw std::runtime_error("Cannot read: " + fileName);
+    }
+
+    size_t size = fileStat.st_size;
+    if (size == 0) {
+      close(fd);
+      return;
+    }
+
+    void* text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) throw std::runtime_error("Cannot map: " + fileName);
+    madvise(text, size, MADV_SEQUENTIAL);
+
+    try {
+      parse((const char*)text, (const char*)text + size, nThreads);
+    } catch (...) {
+      munmap(text, size);
+      throw;
+    }
+
+    munmap(text, size);
+  }
+
+  void objMaterialTable::parse(const char* p, const char* end) {
+
+    objMaterial* material = NULL;
+    std::vector<float> values;
+
+    while (p < end) {
+
+      p = skipSpace(p, end);
+      if (p == end) break;
+
+      values.clear();
+      if (isKeyword(p, end, "newmtl")) {
+        std::string name = restOfRecord(p + 6, end);
+        material = &materials[name];
+        *material = objMaterial();
+        material->name = name;
+      } else if (!material) {
+        // Nothing before the first newmtl means anything.
+      } else if (isKeyword(p, end, "Ka")) {
+        scanFloats(p + 2, end, 3, values);
+        material->ambient = glm::vec4(values[0], values[1], values[2], 1.0f);
+      } else if (isKeyword(p, end, "Kd")) {
+        scanFloats(p + 2, end, 3, values);
+        material->diffuse = glm::vec4(values[0], values[1], values[2],
+                                      material->diffuse.a);
+      } else if (isKeyword(p, end, "Ks")) {
+        scanFloats(p + 2, end, 3, values);
+        material->specular = glm::vec4(values[0], values[1], values[2], 1.0f);
+      } else if (isKeyword(p, end, "Ns")) {
+        scanFloats(p + 2, end, 1, values);
+        material->shininess = values[0];
+      } else if (isKeyword(p, end, "d")) {
+        scanFloats(p + 1, end, 1, values);
+        material->diffuse.a = values[0];
+      } else if (isKeyword(p, end, "Tr")) {
+        scanFloats(p + 2, end, 1, values);
+        material->diffuse.a = 1.0f - values[0];
+      } else if (isKeyword(p, end, "map_Kd")) {
+        material->diffuseMap = restOfRecord(p + 6, end);
+      }
+
+      p = skipLine(p, end);
+    }
+  }
+
+  void objMaterialTable::readFile(const std::string& fileName) {
+
+    // These are small, so there's no need to map them.
+    std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!file.is_open()) throw std::runtime_error("Cannot open: " + fileName);
+
+    std::stringstream text;
+    text << file.rdbuf();
+    std::string contents = text.str();
+
+    parse(contents.data(), contents.data() + contents.size());
+  }
+
+  const objMaterial* objMaterialTable::find(const std::string& name) const {
+    std::map<std::string, objMaterial>::const_iterator it = materials.find(name);
+    return (it == materials.end()) ? NULL : &it->second;
+  }
+
+  // Runs job(begin, end) over [0, n), cut into one block per thread.
+  // Blocks are never very small, so short jobs stay on this thread.
+  template <class T>
+  static void parallelFor(const size_t n, int nThreads, T& job) {
+
+    if (nThreads < 1) nThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t nBlocks = std::min((size_t)nThreads, std::max((size_t)1, n / 16384));
+    if (nBlocks == 1) {
+      job(0, n);
+      return;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nBlocks; i++) {
+      threads.push_back(std::thread(std::ref(job), n * i / nBlocks,
+                                    n * (i + 1) / nBlocks));
+    }
+    for (size_t i = 0; i < nBlocks; i++) threads[i].join();
+  }
+
+  static inline glm::vec3 cornerPosition(const objFileData& data, const size_t corner) {
+    const float* p = &data.positions[3 * data.corners[3 * corner]];
+    return glm::vec3(p[0], p[1], p[2]);
+  }
+
+  // Finds the normal of each triangle, both as it comes from the
+  // cross product, with a length of twice the triangle's area, and
+  // made unit length.
+  struct faceNormalJob {
+    const objFileData* data;
+    std::vector<glm::vec3>* areaNormals;
+    std::vector<glm::vec3>* unitNormals;
+
+    void operator()(const size_t begin, const size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        glm::vec3 p0 = cornerPosition(*data, 3 * i);
+        glm::vec3 p1 = cornerPosition(*data, 3 * i + 1);
+        glm::vec3 p2 = cornerPosition(*data, 3 * i + 2);
+        glm::vec3 normal = glm::cross(p0 - p1, p0 - p2);
+        (*areaNormals)[i] = normal;
+        (*unitNormals)[i] = glm::normalize(normal);
+      }
+    }
+  };
+
+  // Finds a smooth normal for each corner that has none: the sum of
+  // the area-weighted normals of the triangles that share the
+  // corner's position, leaving out those that meet the corner's own
+  // triangle at more than the crease angle.  Each corner gathers its
+  // own sum from the adjacency lists, so there is nothing shared to
+  // lock, and the sums are added in the same order however the
+  // corners are divided among threads.
+  struct smoothNormalJob {
+    const objFileData* data;
+    const std::vector<glm::vec3>* areaNormals;
+    const std::vector<glm::vec3>* unitNormals;
+    // The triangles using each position are adjacency[start[i]] up to
+    // adjacency[start[i + 1]].
+    const std::vector<size_t>* start;
+    const std::vector<GLuint>* adjacency;
+    float cosCrease;
+    std::vector<glm::vec3>* normals;
+
+    void operator()(const size_t begin, const size_t end) {
+      for (size_t i = begin; i < end; i++) {
+
+        if (data->corners[3 * i + 1] != objFileData::missing) continue;
+
+        // A triangle with no area has no direction to compare with, so
+        // its corners take all their neighbors.
+        const glm::vec3& own = (*unitNormals)[i / 3];
+        bool degenerate = !(glm::dot(own, own) > 0.5f);
+        int position = data->corners[3 * i];
+
+        glm::vec3 sum(0.0f, 0.0f, 0.0f);
+        for (size_t j = (*start)[position]; j < (*start)[position + 1]; j++) {
+          GLuint triangle = (*adjacency)[j];
+          if (degenerate || (glm::dot((*unitNormals)[triangle], own) >= cosCrease)) {
+            sum += (*areaNormals)[triangle];
+          }
+        }
+
+        float length = glm::length(sum);
+        (*normals)[i] = (length > 0.0f) ? sum / length : glm::vec3(0.0f, 0.0f, 0.0f);
+      }
+    }
+  };
+
+  // Makes a normal for each corner that doesn't have one in the file.
+  static void generateNormals(const objFileData& data,
+                              const objLoadOptions& options,
+                              std::vector<glm::vec3>& normals) {
+
+    size_t nCorners = data.corners.size() / 3;
+    size_t nTriangles = nCorners / 3;
+    normals.resize(nCorners);
+
+    std::vector<glm::vec3> areaNormals(nTriangles), unitNormals(nTriangles);
+    faceNormalJob faces = { &data, &areaNormals, &unitNormals };
+    parallelFor(nTriangles, options.nThreads, faces);
+
+    if (options.normals == OBJNORMALS_FLAT) {
+      for (size_t i = 0; i < nCorners; i++) normals[i] = unitNormals[i / 3];
+      return;
+    }
+
+    // List the triangles that use each position, in order.
+    size_t nPositions = data.positions.size() / 3;
+    std::vector<size_t> start(nPositions + 1, 0);
+    for (size_t i = 0; i < nCorners; i++) start[data.corners[3 * i] + 1]++;
+    for (size_t i = 0; i < nPositions; i++) start[i + 1] += start[i];
+
+    std::vector<GLuint> adjacency(nCorners);
+    std::vector<size_t> next(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < nCorners; i++) {
+      adjacency[next[data.corners[3 * i]]++] = i / 3;
+    }
+
+    smoothNormalJob smooth = { &data, &areaNormals, &unitNormals, &start, &adjacency,
+                               cosf(options.creaseAngle * (float)M_PI / 180.0f),
+                               &normals };
+    parallelFor(nCorners, options.nThreads, smooth);
+  }
+
+  void objMesh::build(objFileData& data, const objLoadOptions& options) {
+
+    // Check the indices now, so the loop below can trust them.  This
+    // is after any negative ones have been shifted into place by
+    // parse(), so one still negative was out of range.
+    int nPositions = data.positions.size() / 3;
+    int nNormals = data.normals.size() / 3;
+    int nUVs = data.uvs.size() / 2;
+    for (std::vector<int>::iterator it = data.corners.begin();
+         it != data.corners.end(); it += 3) {
+      if ((it[0] < 0) || (it[0] >= nPositions) ||
+          ((it[1] < 0) && (it[1] != objFileData::missing)) || (it[1] >= nNormals) ||
+          ((it[2] < 0) && (it[2] != objFileData::missing)) || (it[2] >= nUVs)) {
+        throw std::runtime_error("Bad face index in OBJ data");
+      }
+    }
+
+    // The face list has three entries for each triangle corner: the
+    // position, normal, and texture coordinate indices.  Each distinct
+    // combination of those becomes one vertex, and the triangles are
+    // described by indices into the vertices.  A position shared by
+    // six triangles is stored once instead of six times.
+    int nCorners = data.corners.size() / 3;
+    tripleIndex vertexIndex(nCorners);
+
+    // Faces without normals get one made for them, flat or smooth as
+    // the options say.  These are added to the end of the normal list,
+    // and corners with exactly the same normal share one.
+    std::vector<glm::vec3> generatedNormals;
+    bool needNormals = false;
+    for (int i = 0; i < nCorners; i++) {
+      if (data.corners[3 * i + 1] == objFileData::missing) {
+        needNormals = true;
+        break;
+      }
+    }
+    if (needNormals) generateNormals(data, options, generatedNormals);
+
+    tripleIndex generatedNormalIndex(!needNormals ? 0 :
+                                     (options.normals == OBJNORMALS_FLAT) ?
+                                     nCorners / 3 : nCorners);
+    int nFileNormals = data.normals.size() / 3;
+
+    indices.resize(nCorners);
+    positions.clear();
+    normals.clear();
+    uvs.clear();
+    positions.reserve(nCorners);
+    normals.reserve(nCorners);
+    uvs.reserve(nCorners);
+
+    for (int i = 0; i < nCorners; i++) {
+
+      int iv = data.corners[3 * i];
+      int ivn = data.corners[3 * i + 1];
+      int ivt = data.corners[3 * i + 2];
+
+      if (ivn == objFileData::missing) {
+        const glm::vec3& normal = generatedNormals[i];
+        ivn = nFileNormals + generatedNormalIndex.insert(floatBits(normal.x),
+                                                         floatBits(normal.y),
+                                                         floatBits(normal.z));
+        if (ivn * 3 == (int)data.normals.size()) {
+          data.normals.push_back(normal.x);
+          data.normals.push_back(normal.y);
+          data.normals.push_back(normal.z);
+        }
+      }
+
+      GLuint index = vertexIndex.insert(iv, ivn, ivt);
+      indices[i] = index;
+
+      if (index == positions.size()) {
+        positions.push_back(glm::vec4(data.positions[3 * iv], data.positions[3 * iv + 1],
+                                     data.positions[3 * iv + 2], 1.0f));
+        normals.push_back(glm::vec4(data.normals[3 * ivn], data.normals[3 * ivn + 1],
+                                    data.normals[3 * ivn + 2], 1.0f));
+        if (ivt != objFileData::missing) {
+          uvs.push_back(glm::vec2(data.uvs[2 * ivt], data.uvs[2 * ivt + 1]));
         } else {
-            frontFaceUVs[i/3] = (glm::vec2(0.0f, 0.0f));
-            backFaceUVs[i/3] = (glm::vec2(0.0f, 0.0f));
+          uvs.push_back(glm::vec2(0.0f, 0.0f));
         }
+      }
+    }
+
+    // Sort the triangles by material, keeping them in file order
+    // otherwise, so each material's triangles can be drawn as one
+    // stretch of the index list.  Materials are numbered in the order
+    // they are first used.
+    materialLibraries = data.materialLibraries;
+    submeshes.clear();
+
+    size_t nTriangles = nCorners / 3;
+    if (nTriangles == 0) return;
+
+    std::vector<std::pair<std::string, size_t> > uses = data.materialUses;
+    if (uses.empty() || (uses[0].second > 0)) {
+      uses.insert(uses.begin(), std::make_pair(std::string(""), (size_t)0));
+    }
+
+    std::vector<int> triangleMaterials(nTriangles);
+    std::map<std::string, int> materialNumbers;
+    for (size_t i = 0; i < uses.size(); i++) {
+
+      int number;
+      std::map<std::string, int>::iterator it = materialNumbers.find(uses[i].first);
+      if (it == materialNumbers.end()) {
+        number = submeshes.size();
+        materialNumbers[uses[i].first] = number;
+        submeshes.push_back(objSubmesh());
+        submeshes.back().material = uses[i].first;
+      } else {
+        number = it->second;
+      }
+
+      size_t last = (i + 1 < uses.size()) ? uses[i + 1].second : nTriangles;
+      for (size_t j = uses[i].second; j < last; j++) {
+        triangleMaterials[j] = number;
+        submeshes[number].nIndices += 3;
+      }
+    }
+
+    GLuint first = 0;
+    std::vector<GLuint> next(submeshes.size());
+    for (size_t i = 0; i < submeshes.size(); i++) {
+      submeshes[i].firstIndex = next[i] = first;
+      first += submeshes[i].nIndices;
+    }
+
+    if (submeshes.size() > 1) {
+      std::vector<GLuint> sorted(indices.size());
+      for (size_t j = 0; j < nTriangles; j++) {
+        GLuint& out = next[triangleMaterials[j]];
+        memcpy(&sorted[out], &indices[3 * j], 3 * sizeof(GLuint));
+        out += 3;
+      }
+      indices.swap(sorted);
+    }
+
+    // A usemtl with no faces after it leaves an empty submesh.
+    std::vector<objSubmesh> used;
+    for (size_t i = 0; i < submeshes.size(); i++) {
+      if (submeshes[i].nIndices > 0) used.push_back(submeshes[i]);
     }
+    submeshes.swap(used);
+  }
 
-      _frontFace.addData(bsg::GLDATA_VERTICES, "position", frontFaceVertices);
-      _frontFace.addData(bsg::GLDATA_COLORS, "color", frontFaceColors);
-      _frontFace.addData(bsg::GLDATA_NORMALS, "normal", frontFaceNormals);
-      _frontFace.addData(bsg::GLDATA_TEXCOORDS, "texture", frontFaceUVs);
-      _frontFace.setDrawType(GL_TRIANGLES, frontFaceVertices.size());  
+  // The binary cache file.  It starts with this header, and the arrays
+  // follow in order: positions, normals, uvs, indices.  The arrays are
+  // written just as they sit in memory, so reading them back is one
+  // copy each, and everything is on a 16-byte boundary since the
+  // header is 80 bytes.  After the arrays come the material library
+  // names, then the submeshes: first index and count, then material
+  // name.  Each name is a 32-bit length and the characters.  Bump the
+  // version whenever the layout or the way the mesh is built changes.
+  static const char objCacheMagic[8] = { 'b', 's', 'g', 'm', 'e', 's', 'h', '\0' };
+  static const uint32_t objCacheVersion = 4;
 
-      _backFace.addData(bsg::GLDATA_VERTICES, "position", backFaceVertices);
-      _backFace.addData(bsg::GLDATA_COLORS, "color", backFaceColors);
-      _backFace.addData(bsg::GLDATA_NORMALS, "normal", backFaceNormals);
-      _backFace.addData(bsg::GLDATA_TEXCOORDS, "texture", backFaceUVs);
-      _backFace.setDrawType(GL_TRIANGLES, backFaceVertices.size()); 
+  struct objCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;     // 0x01020304, as written.
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint64_t sourceHash;
+    uint64_t nVertices;
+    uint64_t nIndices;
+    uint32_t nLibraries;
+    uint32_t nSubmeshes;
+    // The options the mesh was built with.
+    uint32_t normals;
+    float creaseAngle;
+    uint64_t reserved;
+  };
+
+  // Fills in the parts of the header that identify the source file
+  // and the options.
+  // The hash is FNV-1a over a sample of the file: the first and last
+  // few kilobytes, and evenly spaced blocks in between.  It catches
+  // a file that was replaced but kept its size and time, without
+  // reading the whole thing, which would cost about as much as
+  // parsing it.  Returns false if the source can't be read.
+  static bool describeSource(const std::string& fileName,
+                             const objLoadOptions& options,
+                             objCacheHeader& header) {
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) < 0) {
+      close(fd);
+      return false;
+    }
+
+    memcpy(header.magic, objCacheMagic, sizeof(header.magic));
+    header.version = objCacheVersion;
+    header.byteOrder = 0x01020304;
+    header.sourceSize = fileStat.st_size;
+    header.sourceTime = fileStat.st_mtime;
+    header.nLibraries = 0;
+    header.nSubmeshes = 0;
+    header.normals = options.normals;
+    header.creaseAngle = options.creaseAngle;
+    header.reserved = 0;
+
+    const size_t blockSize = 4096;
+    const size_t nBlocks = 64;
+    std::vector<unsigned char> block(blockSize);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < nBlocks; i++) {
+
+      off_t offset = 0;
+      if (header.sourceSize > blockSize) {
+        offset = (off_t)(((header.sourceSize - blockSize) / (nBlocks - 1)) * i);
+      }
+      ssize_t nRead = pread(fd, &block[0], blockSize, offset);
+      if (nRead < 0) {
+        close(fd);
+        return false;
+      }
+      for (ssize_t j = 0; j < nRead; j++) {
+        hash = (hash ^ block[j]) * 1099511628211ULL;
+      }
+    }
+    header.sourceHash = hash;
+
+    close(fd);
+    return true;
+  }
+
+  // Reads things from the part of the cache after the arrays, making
+  // sure not to run off the end.
+  static bool readCacheValue(const char*& p, const char* end, uint32_t& value) {
+    if ((size_t)(end - p) < sizeof(value)) return false;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+  }
+  static bool readCacheString(const char*& p, const char* end, std::string& value) {
+    uint32_t length;
+    if (!readCacheValue(p, end, length) || ((size_t)(end - p) < length)) return false;
+    value.assign(p, length);
+    p += length;
+    return true;
+  }
+
+  bool objMesh::readCache(const std::string& cacheName,
+                          const std::string& sourceName,
+                          const objLoadOptions& options) {
+
+    objCacheHeader source;
+    if (!describeSource(sourceName, options, source)) return false;
+
+    int fd = open(cacheName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat fileStat;
+    if ((fstat(fd, &fileStat) < 0) ||
+        ((size_t)fileStat.st_size < sizeof(objCacheHeader))) {
+      close(fd);
+      return false;
+    }
+    size_t size = fileStat.st_size;
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const char* bytes = (const char*)map;
+    const char* end = bytes + size;
+    objCacheHeader header;
+    memcpy(&header, bytes, sizeof(header));
+
+    bool valid =
+      (memcmp(header.magic, source.magic, sizeof(header.magic)) == 0) &&
+      (header.version == source.version) &&
+      (header.byteOrder == source.byteOrder) &&
+      (header.sourceSize == source.sourceSize) &&
+      (header.sourceTime == source.sourceTime) &&
+      (header.sourceHash == source.sourceHash) &&
+      (header.normals == source.normals) &&
+      ((header.normals == OBJNORMALS_FLAT) ||
+       (header.creaseAngle == source.creaseAngle)) &&
+      // Bound the counts by the file size before multiplying, so a
+      // damaged header can't wrap the product around into passing.
+      (header.nVertices <= size) && (header.nIndices <= size) &&
+      (header.nLibraries <= size) && (header.nSubmeshes <= size) &&
+      (size >= sizeof(header) +
+       header.nVertices * (2 * sizeof(glm::vec4) + sizeof(glm::vec2)) +
+       header.nIndices * sizeof(GLuint));
+
+    // Read into a new mesh, so this one is untouched if the cache turns
+    // out to be no good.
+    objMesh cached;
+    if (valid) {
+      cached.positions.resize(header.nVertices);
+      cached.normals.resize(header.nVertices);
+      cached.uvs.resize(header.nVertices);
+      cached.indices.resize(header.nIndices);
+
+      bytes += sizeof(header);
+      if (header.nVertices > 0) {
+        memcpy(&cached.positions[0], bytes, header.nVertices * sizeof(glm::vec4));
+        bytes += header.nVertices * sizeof(glm::vec4);
+        memcpy(&cached.normals[0], bytes, header.nVertices * sizeof(glm::vec4));
+        bytes += header.nVertices * sizeof(glm::vec4);
+        memcpy(&cached.uvs[0], bytes, header.nVertices * sizeof(glm::vec2));
+        bytes += header.nVertices * sizeof(glm::vec2);
+      }
+      if (header.nIndices > 0) {
+        memcpy(&cached.indices[0], bytes, header.nIndices * sizeof(GLuint));
+        bytes += header.nIndices * sizeof(GLuint);
+      }
+
+      // The indices go straight to glDrawElements(), so they had
+      // better point at vertices.
+      for (std::vector<GLuint>::iterator it = cached.indices.begin();
+           valid && (it != cached.indices.end()); it++) {
+        valid = (*it < header.nVertices);
+      }
+
+      cached.materialLibraries.resize(header.nLibraries);
+      for (uint32_t i = 0; valid && (i < header.nLibraries); i++) {
+        valid = readCacheString(bytes, end, cached.materialLibraries[i]);
+      }
+
+      cached.submeshes.resize(header.nSubmeshes);
+      for (uint32_t i = 0; valid && (i < header.nSubmeshes); i++) {
+        objSubmesh& submesh = cached.submeshes[i];
+        uint32_t firstIndex = 0, nIndices = 0;
+        valid = readCacheValue(bytes, end, firstIndex) &&
+          readCacheValue(bytes, end, nIndices) &&
+          readCacheString(bytes, end, submesh.material) &&
+          ((uint64_t)firstIndex + nIndices <= header.nIndices);
+        submesh.firstIndex = firstIndex;
+        submesh.nIndices = nIndices;
+      }
+    }
+
+    munmap(map, size);
+
+    if (valid) {
+      positions.swap(cached.positions);
+      normals.swap(cached.normals);
+      uvs.swap(cached.uvs);
+      indices.swap(cached.indices);
+      materialLibraries.swap(cached.materialLibraries);
+      submeshes.swap(cached.submeshes);
+    }
+    return valid;
+  }
+
+  // Writes one array to the cache file.
+  template <class T>
+  static bool writeArray(FILE* file, const std::vector<T>& array) {
+    if (array.empty()) return true;
+    return fwrite(&array[0], sizeof(T), array.size(), file) == array.size();
+  }
+
+  static bool writeCacheValue(FILE* file, const uint32_t value) {
+    return fwrite(&value, sizeof(value), 1, file) == 1;
+  }
+
+  static bool writeCacheString(FILE* file, const std::string& value) {
+    return writeCacheValue(file, value.size()) &&
+      (fwrite(value.data(), 1, value.size(), file) == value.size());
+  }
+
+  bool objMesh::writeCache(const std::string& cacheName,
+                           const std::string& sourceName,
+                           const objLoadOptions& options) const {
+
+    objCacheHeader header;
+    if (!describeSource(sourceName, options, header)) return false;
+    header.nVertices = positions.size();
+    header.nIndices = indices.size();
+    header.nLibraries = materialLibraries.size();
+    header.nSubmeshes = submeshes.size();
+
+    // Write to a temporary file and rename it into place, so that a
+    // reader never sees half a cache, even when several processes
+    // (e.g. render nodes sharing a filesystem) write it at once.
+    std::stringstream tempName;
+    tempName << cacheName << "." << getpid() << ".tmp";
+
+    FILE* file = fopen(tempName.str().c_str(), "wb");
+    if (!file) return false;
+
+    bool written =
+      (fwrite(&header, sizeof(header), 1, file) == 1) &&
+      writeArray(file, positions) && writeArray(file, normals) &&
+      writeArray(file, uvs) && writeArray(file, indices);
+
+    for (std::vector<std::string>::const_iterator it = materialLibraries.begin();
+         written && (it != materialLibraries.end()); it++) {
+      written = writeCacheString(file, *it);
+    }
+
+    for (std::vector<objSubmesh>::const_iterator it = submeshes.begin();
+         written && (it != submeshes.end()); it++) {
+      written = writeCacheValue(file, it->firstIndex) &&
+        writeCacheValue(file, it->nIndices) &&
+        writeCacheString(file, it->material);
+    }
+
+    if ((fclose(file) != 0) || !written ||
+        (rename(tempName.str().c_str(), cacheName.c_str()) != 0)) {
+      remove(tempName.str().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string& fileName) :
+    drawableCompound(pShader), _fileName(fileName){
+
+    _load(objLoadOptions());
+  }
+
+  drawableObjModel::drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string& fileName,
+                                     const objLoadOptions& options) :
+    drawableCompound(pShader), _fileName(fileName){
+
+    _load(options);
+  }
+
+  void drawableObjModel::_load(const objLoadOptions& options) {
+
+    // Use the cached mesh if there is one and it is up to date.
+    // Otherwise, read the OBJ file and leave a cache for next time.
+    objMesh mesh;
+    std::string cacheName = _fileName + ".bsgcache";
+    if (!options.useCache || !mesh.readCache(cacheName, _fileName, options)) {
+
+      objFileData data;
+      data.readFile(_fileName, options.nThreads);
+      mesh.build(data, options);
+
+      if (options.useCache && !mesh.writeCache(cacheName, _fileName, options)) {
+        std::cerr << "** Caution: could not write " << cacheName << std::endl;
+      }
+    }
+
+    // The material files are small, and are always read fresh, so an
+    // edit to one shows up even when the mesh comes from the cache.
+    // Their names are relative to the OBJ file.
+    std::string directory;
+    size_t slash = _fileName.find_last_of('/');
+    if (slash != std::string::npos) directory = _fileName.substr(0, slash + 1);
+
+    objMaterialTable materials;
+    for (std::vector<std::string>::iterator it = mesh.materialLibraries.begin();
+         it != mesh.materialLibraries.end(); it++) {
+      try {
+        materials.readFile(directory + *it);
+      } catch (std::runtime_error& e) {
+        std::cerr << "** Caution: " << e.what() << std::endl;
+      }
+    }
+
+    std::vector<drawableObjRange> ranges;
+    for (std::vector<objSubmesh>::iterator it = mesh.submeshes.begin();
+         it != mesh.submeshes.end(); it++) {
+      const objMaterial* material = materials.find(it->material);
+      ranges.push_back(drawableObjRange(it->firstIndex, it->nIndices,
+                                        material ? material->diffuse :
+                                        glm::vec4(1.0f, 0.2f, 0.2f, 1.0f)));
+    }
+
+      _frontFace.addData(bsg::GLDATA_VERTICES, "position", mesh.positions);
+      _frontFace.addData(bsg::GLDATA_NORMALS, "normal", mesh.normals);
+      _frontFace.addData(bsg::GLDATA_TEXCOORDS, "texture", mesh.uvs);
+      _frontFace.setIndices(mesh.indices);
+      _frontFace.setRanges("color", ranges);
+      _frontFace.setDrawType(GL_TRIANGLES);
 
       addObject(_frontFace);
-      addObject(_backFace);
+
+      // The inside of the model is drawn with the same triangles,
+      // rather than a reversed copy of them.
+      setTwoSided(true);
 
   }
 }
@@ -2,20 +2,225 @@
 #include <string>
 #include <iostream>
 #include <fstream>
-#include <algorithm> 
+#include <algorithm>
+#include <map>
+#include <climits>
 
 namespace bsg {
-  
+
+/// \brief The contents of an OBJ file, as read.
+///
+/// The positions, normals, and texture coordinates are kept just as
+/// they appear in the file.  The faces are broken into triangles,
+/// and each triangle corner is stored as three indices into those
+/// lists.  A polygon with any number of sides is split into a fan of
+/// triangles around its first corner.  The mtllib and usemtl records
+/// are noted, and records other than those are skipped.
+class objFileData {
+ public:
+  /// The x, y, z of each 'v' record.
+  std::vector<float> positions;
+  /// The x, y, z of each 'vn' record.
+  std::vector<float> normals;
+  /// The u, v of each 'vt' record.
+  std::vector<float> uvs;
+
+  /// Three ints for each triangle corner: the position, normal, and
+  /// texture coordinate index, counting from zero.  Negative indices
+  /// in the file have already been resolved.  A missing normal or
+  /// texture coordinate is objFileData::missing; any other negative
+  /// index is a bad one.
+  std::vector<int> corners;
+
+  /// The corner index of a normal or texture coordinate the file
+  /// didn't give.
+  static const int missing = INT_MIN;
+
+  /// The number of 'f' records, before triangulation.
+  size_t nFaces;
+
+  /// The material files named by 'mtllib' records.
+  std::vector<std::string> materialLibraries;
+
+  /// The 'usemtl' records: each material name, and the number of
+  /// triangles that came before it.
+  std::vector<std::pair<std::string, size_t> > materialUses;
+
+  objFileData() : nFaces(0) {};
+
+  /// \brief Reads an OBJ file.
+  ///
+  /// The file is mapped into memory and parsed in place, so nothing
+  /// is copied or allocated per line.  See parse() for nThreads.
+  /// Throws std::runtime_error if the file can't be read.
+  void readFile(const std::string& fileName, int nThreads = 0);
+
+  /// \brief Parses OBJ text.
+  ///
+  /// The text does not need to be null-terminated, and lines may end
+  /// with either LF or CRLF.  The results are appended to whatever is
+  /// already here.
+  ///
+  /// Large texts are cut into chunks at line boundaries and the chunks
+  /// parsed in parallel, using up to nThreads threads, or one per core
+  /// if nThreads is zero.  Each chunk is parsed on its own, and then
+  /// copied into place and its negative indices shifted by the number
+  /// of records before it, so the result is the same, bit for bit, as
+  /// parsing with one thread.
+  void parse(const char* begin, const char* end, int nThreads = 0);
+};
+
+/// How normals are made for faces that have none in the file.
+typedef enum {
+  OBJNORMALS_FLAT    = 0,
+  OBJNORMALS_SMOOTH  = 1
+} OBJNORMALTYPE;
+
+/// \brief Choices for how an OBJ model is read and built.
+class objLoadOptions {
+ public:
+  /// With OBJNORMALS_FLAT, each triangle without normals gets its own
+  /// normal, so the model looks faceted.  With OBJNORMALS_SMOOTH, each
+  /// corner gets the area-weighted average of the normals of the
+  /// triangles that share its position, so the model looks smooth
+  /// except where two triangles meet at more than creaseAngle
+  /// (in degrees), where an edge is kept.
+  OBJNORMALTYPE normals;
+  float creaseAngle;
+
+  /// The number of threads to parse and make normals with.  Zero
+  /// means one per core.
+  int nThreads;
+
+  /// Whether to read and write the binary mesh cache.
+  bool useCache;
+
+  objLoadOptions() :
+    normals(OBJNORMALS_FLAT), creaseAngle(60.0f), nThreads(0), useCache(true) {};
+};
+
+/// \brief One material from an MTL file.
+class objMaterial {
+ public:
+  std::string name;
+  /// Ka, Kd, and Ks.  The alpha of the diffuse color is the 'd'
+  /// (dissolve) value, or 1 - Tr.
+  glm::vec4 ambient;
+  glm::vec4 diffuse;
+  glm::vec4 specular;
+  /// Ns, the specular exponent.
+  float shininess;
+  /// map_Kd, the diffuse texture file, as given.
+  std::string diffuseMap;
+
+  objMaterial() :
+    ambient(0.0f, 0.0f, 0.0f, 1.0f), diffuse(0.8f, 0.8f, 0.8f, 1.0f),
+    specular(0.0f, 0.0f, 0.0f, 1.0f), shininess(0.0f) {};
+};
+
+/// \brief The materials from one or more MTL files, by name.
+class objMaterialTable {
+ public:
+  std::map<std::string, objMaterial> materials;
+
+  /// \brief Reads an MTL file, adding its materials to the table.
+  ///
+  /// Throws std::runtime_error if the file can't be read.
+  void readFile(const std::string& fileName);
+
+  /// \brief Parses MTL text.
+  void parse(const char* begin, const char* end);
+
+  /// Returns the named material, or null if there is no such thing.
+  const objMaterial* find(const std::string& name) const;
+};
+
+/// \brief The triangles of an objMesh that share one material.
+///
+/// They are one contiguous stretch of the mesh's index list.
+class objSubmesh {
+ public:
+  std::string material;
+  GLuint firstIndex;
+  GLuint nIndices;
+
+  objSubmesh() : firstIndex(0), nIndices(0) {};
+};
+
+/// \brief An OBJ model, ready to draw.
+///
+/// Each distinct combination of position, normal, and texture
+/// coordinate in the file's faces becomes one vertex, and the
+/// triangles are given as indices into the vertex arrays.  Faces
+/// without normals get them made, as objLoadOptions says.  The
+/// triangles are sorted by material, so each material's triangles are
+/// one submesh.
+///
+/// A mesh can be saved to a binary cache file and read back.  The
+/// cache holds the arrays exactly as they are laid out here, so
+/// reading it is a mapping and a copy per array, with no parsing or
+/// conversion.  It also records the size, time, and a hash of the OBJ
+/// file it came from, and is ignored if those no longer match.
+class objMesh {
+ public:
+  std::vector<glm::vec4> positions;
+  std::vector<glm::vec4> normals;
+  std::vector<glm::vec2> uvs;
+  std::vector<GLuint> indices;
+
+  /// The material files named in the OBJ file.
+  std::vector<std::string> materialLibraries;
+  /// One for each material used, in order of first use.  Triangles
+  /// that come before any usemtl have the material "".
+  std::vector<objSubmesh> submeshes;
+
+  /// \brief Builds the mesh from the parsed file.
+  ///
+  /// Flat normals are added to the data's normal list as they are
+  /// made.  Throws std::runtime_error if a face refers to a record
+  /// that doesn't exist.
+  void build(objFileData& data,
+             const objLoadOptions& options = objLoadOptions());
+
+  /// \brief Reads a cache file.
+  ///
+  /// Returns false, and leaves the mesh alone, if there is no cache or
+  /// it is out of date with respect to the source OBJ file, or was
+  /// built with different options, or is damaged: too short for the
+  /// counts in its header, or with indices past the last vertex.
+  bool readCache(const std::string& cacheName, const std::string& sourceName,
+                 const objLoadOptions& options = objLoadOptions());
+
+  /// \brief Writes a cache file.
+  ///
+  /// Returns false if the file could not be written.
+  bool writeCache(const std::string& cacheName, const std::string& sourceName,
+                  const objLoadOptions& options = objLoadOptions()) const;
+};
+
+/// \brief A drawable object read from an OBJ file.
+///
+/// The first time a file is read, the finished mesh is saved beside
+/// it, as fileName.bsgcache, and later runs read that instead.
+///
+/// The model is one drawableObj, drawn a submesh at a time.  The
+/// diffuse color of each submesh's material is given to the shader as
+/// a constant value of its "color" attribute.  Models without
+/// materials are drawn in red.
 class drawableObjModel : public drawableCompound {
  private:
 
-  
-  const std::string& _fileName;
 
-  drawableObj _frontFace, _backFace;
+  std::string _fileName;
+
+  drawableObj _frontFace;
+
+  void _load(const objLoadOptions& options);
 
  public:
   drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string& fileName);
+  drawableObjModel(bsgPtr<shaderMgr> pShader, const std::string& fileName,
+                   const objLoadOptions& options);
 
 };
 
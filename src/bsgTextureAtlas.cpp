@@ -0,0 +1,272 @@
+#include "bsgTextureAtlas.h"
+#include <sstream>
+
+namespace bsg {
+
+  // The top edge of what has been placed on a page so far, as a list
+  // of level stretches from left to right, covering the whole width.
+  class skyline {
+  private:
+    class segment {
+    public:
+      GLsizei x, y, width;
+      segment(const GLsizei px, const GLsizei py, const GLsizei w) :
+        x(px), y(py), width(w) {};
+    };
+
+    std::vector<segment> _segments;
+    GLsizei _width, _height;
+
+    // How high a rectangle of the given width must sit if its left
+    // edge is at the start of segment i.  Returns -1 if it runs off
+    // the right side.
+    GLsizei _fit(const size_t i, const GLsizei width) {
+      if (_segments[i].x + width > _width) return -1;
+
+      GLsizei y = 0;
+      GLsizei left = width;
+      for (size_t j = i; left > 0; j++) {
+        y = std::max(y, _segments[j].y);
+        left -= _segments[j].width;
+      }
+      return y;
+    };
+
+  public:
+    skyline(const GLsizei width, const GLsizei height) :
+      _width(width), _height(height) {
+      _segments.push_back(segment(0, 0, width));
+    };
+
+    /// \brief Finds the lowest, then leftmost, place for a rectangle,
+    /// and takes it.
+    ///
+    /// Returns false if there is no room.
+    bool place(const GLsizei width, const GLsizei height,
+               GLsizei &x, GLsizei &y) {
+
+      size_t best = _segments.size();
+      GLsizei bestY = _height;
+      for (size_t i = 0; i < _segments.size(); i++) {
+        GLsizei fitY = _fit(i, width);
+        if ((fitY < 0) || (fitY + height > _height)) continue;
+        if (fitY < bestY) {
+          best = i;
+          bestY = fitY;
+        }
+      }
+      if (best == _segments.size()) return false;
+
+      x = _segments[best].x;
+      y = bestY;
+
+      // The new rectangle's top replaces whatever it covers.
+      _segments.insert(_segments.begin() + best, segment(x, y + height, width));
+      size_t i = best + 1;
+      while (i < _segments.size()) {
+        GLsizei overlap = x + width - _segments[i].x;
+        if (overlap <= 0) break;
+        if (overlap < _segments[i].width) {
+          _segments[i].x += overlap;
+          _segments[i].width -= overlap;
+          break;
+        }
+        _segments.erase(_segments.begin() + i);
+      }
+
+      // Join neighbors at the same level.
+      for (i = 0; i + 1 < _segments.size(); ) {
+        if (_segments[i].y == _segments[i + 1].y) {
+          _segments[i].width += _segments[i + 1].width;
+          _segments.erase(_segments.begin() + i + 1);
+        } else {
+          i++;
+        }
+      }
+
+      return true;
+    };
+  };
+
+  // Biggest first packs better.
+  class tallerImage {
+  private:
+    const std::vector<textureImage> &_images;
+  public:
+    tallerImage(const std::vector<textureImage> &images) : _images(images) {};
+    bool operator()(const int a, const int b) const {
+      if (_images[a].height != _images[b].height)
+        return _images[a].height > _images[b].height;
+      return _images[a].width > _images[b].width;
+    };
+  };
+
+textureAtlas::textureAtlas(const GLsizei pageSize, const GLsizei padding) :
+  _pageSize(pageSize), _padding(padding), _packed(false), _usedPixels(0) {}
+
+int textureAtlas::addImage(const textureImage &image) {
+
+  if (_packed)
+    throw std::runtime_error("Can't add to a texture atlas after packing it.");
+
+  if ((image.width + 2 * _padding > _pageSize) ||
+      (image.height + 2 * _padding > _pageSize)) {
+    std::stringstream msg;
+    msg << "A " << image.width << "x" << image.height
+        << " image won't fit in a texture atlas page of " << _pageSize << ".";
+    throw std::runtime_error(msg.str());
+  }
+
+  _images.push_back(image);
+  _entries.push_back(textureAtlasEntry());
+  return _entries.size() - 1;
+}
+
+int textureAtlas::addFile(const std::string &fileName) {
+
+  textureImage image;
+  if (!image.readPNG(fileName))
+    throw std::runtime_error("Can't read texture " + fileName);
+
+  return addImage(image);
+}
+
+void textureAtlas::pack() {
+
+  if (_packed) return;
+
+  std::vector<int> order;
+  for (size_t i = 0; i < _images.size(); i++) order.push_back(i);
+  std::stable_sort(order.begin(), order.end(), tallerImage(_images));
+
+  // Place everything, first fit by page.
+  std::vector<skyline> skylines;
+  std::vector<GLsizei> pageWidths, pageHeights;
+  for (std::vector<int>::iterator it = order.begin(); it != order.end(); it++) {
+
+    textureAtlasEntry &entry = _entries[*it];
+    entry.width = _images[*it].width;
+    entry.height = _images[*it].height;
+    GLsizei w = entry.width + 2 * _padding;
+    GLsizei h = entry.height + 2 * _padding;
+
+    GLsizei x, y;
+    size_t page;
+    for (page = 0; page < skylines.size(); page++) {
+      if (skylines[page].place(w, h, x, y)) break;
+    }
+    if (page == skylines.size()) {
+      skylines.push_back(skyline(_pageSize, _pageSize));
+      pageWidths.push_back(0);
+      pageHeights.push_back(0);
+      skylines.back().place(w, h, x, y);
+    }
+
+    entry.page = page;
+    entry.x = x + _padding;
+    entry.y = y + _padding;
+    pageWidths[page] = std::max(pageWidths[page], x + w);
+    pageHeights[page] = std::max(pageHeights[page], y + h);
+    _usedPixels += (size_t)entry.width * entry.height;
+  }
+
+  // The pages only need to be as big as what's on them.
+  _pages.resize(skylines.size());
+  _textures.resize(skylines.size());
+  for (size_t page = 0; page < _pages.size(); page++) {
+    textureImage &image = _pages[page];
+    image.width = pageWidths[page];
+    image.height = pageHeights[page];
+    image.format = GL_RGBA;
+    image.rowBytes = 4 * image.width;
+    image.pixels.assign(image.rowBytes * image.height, 0);
+  }
+
+  for (size_t i = 0; i < _entries.size(); i++) {
+    textureAtlasEntry &entry = _entries[i];
+    const textureImage &page = _pages[entry.page];
+    entry.scale = glm::vec2((float)entry.width / page.width,
+                            (float)entry.height / page.height);
+    entry.offset = glm::vec2((float)entry.x / page.width,
+                             (float)entry.y / page.height);
+    _blit(_images[i], entry);
+  }
+
+  // We're done with the originals.
+  std::vector<textureImage>().swap(_images);
+  _packed = true;
+}
+
+void textureAtlas::_blit(const textureImage &image,
+                         const textureAtlasEntry &entry) {
+
+  textureImage &page = _pages[entry.page];
+  int channels = (image.format == GL_RGBA) ? 4 : 3;
+
+  for (GLsizei y = -_padding; y < image.height + _padding; y++) {
+    GLsizei sy = std::min(std::max(y, 0), image.height - 1);
+    const unsigned char* in = &image.pixels[sy * image.rowBytes];
+    unsigned char* out = &page.pixels[(entry.y + y) * page.rowBytes];
+
+    for (GLsizei x = -_padding; x < image.width + _padding; x++) {
+      GLsizei sx = std::min(std::max(x, 0), image.width - 1);
+      unsigned char* pixel = out + 4 * (entry.x + x);
+      pixel[0] = in[channels * sx];
+      pixel[1] = in[channels * sx + 1];
+      pixel[2] = in[channels * sx + 2];
+      pixel[3] = (channels == 4) ? in[channels * sx + 3] : 255;
+    }
+  }
+}
+
+const textureAtlasEntry& textureAtlas::getEntry(const int index) {
+  return _entries.at(index);
+}
+
+const textureImage& textureAtlas::getPage(const int page) {
+  return _pages.at(page);
+}
+
+bsgPtr<textureMgr> textureAtlas::getTexture(const int page,
+                                            const textureOptions &options) {
+
+  if (!_textures.at(page)) {
+    _textures[page] = new textureMgr(options);
+    _textures[page]->setImage(_pages[page]);
+  }
+  return _textures[page];
+}
+
+void textureAtlas::remapUVs(drawableObj &obj, const int index) {
+  const textureAtlasEntry &entry = getEntry(index);
+  obj.transformUVs(entry.offset, entry.scale);
+}
+
+void textureAtlas::remapUVs(drawableCompound &obj, const int index) {
+  const textureAtlasEntry &entry = getEntry(index);
+  obj.transformUVs(entry.offset, entry.scale);
+}
+
+float textureAtlas::getEfficiency() {
+
+  size_t area = 0;
+  for (std::vector<textureImage>::iterator it = _pages.begin();
+       it != _pages.end(); it++) {
+    area += (size_t)it->width * it->height;
+  }
+  return area ? (float)_usedPixels / area : 0.0f;
+}
+
+void textureAtlas::printStats(std::ostream &os) {
+
+  os << "texture atlas: " << _entries.size() << " images on "
+     << _pages.size() << " page" << (_pages.size() == 1 ? "" : "s");
+  for (std::vector<textureImage>::iterator it = _pages.begin();
+       it != _pages.end(); it++) {
+    os << (it == _pages.begin() ? " (" : ", ") << it->width << "x" << it->height;
+  }
+  os << (_pages.empty() ? "" : ")") << ", "
+     << 100.0f * getEfficiency() << "% covered" << std::endl;
+}
+
+}
@@ -0,0 +1,127 @@
+#include "bsg.h"
+
+namespace bsg {
+
+/// \brief Where one image landed in a textureAtlas.
+class textureAtlasEntry {
+ public:
+  /// Which page of the atlas it is on.
+  int page;
+  /// The corner and size of the image on the page, in pixels, not
+  /// counting the padding around it.  Rows count from the bottom.
+  GLsizei x, y, width, height;
+  /// What to multiply an image texture coordinate by, and then add,
+  /// to get the coordinate on the page.
+  glm::vec2 scale, offset;
+
+ textureAtlasEntry() : page(-1), x(0), y(0), width(0), height(0),
+    scale(1.0f, 1.0f), offset(0.0f, 0.0f) {};
+};
+
+/// \brief Many small images packed into a few big textures.
+///
+/// Every textureMgr is a separate OpenGL texture, and binding one
+/// costs something, so a scene with hundreds of small textured objects
+/// spends a lot of its time switching textures.  An atlas gathers the
+/// images onto a few large pages, so objects whose images share a page
+/// can share a texture, and a shader.  Each object's texture
+/// coordinates have to be moved to its image's spot on the page, which
+/// remapUVs() does.
+///
+/// The images are placed with a skyline packer: the tallest go first,
+/// and each goes wherever along the top edge of what's already placed
+/// it sits lowest, leftmost on a tie.  A new page is started when an
+/// image doesn't fit.  Each image is surrounded by a border made by
+/// repeating its edge pixels, so filtering doesn't pick up the
+/// neighbors' colors.  The smallest mipmaps will blend neighbors
+/// anyway; a wider border puts that off to smaller levels.
+///
+/// Texture coordinates outside [0, 1], used to repeat a texture across
+/// a surface, don't work with an atlas, since they run into the
+/// neighbors instead of wrapping.
+///
+/// Use it like this:
+///
+///     bsg::textureAtlas atlas;
+///     int brick = atlas.addFile("brick.png");
+///     int stone = atlas.addFile("stone.png");
+///     atlas.pack();
+///     shader->addTexture(atlas.getTexture(atlas.getEntry(brick).page));
+///     atlas.remapUVs(wall, brick);
+///
+class textureAtlas {
+ private:
+  GLsizei _pageSize;
+  GLsizei _padding;
+
+  // The images as added, until they are packed.
+  std::vector<textureImage> _images;
+  std::vector<textureAtlasEntry> _entries;
+
+  std::vector<textureImage> _pages;
+  std::vector<bsgPtr<textureMgr> > _textures;
+
+  bool _packed;
+  size_t _usedPixels;
+
+  // Copies an image, with its edge pixels extended into the padding,
+  // into a page.
+  void _blit(const textureImage &image, const textureAtlasEntry &entry);
+
+ public:
+  /// The pages are pageSize pixels wide, and no taller, and each image
+  /// gets padding pixels of border on each side.
+  textureAtlas(const GLsizei pageSize = 2048, const GLsizei padding = 4);
+
+  /// \brief Adds an image to be packed.
+  ///
+  /// Returns the index by which to ask about it later.  Throws
+  /// std::runtime_error if the atlas has already been packed, or if
+  /// the image won't fit on a page.
+  int addImage(const textureImage &image);
+
+  /// \brief Reads a PNG file and adds it to be packed.
+  ///
+  /// Throws std::runtime_error if the file can't be read.
+  int addFile(const std::string &fileName);
+
+  /// \brief Packs the images onto pages.
+  ///
+  /// After this, the entries and pages are ready, and no more images
+  /// can be added.  Each page is cut down to the width and height
+  /// actually used.
+  void pack();
+
+  size_t getNumImages() { return _entries.size(); };
+  size_t getNumPages() { return _pages.size(); };
+
+  /// Where an image went.  Only meaningful after pack().
+  const textureAtlasEntry& getEntry(const int index);
+
+  /// \brief The image of one page.
+  const textureImage& getPage(const int page);
+
+  /// \brief The texture for one page.
+  ///
+  /// The texture is made with the given options the first time it is
+  /// asked for, so this must be called on the rendering thread.
+  bsgPtr<textureMgr> getTexture(const int page,
+                                const textureOptions &options = textureOptions());
+
+  /// \brief Points an object's texture coordinates at an image.
+  ///
+  /// The coordinates should be for the image by itself, in [0, 1].
+  /// Do this only once per object.
+  void remapUVs(drawableObj &obj, const int index);
+  void remapUVs(drawableCompound &obj, const int index);
+
+  /// \brief The fraction of the page area covered by images.
+  ///
+  /// The rest is padding and gaps.  Only meaningful after pack().
+  float getEfficiency();
+
+  /// \brief Prints the number of images and pages, and the efficiency.
+  void printStats(std::ostream &os);
+};
+
+}
@@ -0,0 +1,260 @@
+#include "bsgTransformStore.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace bsg {
+
+void transformStore::reserve(const size_t n) {
+
+  _parent.reserve(n);
+  _px.reserve(n); _py.reserve(n); _pz.reserve(n);
+  _qx.reserve(n); _qy.reserve(n); _qz.reserve(n); _qw.reserve(n);
+  _sx.reserve(n); _sy.reserve(n); _sz.reserve(n);
+  for (int k = 0; k < 12; k++) _world[k].reserve(n);
+  _slot.reserve(n);
+  _node.reserve(n);
+  _depth.reserve(n);
+}
+
+int transformStore::add(const int parent,
+                        const glm::vec3 &position,
+                        const glm::quat &orientation,
+                        const glm::vec3 &scale) {
+
+  int node = _slot.size();
+  if (parent < -1 || parent >= node) {
+    std::stringstream msg;
+    msg << "transformStore: no node " << parent << " to be a parent.";
+    throw std::runtime_error(msg.str());
+  }
+
+  // New nodes go on the end, which spoils the order unless they
+  // happen to be no shallower than the last one.
+  int depth = (parent < 0) ? 0 : _depth[_slot[parent]] + 1;
+  if (!_depth.empty() && depth < _depth.back()) _sorted = false;
+
+  _slot.push_back(node);
+  _node.push_back(node);
+  _depth.push_back(depth);
+  _parent.push_back((parent < 0) ? -1 : _slot[parent]);
+
+  _px.push_back(position.x);
+  _py.push_back(position.y);
+  _pz.push_back(position.z);
+  _qx.push_back(orientation.x);
+  _qy.push_back(orientation.y);
+  _qz.push_back(orientation.z);
+  _qw.push_back(orientation.w);
+  _sx.push_back(scale.x);
+  _sy.push_back(scale.y);
+  _sz.push_back(scale.z);
+  for (int k = 0; k < 12; k++) _world[k].push_back((k % 4 == 0) ? 1.0f : 0.0f);
+
+  if (_sorted) {
+    if (depth >= (int)_levelStart.size()) _levelStart.push_back(node);
+  }
+  return node;
+}
+
+// Moves an array's entries into the new order.
+template <class T>
+static void permute(std::vector<T> &v, const std::vector<int> &from,
+                    std::vector<T> &scratch) {
+  scratch.resize(v.size());
+  for (size_t i = 0; i < v.size(); i++) scratch[i] = v[from[i]];
+  v.swap(scratch);
+}
+
+void transformStore::_sort() {
+
+  size_t n = _slot.size();
+
+  // Count the nodes at each depth, then hand out places, in the order
+  // the nodes are now in.
+  int maxDepth = 0;
+  for (size_t i = 0; i < n; i++) maxDepth = std::max(maxDepth, _depth[i]);
+
+  _levelStart.assign(maxDepth + 2, 0);
+  for (size_t i = 0; i < n; i++) _levelStart[_depth[i] + 1]++;
+  for (int d = 1; d <= maxDepth + 1; d++) _levelStart[d] += _levelStart[d - 1];
+
+  std::vector<size_t> next(_levelStart.begin(), _levelStart.end() - 1);
+  std::vector<int> from(n), to(n);
+  for (size_t i = 0; i < n; i++) {
+    size_t j = next[_depth[i]]++;
+    from[j] = i;
+    to[i] = j;
+  }
+  _levelStart.pop_back();
+
+  std::vector<int> intScratch;
+  permute(_depth, from, intScratch);
+  permute(_node, from, intScratch);
+  permute(_parent, from, intScratch);
+  for (size_t i = 0; i < n; i++) {
+    if (_parent[i] >= 0) _parent[i] = to[_parent[i]];
+  }
+  for (size_t i = 0; i < n; i++) _slot[_node[i]] = i;
+
+  std::vector<float> scratch;
+  permute(_px, from, scratch);
+  permute(_py, from, scratch);
+  permute(_pz, from, scratch);
+  permute(_qx, from, scratch);
+  permute(_qy, from, scratch);
+  permute(_qz, from, scratch);
+  permute(_qw, from, scratch);
+  permute(_sx, from, scratch);
+  permute(_sy, from, scratch);
+  permute(_sz, from, scratch);
+  for (int k = 0; k < 12; k++) permute(_world[k], from, scratch);
+
+  _sorted = true;
+}
+
+void transformStore::_updateOne(const size_t i) {
+
+  // The local matrix: the rotation, with each column stretched by its
+  // scale, and the position in the last column.  The rotation is as
+  // glm::mat3_cast() makes it.
+  float x = _qx[i], y = _qy[i], z = _qz[i], w = _qw[i];
+  float l[12];
+  l[0] = (1.0f - 2.0f * (y * y + z * z)) * _sx[i];
+  l[1] = 2.0f * (x * y + w * z) * _sx[i];
+  l[2] = 2.0f * (x * z - w * y) * _sx[i];
+  l[3] = 2.0f * (x * y - w * z) * _sy[i];
+  l[4] = (1.0f - 2.0f * (x * x + z * z)) * _sy[i];
+  l[5] = 2.0f * (y * z + w * x) * _sy[i];
+  l[6] = 2.0f * (x * z + w * y) * _sz[i];
+  l[7] = 2.0f * (y * z - w * x) * _sz[i];
+  l[8] = (1.0f - 2.0f * (x * x + y * y)) * _sz[i];
+  l[9] = _px[i];
+  l[10] = _py[i];
+  l[11] = _pz[i];
+
+  int p = _parent[i];
+  if (p < 0) {
+    for (int k = 0; k < 12; k++) _world[k][i] = l[k];
+    return;
+  }
+
+  // Each column of the world matrix is the parent's first three
+  // columns weighted by the local column, plus, for the last column,
+  // the parent's position.
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 3; r++) {
+      float sum = _world[r][p] * l[3 * c] +
+        _world[3 + r][p] * l[3 * c + 1] +
+        _world[6 + r][p] * l[3 * c + 2];
+      if (c == 3) sum += _world[9 + r][p];
+      _world[3 * c + r][i] = sum;
+    }
+  }
+}
+
+#ifdef __SSE__
+void transformStore::_updateFour(const size_t i) {
+
+  // Just as _updateOne(), with a node in each lane.
+  __m128 x = _mm_loadu_ps(&_qx[i]);
+  __m128 y = _mm_loadu_ps(&_qy[i]);
+  __m128 z = _mm_loadu_ps(&_qz[i]);
+  __m128 w = _mm_loadu_ps(&_qw[i]);
+  __m128 sx = _mm_loadu_ps(&_sx[i]);
+  __m128 sy = _mm_loadu_ps(&_sy[i]);
+  __m128 sz = _mm_loadu_ps(&_sz[i]);
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 two = _mm_set1_ps(2.0f);
+
+  __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+  __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+  __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+  __m128 l[12];
+  l[0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+  l[1] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+  l[2] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+  l[3] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+  l[4] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+  l[5] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+  l[6] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+  l[7] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+  l[8] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+  l[9] = _mm_loadu_ps(&_px[i]);
+  l[10] = _mm_loadu_ps(&_py[i]);
+  l[11] = _mm_loadu_ps(&_pz[i]);
+
+  if (_parent[i] < 0) {
+    for (int k = 0; k < 12; k++) _mm_storeu_ps(&_world[k][i], l[k]);
+    return;
+  }
+
+  // The parents are scattered through the level above, so they have
+  // to be gathered a float at a time.
+  int p0 = _parent[i], p1 = _parent[i + 1], p2 = _parent[i + 2], p3 = _parent[i + 3];
+  __m128 pm[12];
+  for (int k = 0; k < 12; k++) {
+    const float* pw = &_world[k][0];
+    pm[k] = _mm_set_ps(pw[p3], pw[p2], pw[p1], pw[p0]);
+  }
+
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 3; r++) {
+      __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pm[r], l[3 * c]),
+                                         _mm_mul_ps(pm[3 + r], l[3 * c + 1])),
+                              _mm_mul_ps(pm[6 + r], l[3 * c + 2]));
+      if (c == 3) sum = _mm_add_ps(sum, pm[9 + r]);
+      _mm_storeu_ps(&_world[3 * c + r][i], sum);
+    }
+  }
+}
+#else
+void transformStore::_updateFour(const size_t i) {
+  for (size_t j = i; j < i + 4; j++) _updateOne(j);
+}
+#endif
+
+void transformStore::update() {
+
+  if (!_sorted) _sort();
+
+  // A level's parents are all in the levels before it, so each level
+  // can be done in any order, four at a time, once those are done.
+  size_t n = _slot.size();
+  for (size_t d = 0; d < _levelStart.size(); d++) {
+    size_t end = (d + 1 < _levelStart.size()) ? _levelStart[d + 1] : n;
+    size_t i = _levelStart[d];
+    for (; i + 4 <= end; i += 4) _updateFour(i);
+    for (; i < end; i++) _updateOne(i);
+  }
+}
+
+void transformStore::updateScalar() {
+
+  if (!_sorted) _sort();
+
+  for (size_t i = 0; i < _slot.size(); i++) _updateOne(i);
+}
+
+glm::mat4 transformStore::getWorldMatrix(const int node) {
+
+  int i = _slot[node];
+  glm::mat4 out;
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 3; r++) out[c][r] = _world[3 * c + r][i];
+    out[c][3] = (c == 3) ? 1.0f : 0.0f;
+  }
+  return out;
+}
+
+void transformStore::getWorldMatrices(std::vector<glm::mat4> &matrices) {
+
+  matrices.resize(_slot.size());
+  for (size_t node = 0; node < _slot.size(); node++) {
+    matrices[node] = getWorldMatrix(node);
+  }
+}
+
+}
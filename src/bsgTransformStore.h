@@ -0,0 +1,132 @@
+#include "bsg.h"
+
+namespace bsg {
+
+/// \brief A great many transforms, kept together and updated at once.
+///
+/// Each drawableMulti keeps its own position, orientation, scale, and
+/// matrices, wherever it happens to be on the heap, so updating a
+/// large hierarchy spends most of its time waiting for memory.  This
+/// keeps the same things for many nodes in arrays, one per component
+/// (all the x positions together, and so on), with the parents before
+/// their children, grouped by depth.  The world matrices are then
+/// worked out in one pass from the start of the arrays to the end,
+/// four nodes at a time with SSE, where the compiler allows it.
+///
+/// A node is named by the number add() returns, which doesn't change
+/// when the nodes are rearranged.  Nodes can't be removed.  The world
+/// matrices are only right after update(); it is up to the caller to
+/// call it once per frame, after moving things and before using the
+/// matrices, for example to feed a drawableInstances:
+///
+///     bsg::transformStore store;
+///     int root = store.add();
+///     for (...) store.add(root, glm::vec3(x, 0.0f, z));
+///     ...
+///     // Each frame:
+///     store.setOrientation(root, spin);
+///     store.update();
+///     store.getWorldMatrices(matrices);
+///     forest->setInstances(matrices);
+///
+/// The matrices are assumed to be affine, as they are when made of a
+/// position, orientation and scale, so only their top three rows are
+/// kept and multiplied.
+class transformStore {
+ private:
+  // By position in the arrays.  The parent is a position too, or -1.
+  std::vector<int> _parent;
+  std::vector<float> _px, _py, _pz;
+  std::vector<float> _qx, _qy, _qz, _qw;
+  std::vector<float> _sx, _sy, _sz;
+  // The world matrices, as the top three rows of each column, column
+  // by column: _world[0] is row 0 of column 0, _world[1] is row 1, and
+  // so on, through _world[11], row 2 of column 3.
+  std::vector<float> _world[12];
+
+  // Where each node is, and which node is where.
+  std::vector<int> _slot;
+  std::vector<int> _node;
+  std::vector<int> _depth;
+
+  // The arrays are sorted by depth, and each depth starts here.
+  bool _sorted;
+  std::vector<size_t> _levelStart;
+
+  // Puts the nodes in order of depth, keeping the order within each.
+  void _sort();
+
+  // Work out the world matrix of the node at slot i, or of those at
+  // slots i through i + 3, all of which have parents if one does.
+  void _updateOne(const size_t i);
+  void _updateFour(const size_t i);
+
+ public:
+  transformStore() : _sorted(true) {};
+
+  /// \brief Makes room for this many nodes.
+  void reserve(const size_t n);
+
+  /// \brief Adds a node, under a parent node or at the top.
+  ///
+  /// The parent must already have been added.  Returns the new node's
+  /// number.  Throws std::runtime_error if there is no such parent.
+  int add(const int parent = -1,
+          const glm::vec3 &position = glm::vec3(0.0f, 0.0f, 0.0f),
+          const glm::quat &orientation = glm::quat(),
+          const glm::vec3 &scale = glm::vec3(1.0f, 1.0f, 1.0f));
+
+  size_t size() { return _slot.size(); };
+
+  void setPosition(const int node, const glm::vec3 &position) {
+    int i = _slot[node];
+    _px[i] = position.x;
+    _py[i] = position.y;
+    _pz[i] = position.z;
+  };
+  void setOrientation(const int node, const glm::quat &orientation) {
+    int i = _slot[node];
+    _qx[i] = orientation.x;
+    _qy[i] = orientation.y;
+    _qz[i] = orientation.z;
+    _qw[i] = orientation.w;
+  };
+  void setScale(const int node, const glm::vec3 &scale) {
+    int i = _slot[node];
+    _sx[i] = scale.x;
+    _sy[i] = scale.y;
+    _sz[i] = scale.z;
+  };
+
+  glm::vec3 getPosition(const int node) {
+    int i = _slot[node];
+    return glm::vec3(_px[i], _py[i], _pz[i]);
+  };
+  glm::quat getOrientation(const int node) {
+    int i = _slot[node];
+    return glm::quat(_qw[i], _qx[i], _qy[i], _qz[i]);
+  };
+  glm::vec3 getScale(const int node) {
+    int i = _slot[node];
+    return glm::vec3(_sx[i], _sy[i], _sz[i]);
+  };
+
+  /// \brief Works out every world matrix.
+  ///
+  /// The first time after nodes are added, they are sorted first.
+  void update();
+
+  /// \brief Does what update() does, one node at a time.
+  ///
+  /// This is for checking update(), and for timing it against; see
+  /// transformBench.
+  void updateScalar();
+
+  /// \brief A node's world matrix, as of the last update().
+  glm::mat4 getWorldMatrix(const int node);
+
+  /// \brief All the world matrices, in order of node number.
+  void getWorldMatrices(std::vector<glm::mat4> &matrices);
+};
+
+}
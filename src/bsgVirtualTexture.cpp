@@ -0,0 +1,645 @@
+#include "bsgVirtualTexture.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <limits>
+#include <functional>
+
+namespace bsg {
+
+  // A tile file starts with this header, in native byte order, and
+  // the tiles follow, level by level, each level a row at a time from
+  // the top, each tile as (tileSize + 2 * border) rows of RGBA pixels,
+  // also from the top.
+  class tileFileHeader {
+  public:
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t tileSize, border;
+    uint32_t nLevels;
+  };
+
+  static const char tileFileMagic[8] = { 'b', 's', 'g', 't', 'i', 'l', 'e', 0 };
+
+  // The feedback pass writes level 15 where there's nothing, and tile
+  // numbers get ten bits apiece, so those are the limits.
+  static const int maxLevels = 15;
+  static const GLsizei maxTilesPerSide = 1024;
+
+  // Works out the sizes of the levels, and where their tiles start.
+  // Each level is half the one above, rounded down, until one fits
+  // in a single tile.
+  static size_t tileLevels(const GLsizei width, const GLsizei height,
+                           const GLsizei tileSize,
+                           std::vector<virtualTextureLevel> &levels) {
+    levels.clear();
+    size_t nTiles = 0;
+    GLsizei w = width, h = height;
+    while (true) {
+      virtualTextureLevel level;
+      level.width = w;
+      level.height = h;
+      level.tilesWide = (w + tileSize - 1) / tileSize;
+      level.tilesHigh = (h + tileSize - 1) / tileSize;
+      level.firstTile = nTiles;
+      nTiles += (size_t)level.tilesWide * level.tilesHigh;
+      levels.push_back(level);
+
+      if ((w <= tileSize) && (h <= tileSize)) break;
+      w = std::max(1, w / 2);
+      h = std::max(1, h / 2);
+    }
+    return nTiles;
+  }
+
+  // One level of the pyramid being cut into tiles by makeTiles().  The
+  // rows of the level arrive from the top down.  A strip of them, one
+  // row of tiles and the borders above and below, is kept, and when
+  // it is complete its tiles are written out.  Meanwhile, the rows
+  // are averaged in pairs to make the rows of the next level.
+  class tileStrip {
+  public:
+    virtualTextureLevel level;
+    GLsizei tileSize, border;
+    // The first image row of the row of tiles being filled in.  The
+    // strip starts border rows above that.
+    GLsizei top;
+    GLsizei nextRow;
+    std::vector<unsigned char> rows;
+    // The even row of a pair, waiting for the odd one.
+    std::vector<unsigned char> pending;
+
+    tileStrip(const virtualTextureLevel &l, const GLsizei t, const GLsizei b) :
+      level(l), tileSize(t), border(b), top(0), nextRow(0) {
+      rows.resize((size_t)(tileSize + 2 * border) * level.width * 4);
+    };
+
+    unsigned char* row(const GLsizei y) {
+      return &rows[(size_t)(y - (top - border)) * level.width * 4];
+    };
+  };
+
+  // Averages two rows into one half as wide, rounding down an odd
+  // width, the same way textureImage::halve() does.
+  static void halveRows(const unsigned char* a, const unsigned char* b,
+                        const GLsizei width, std::vector<unsigned char> &out) {
+    GLsizei outWidth = std::max(1, width / 2);
+    out.resize((size_t)outWidth * 4);
+    for (GLsizei x = 0; x < outWidth; x++) {
+      GLsizei x0 = (width == 1) ? 0 : 2 * x;
+      GLsizei x1 = (width == 1) ? 0 : 2 * x + 1;
+      for (int c = 0; c < 4; c++) {
+        out[4 * x + c] = (a[4 * x0 + c] + a[4 * x1 + c] +
+                          b[4 * x0 + c] + b[4 * x1 + c] + 2) / 4;
+      }
+    }
+  }
+
+  class tileWriter {
+  private:
+    int _fd;
+    std::string _fileName;
+    size_t _tileBytes;
+    std::vector<tileStrip> _strips;
+    std::vector<unsigned char> _tile;
+
+    bool _writeTiles(tileStrip &s) {
+
+      GLsizei slotSize = s.tileSize + 2 * s.border;
+      GLsizei ty = s.top / s.tileSize;
+      for (GLsizei tx = 0; tx < s.level.tilesWide; tx++) {
+
+        unsigned char* out = &_tile[0];
+        for (GLsizei j = 0; j < slotSize; j++) {
+          GLsizei y = s.top - s.border + j;
+          y = std::min(std::max(y, 0), s.level.height - 1);
+          const unsigned char* in = s.row(y);
+          for (GLsizei i = 0; i < slotSize; i++) {
+            GLsizei x = tx * s.tileSize - s.border + i;
+            x = std::min(std::max(x, 0), s.level.width - 1);
+            memcpy(out, in + 4 * x, 4);
+            out += 4;
+          }
+        }
+
+        size_t tile = s.level.firstTile + ty * s.level.tilesWide + tx;
+        off_t offset = sizeof(tileFileHeader) + (off_t)tile * _tileBytes;
+        if (pwrite(_fd, &_tile[0], _tileBytes, offset) != (ssize_t)_tileBytes) {
+          perror(_fileName.c_str());
+          return false;
+        }
+      }
+      return true;
+    }
+
+  public:
+    tileWriter(int fd, const std::string &fileName,
+               const std::vector<virtualTextureLevel> &levels,
+               const GLsizei tileSize, const GLsizei border) :
+      _fd(fd), _fileName(fileName) {
+      GLsizei slotSize = tileSize + 2 * border;
+      _tileBytes = (size_t)slotSize * slotSize * 4;
+      _tile.resize(_tileBytes);
+      for (std::vector<virtualTextureLevel>::const_iterator it = levels.begin();
+           it != levels.end(); it++) {
+        _strips.push_back(tileStrip(*it, tileSize, border));
+      }
+    };
+
+    // Takes the next row of a level, from the top.
+    bool addRow(const size_t l, const unsigned char* in) {
+
+      tileStrip &s = _strips[l];
+      GLsizei y = s.nextRow++;
+      memcpy(s.row(y), in, (size_t)s.level.width * 4);
+
+      // Finish every row of tiles that now has all its rows.  The last
+      // row of the image can finish two, if the last row of tiles is
+      // shorter than the border.
+      while ((s.top < s.level.height) &&
+             (y == std::min(s.top + s.tileSize + s.border, s.level.height) - 1)) {
+        if (!_writeTiles(s)) return false;
+
+        // The rows the next row of tiles shares with this one move up.
+        size_t rowBytes = (size_t)s.level.width * 4;
+        memmove(&s.rows[0], &s.rows[s.tileSize * rowBytes],
+                2 * s.border * rowBytes);
+        s.top += s.tileSize;
+      }
+
+      if (l + 1 == _strips.size()) return true;
+
+      // A level one row high makes each row of the next from itself.
+      // Otherwise the rows go in pairs, and an odd last row is
+      // dropped.
+      std::vector<unsigned char> half;
+      if (s.level.height == 1) {
+        halveRows(in, in, s.level.width, half);
+      } else if ((y % 2) == 0) {
+        s.pending.assign(in, in + (size_t)s.level.width * 4);
+        return true;
+      } else {
+        halveRows(&s.pending[0], in, s.level.width, half);
+      }
+      return addRow(l + 1, &half[0]);
+    }
+  };
+
+bool virtualTexture::makeTiles(const std::string &pngName,
+                               const std::string &tileName,
+                               const GLsizei tileSize, const GLsizei border) {
+
+  if ((tileSize < 2) || (tileSize % 2) || (border < 0) || (border > tileSize / 2)) {
+    std::cerr << "Can't make tiles " << tileSize << " pixels wide, with "
+              << border << " pixels of border." << std::endl;
+    return false;
+  }
+
+  pngFile png;
+  if (!png.open(pngName)) return false;
+  if (png.interlaced) {
+    std::cerr << pngName << ": can't make tiles from an interlaced PNG, "
+              << "since it can't be read a row at a time." << std::endl;
+    return false;
+  }
+
+  std::vector<virtualTextureLevel> levels;
+  size_t nTiles = tileLevels(png.width, png.height, tileSize, levels);
+  if ((levels.size() > (size_t)maxLevels) ||
+      (levels[0].tilesWide > maxTilesPerSide) ||
+      (levels[0].tilesHigh > maxTilesPerSide)) {
+    std::cerr << pngName << ": too big for " << tileSize
+              << " pixel tiles; use bigger ones." << std::endl;
+    return false;
+  }
+
+  int fd = open(tileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(tileName.c_str());
+    return false;
+  }
+
+  tileFileHeader header;
+  memcpy(header.magic, tileFileMagic, sizeof(header.magic));
+  header.version = 1;
+  header.width = png.width;
+  header.height = png.height;
+  header.tileSize = tileSize;
+  header.border = border;
+  header.nLevels = levels.size();
+
+  GLsizei slotSize = tileSize + 2 * border;
+  off_t fileSize = sizeof(header) + (off_t)nTiles * slotSize * slotSize * 4;
+  if ((write(fd, &header, sizeof(header)) != sizeof(header)) ||
+      (ftruncate(fd, fileSize) != 0)) {
+    perror(tileName.c_str());
+    close(fd);
+    return false;
+  }
+
+  tileWriter writer(fd, tileName, levels, tileSize, border);
+  std::vector<unsigned char> in(png.rowBytes), rgba((size_t)png.width * 4);
+  bool ok = true;
+  for (GLsizei y = 0; ok && (y < png.height); y++) {
+    png.readRow(&in[0]);
+    if (png.format == GL_RGBA) {
+      ok = writer.addRow(0, &in[0]);
+    } else {
+      for (GLsizei x = 0; x < png.width; x++) {
+        rgba[4 * x] = in[3 * x];
+        rgba[4 * x + 1] = in[3 * x + 1];
+        rgba[4 * x + 2] = in[3 * x + 2];
+        rgba[4 * x + 3] = 255;
+      }
+      ok = writer.addRow(0, &rgba[0]);
+    }
+  }
+
+  if (close(fd) != 0) {
+    perror(tileName.c_str());
+    ok = false;
+  }
+  return ok;
+}
+
+virtualTexture::virtualTexture(const std::string &fileName,
+                               const int slotsPerSide) :
+  _fd(-1), _map(NULL), _mapSize(0), _tiles(NULL), _nTiles(0),
+  _cacheID(0), _slotsPerSide(slotsPerSide), _tableID(0),
+  _tableWidth(0), _tableHeight(0), _dirtyMin(0), _dirtyMax(-1),
+  _frame(0), _uploadsPerFrame(16), _feedbackScale(8), _inFeedback(false),
+  _cacheUniform(-1), _tableUniform(-1), _tableSizeUniform(-1),
+  _paramsUniform(-1), _levelsUniform(-1), _maxLevelUniform(-1),
+  _feedbackUniform(-1), _lodBiasUniform(-1) {
+
+  _openFile(fileName);
+  _setupCache();
+
+  // The coarsest level is a single tile, and is always there, so
+  // every page table entry has somewhere to point.
+  int top = _levels.size() - 1;
+  _setSlot(top, 0, 0, 0);
+  _slotFrame[0] = std::numeric_limits<unsigned int>::max();
+  _uploadTable();
+}
+
+void virtualTexture::_openFile(const std::string &fileName) {
+
+  _fd = open(fileName.c_str(), O_RDONLY);
+  struct stat st;
+  if ((_fd < 0) || (fstat(_fd, &st) != 0))
+    throw std::runtime_error("Can't read tile file " + fileName);
+  _mapSize = st.st_size;
+
+  tileFileHeader header;
+  if ((_mapSize < sizeof(header)) ||
+      (read(_fd, &header, sizeof(header)) != sizeof(header)) ||
+      memcmp(header.magic, tileFileMagic, sizeof(header.magic)) ||
+      (header.version != 1))
+    throw std::runtime_error(fileName + " is not a tile file.");
+
+  _tileSize = header.tileSize;
+  _border = header.border;
+  _slotSize = _tileSize + 2 * _border;
+  _width = header.width;
+  _height = header.height;
+  _nTiles = tileLevels(header.width, header.height, _tileSize, _levels);
+
+  size_t tileBytes = (size_t)_slotSize * _slotSize * 4;
+  if ((_levels.size() != header.nLevels) ||
+      (_levels.size() > (size_t)maxLevels) ||
+      (_mapSize < sizeof(header) + _nTiles * tileBytes))
+    throw std::runtime_error(fileName + " is damaged or cut short.");
+
+  void* map = mmap(NULL, _mapSize, PROT_READ, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED)
+    throw std::runtime_error("Can't map tile file " + fileName);
+  _map = (const unsigned char*)map;
+  _tiles = _map + sizeof(header);
+
+  // Level 0's entries go at the left of the page table, and the rest
+  // are stacked to its right.
+  _tableWidth = _levels[0].tilesWide;
+  _tableHeight = _levels[0].tilesHigh;
+  if (_levels.size() > 1) {
+    GLsizei y = 0;
+    for (size_t l = 1; l < _levels.size(); l++) {
+      _levels[l].tableX = _levels[0].tilesWide;
+      _levels[l].tableY = y;
+      y += _levels[l].tilesHigh;
+    }
+    _tableWidth += _levels[1].tilesWide;
+    _tableHeight = std::max(_tableHeight, y);
+  }
+}
+
+void virtualTexture::_setupCache() {
+
+  GLint maxSize;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+  if ((_tableWidth > maxSize) || (_tableHeight > maxSize)) {
+    std::stringstream msg;
+    msg << "The page table for this virtual texture would be " << _tableWidth
+        << "x" << _tableHeight << ", which is too big for OpenGL.";
+    throw std::runtime_error(msg.str());
+  }
+
+  // The page table holds slot positions in a byte apiece.
+  int slots = std::min(std::min(_slotsPerSide, (int)(maxSize / _slotSize)), 256);
+  if (slots < _slotsPerSide) {
+    std::cerr << "** Caution: virtual texture cache cut to " << slots << "x"
+              << slots << " tiles." << std::endl;
+  }
+  _slotsPerSide = std::max(1, slots);
+
+  _slotTile.assign(_slotsPerSide * _slotsPerSide, -1);
+  _slotFrame.assign(_slotTile.size(), 0);
+  _tileSlot.assign(_nTiles, -1);
+  _table.assign((size_t)_tableWidth * _tableHeight * 4, 0);
+  _dirtyMin = 0;
+  _dirtyMax = _tableHeight - 1;
+
+  GLsizei cacheSize = _slotsPerSide * _slotSize;
+  glGenTextures(1, &_cacheID);
+  glBindTexture(GL_TEXTURE_2D, _cacheID);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cacheSize, cacheSize, 0,
+               GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+  glGenTextures(1, &_tableID);
+  glBindTexture(GL_TEXTURE_2D, _tableID);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, _tableWidth, _tableHeight, 0,
+               GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+virtualTexture::~virtualTexture() {
+
+  if (_cacheID) glDeleteTextures(1, &_cacheID);
+  if (_tableID) glDeleteTextures(1, &_tableID);
+  if (_map) munmap((void*)_map, _mapSize);
+  if (_fd >= 0) close(_fd);
+}
+
+void virtualTexture::_setSlot(const int level, const GLsizei tx,
+                              const GLsizei ty, const int slot) {
+
+  size_t tile = _tileIndex(level, tx, ty);
+  if (slot >= 0) {
+    size_t tileBytes = (size_t)_slotSize * _slotSize * 4;
+    glBindTexture(GL_TEXTURE_2D, _cacheID);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % _slotsPerSide) * _slotSize,
+                    (slot / _slotsPerSide) * _slotSize, _slotSize, _slotSize,
+                    GL_RGBA, GL_UNSIGNED_BYTE, _tiles + tile * tileBytes);
+    bsgStats::bytesUploaded += tileBytes;
+
+    _slotTile[slot] = tile;
+    _slotFrame[slot] = _frame;
+  } else if (_tileSlot[tile] >= 0) {
+    _slotTile[_tileSlot[tile]] = -1;
+  }
+  _tileSlot[tile] = slot;
+  _updateTable(level, tx, ty);
+}
+
+void virtualTexture::_updateTable(const int level, const GLsizei tx,
+                                  const GLsizei ty) {
+
+  // The tiles under this one, level by level.  A tile past the edge of
+  // its parent level belongs to that level's last tile, so when the
+  // range reaches the edge, it takes in the rest of the level below.
+  GLsizei x0 = tx, x1 = tx + 1, y0 = ty, y1 = ty + 1;
+  for (int k = level; k >= 0; k--) {
+
+    const virtualTextureLevel &l = _levels[k];
+    if (k < level) {
+      const virtualTextureLevel &parent = _levels[k + 1];
+      x1 = (x1 == parent.tilesWide) ? l.tilesWide : std::min(2 * x1, l.tilesWide);
+      y1 = (y1 == parent.tilesHigh) ? l.tilesHigh : std::min(2 * y1, l.tilesHigh);
+      x0 = 2 * x0;
+      y0 = 2 * y0;
+    }
+
+    for (GLsizei y = y0; y < y1; y++) {
+      for (GLsizei x = x0; x < x1; x++) {
+        unsigned char* entry =
+          &_table[4 * ((size_t)(l.tableY + y) * _tableWidth + l.tableX + x)];
+        int slot = _tileSlot[_tileIndex(k, x, y)];
+        if (slot >= 0) {
+          entry[0] = slot % _slotsPerSide;
+          entry[1] = slot / _slotsPerSide;
+          entry[2] = k;
+          entry[3] = 255;
+        } else if (k + 1 < (int)_levels.size()) {
+          const virtualTextureLevel &parent = _levels[k + 1];
+          GLsizei px = std::min(x / 2, parent.tilesWide - 1);
+          GLsizei py = std::min(y / 2, parent.tilesHigh - 1);
+          memcpy(entry, &_table[4 * ((size_t)(parent.tableY + py) * _tableWidth +
+                                     parent.tableX + px)], 4);
+        } else {
+          memset(entry, 0, 4);
+        }
+      }
+    }
+
+    _dirtyMin = std::min(_dirtyMin, l.tableY + y0);
+    _dirtyMax = std::max(_dirtyMax, l.tableY + y1 - 1);
+  }
+}
+
+void virtualTexture::_uploadTable() {
+
+  if (_dirtyMin > _dirtyMax) return;
+
+  glBindTexture(GL_TEXTURE_2D, _tableID);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, _dirtyMin, _tableWidth,
+                  _dirtyMax - _dirtyMin + 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                  &_table[4 * (size_t)_dirtyMin * _tableWidth]);
+  bsgStats::bytesUploaded += 4 * (size_t)(_dirtyMax - _dirtyMin + 1) * _tableWidth;
+
+  _dirtyMin = _tableHeight;
+  _dirtyMax = -1;
+}
+
+int virtualTexture::_findSlot() {
+
+  int oldest = -1;
+  for (size_t s = 0; s < _slotTile.size(); s++) {
+    if (_slotTile[s] < 0) return s;
+    if ((_slotFrame[s] < _frame) &&
+        ((oldest < 0) || (_slotFrame[s] < _slotFrame[oldest]))) oldest = s;
+  }
+  return oldest;
+}
+
+void virtualTexture::beginFeedback() {
+
+  glGetIntegerv(GL_VIEWPORT, _viewport);
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, _clearColor);
+
+  glViewport(_viewport[0], _viewport[1],
+             std::max(1, _viewport[2] / _feedbackScale),
+             std::max(1, _viewport[3] / _feedbackScale));
+  glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glClearColor(_clearColor[0], _clearColor[1], _clearColor[2], _clearColor[3]);
+
+  _inFeedback = true;
+}
+
+void virtualTexture::endFeedback() {
+
+  GLsizei w = std::max(1, _viewport[2] / _feedbackScale);
+  GLsizei h = std::max(1, _viewport[3] / _feedbackScale);
+  _feedback.resize((size_t)w * h * 4);
+  glReadPixels(_viewport[0], _viewport[1], w, h, GL_RGBA, GL_UNSIGNED_BYTE,
+               &_feedback[0]);
+
+  glViewport(_viewport[0], _viewport[1], _viewport[2], _viewport[3]);
+  _inFeedback = false;
+  _frame++;
+
+  // Each pixel is a tile: red and green are the low eight bits of its
+  // column and row, and blue holds their top two bits and the level.
+  // The wanted tiles are kept as level << 20 | row << 10 | column, so
+  // sorting them from the top puts the coarse ones first.
+  std::vector<size_t> wanted;
+  for (size_t p = 0; p < _feedback.size(); p += 4) {
+    const unsigned char* pixel = &_feedback[p];
+    int level = pixel[2] >> 4;
+    if (level >= (int)_levels.size()) continue;
+    GLsizei tx = pixel[0] | ((pixel[2] & 3) << 8);
+    GLsizei ty = pixel[1] | (((pixel[2] >> 2) & 3) << 8);
+    if ((tx >= _levels[level].tilesWide) || (ty >= _levels[level].tilesHigh))
+      continue;
+    wanted.push_back((level << 20) | (ty << 10) | tx);
+  }
+  std::sort(wanted.begin(), wanted.end());
+  wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+  // A tile's ancestors are wanted too, so there's something to show
+  // while it loads, and so that zooming out is quick.
+  size_t nWanted = wanted.size();
+  for (size_t i = 0; i < nWanted; i++) {
+    int level = wanted[i] >> 20;
+    GLsizei tx = wanted[i] & 1023, ty = (wanted[i] >> 10) & 1023;
+    for (int k = level + 1; k < (int)_levels.size(); k++) {
+      tx = std::min(tx / 2, _levels[k].tilesWide - 1);
+      ty = std::min(ty / 2, _levels[k].tilesHigh - 1);
+      wanted.push_back((k << 20) | (ty << 10) | tx);
+    }
+  }
+  std::sort(wanted.begin(), wanted.end(), std::greater<size_t>());
+  wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+  _serveRequests(wanted);
+  _uploadTable();
+}
+
+void virtualTexture::_serveRequests(const std::vector<size_t> &wanted) {
+
+  // Mark everything wanted that's already in, so none of it is
+  // thrown out to make room.
+  for (std::vector<size_t>::const_iterator it = wanted.begin();
+       it != wanted.end(); it++) {
+    int level = *it >> 20;
+    int slot = _tileSlot[_tileIndex(level, *it & 1023, (*it >> 10) & 1023)];
+    if (slot >= 0) _slotFrame[slot] = std::max(_slotFrame[slot], _frame);
+  }
+
+  int uploads = 0;
+  for (std::vector<size_t>::const_iterator it = wanted.begin();
+       it != wanted.end() && (uploads < _uploadsPerFrame); it++) {
+    int level = *it >> 20;
+    GLsizei tx = *it & 1023, ty = (*it >> 10) & 1023;
+    if (_tileSlot[_tileIndex(level, tx, ty)] >= 0) continue;
+
+    // If the cache is full of tiles wanted this frame, the rest will
+    // have to make do with their ancestors.
+    int slot = _findSlot();
+    if (slot < 0) break;
+
+    if (_slotTile[slot] >= 0) {
+      // Find out where the old tile was, and take it out.
+      size_t old = _slotTile[slot];
+      int oldLevel = _levels.size() - 1;
+      while (_levels[oldLevel].firstTile > old) oldLevel--;
+      size_t n = old - _levels[oldLevel].firstTile;
+      _setSlot(oldLevel, n % _levels[oldLevel].tilesWide,
+               n / _levels[oldLevel].tilesWide, -1);
+    }
+    _setSlot(level, tx, ty, slot);
+    uploads++;
+  }
+}
+
+void virtualTexture::load(shaderMgr &shader) {
+
+  _cacheUniform = shader.getUniformID("vtCache");
+  _tableUniform = shader.getUniformID("vtPageTable");
+  _tableSizeUniform = shader.getUniformID("vtTableSize");
+  _paramsUniform = shader.getUniformID("vtParams");
+  _levelsUniform = shader.getUniformID("vtLevels");
+  _maxLevelUniform = shader.getUniformID("vtMaxLevel");
+  _feedbackUniform = shader.getUniformID("vtFeedback");
+  _lodBiasUniform = shader.getUniformID("vtLodBias");
+}
+
+void virtualTexture::draw() {
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, _tableID);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, _cacheID);
+
+  glUniform1i(_cacheUniform, 0);
+  glUniform1i(_tableUniform, 1);
+  bsgStats::textureSwitches++;
+  glUniform2f(_tableSizeUniform, _tableWidth, _tableHeight);
+  glUniform4f(_paramsUniform, _tileSize, _border, _slotSize,
+              _slotsPerSide * _slotSize);
+
+  // Per level: where its entries are in the page table, and its size.
+  std::vector<GLfloat> levels;
+  for (std::vector<virtualTextureLevel>::iterator it = _levels.begin();
+       it != _levels.end(); it++) {
+    levels.push_back(it->tableX);
+    levels.push_back(it->tableY);
+    levels.push_back(it->width);
+    levels.push_back(it->height);
+  }
+  glUniform4fv(_levelsUniform, _levels.size(), &levels[0]);
+  glUniform1f(_maxLevelUniform, _levels.size() - 1);
+
+  // The feedback pass has fewer pixels, so it would pick coarser
+  // levels than the real one, if not for the bias.
+  glUniform1f(_feedbackUniform, _inFeedback ? 1.0f : 0.0f);
+  glUniform1f(_lodBiasUniform, _inFeedback ? -log2f(_feedbackScale) : 0.0f);
+}
+
+size_t virtualTexture::getBytes() {
+  size_t cacheSize = _slotsPerSide * _slotSize;
+  return 4 * (cacheSize * cacheSize + (size_t)_tableWidth * _tableHeight);
+}
+
+size_t virtualTexture::getNumResident() {
+  size_t n = 0;
+  for (std::vector<int>::iterator it = _slotTile.begin();
+       it != _slotTile.end(); it++) {
+    if (*it >= 0) n++;
+  }
+  return n;
+}
+
+}
@@ -0,0 +1,194 @@
+#include "bsg.h"
+
+namespace bsg {
+
+/// \brief One level of a tile file's mipmap pyramid.
+class virtualTextureLevel {
+ public:
+  /// The size of the level, in pixels.
+  GLsizei width, height;
+  /// How many tiles it takes to cover it.
+  GLsizei tilesWide, tilesHigh;
+  /// The index of its first tile, counting the levels before it.
+  size_t firstTile;
+  /// Where its entries are in the page table.
+  GLsizei tableX, tableY;
+
+ virtualTextureLevel() : width(0), height(0), tilesWide(0), tilesHigh(0),
+    firstTile(0), tableX(0), tableY(0) {};
+};
+
+/// \brief A texture too big for OpenGL, drawn a piece at a time.
+///
+/// Some images are far larger than any texture OpenGL will take, or
+/// than will fit in video memory.  A virtual texture cuts the image
+/// and its mipmaps into square tiles, ahead of time, with makeTiles(),
+/// and keeps only the tiles being looked at in a fixed-size cache
+/// texture.  A small page table texture says, for every tile of every
+/// level, where in the cache it is, or, if it isn't there, where its
+/// nearest loaded ancestor is, so that a missing tile is drawn
+/// blurry rather than not at all.  The coarsest level is always
+/// loaded.
+///
+/// Which tiles are wanted is found out with a feedback pass: the
+/// objects using the texture are drawn at low resolution, with the
+/// shader writing out the tile each pixel would like instead of a
+/// color.  Those tiles, and their ancestors, are loaded, coarse ones
+/// first, no more than a set number per frame, replacing the ones
+/// that have gone the longest without being used.  The video memory
+/// used is the cache plus the page table, which takes four bytes per
+/// tile, however big the image is; the tile file is mapped into
+/// memory, not read, so the operating system decides how much of it
+/// to keep around.
+///
+/// It has to be drawn with virtualTexture.fp (and textureShader.vp),
+/// which do the page table lookups.  Use it like this:
+///
+///     bsg::bsgPtr<bsg::virtualTexture> vt =
+///       new bsg::virtualTexture("huge.bsgtiles");
+///     shader->addShader(bsg::GLSHADER_VERTEX, "textureShader.vp");
+///     shader->addShader(bsg::GLSHADER_FRAGMENT, "virtualTexture.fp");
+///     shader->addTexture(vt);
+///     ...
+///     // Each frame:
+///     scene.load();
+///     vt->beginFeedback();
+///     scene.draw(scene.getViewMatrix(), scene.getProjMatrix());
+///     vt->endFeedback();
+///     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+///     scene.draw(scene.getViewMatrix(), scene.getProjMatrix());
+///
+/// Everything drawn in the feedback pass is read back as tile
+/// requests, so only objects using this texture should be drawn
+/// there; other objects' colors would be taken for requests.  The
+/// tile requests don't say which virtual texture they are for, so
+/// each needs a feedback pass of its own.
+class virtualTexture : public textureMgr {
+ private:
+  // The tile file, mapped into memory.
+  int _fd;
+  const unsigned char* _map;
+  size_t _mapSize;
+  const unsigned char* _tiles;
+
+  GLsizei _tileSize, _border, _slotSize;
+  std::vector<virtualTextureLevel> _levels;
+  size_t _nTiles;
+
+  // The cache: _slotsPerSide squared slots, each holding one tile and
+  // its border.  What's in each slot, and when it was last wanted.
+  GLuint _cacheID;
+  int _slotsPerSide;
+  std::vector<int> _slotTile;
+  std::vector<unsigned int> _slotFrame;
+  // The slot each tile is in, or -1.
+  std::vector<int> _tileSlot;
+
+  // The page table, as RGBA: the slot's column and row, the level of
+  // the tile actually in it, and 255.  Rows _dirtyMin to _dirtyMax
+  // have changed since it was last sent to OpenGL.
+  GLuint _tableID;
+  GLsizei _tableWidth, _tableHeight;
+  std::vector<unsigned char> _table;
+  GLsizei _dirtyMin, _dirtyMax;
+
+  unsigned int _frame;
+  int _uploadsPerFrame;
+
+  // The feedback pass.
+  int _feedbackScale;
+  bool _inFeedback;
+  GLint _viewport[4];
+  GLfloat _clearColor[4];
+  std::vector<unsigned char> _feedback;
+
+  // Shader uniforms.
+  GLint _cacheUniform, _tableUniform, _tableSizeUniform, _paramsUniform;
+  GLint _levelsUniform, _maxLevelUniform, _feedbackUniform, _lodBiasUniform;
+
+  // Index of a tile, by level and position, top row first.
+  size_t _tileIndex(const int level, const GLsizei tx, const GLsizei ty) {
+    return _levels[level].firstTile + ty * _levels[level].tilesWide + tx;
+  };
+
+  void _openFile(const std::string &fileName);
+  void _setupCache();
+
+  // Puts a tile in a slot, or takes it out, with slot -1, and fixes
+  // the page table entries that depend on it.
+  void _setSlot(const int level, const GLsizei tx, const GLsizei ty,
+                const int slot);
+  // Redoes the page table entries of a tile and everything under it.
+  void _updateTable(const int level, const GLsizei tx, const GLsizei ty);
+  void _uploadTable();
+
+  // Finds a slot for a new tile: an empty one, or else the one unused
+  // the longest, as long as it wasn't wanted this frame.  Returns -1
+  // if there isn't one.
+  int _findSlot();
+
+  // Loads the wanted tiles that aren't in yet, within the budget.
+  void _serveRequests(const std::vector<size_t> &wanted);
+
+ public:
+  /// \brief Opens a tile file made by makeTiles().
+  ///
+  /// The cache holds slotsPerSide squared tiles; it is made smaller
+  /// if OpenGL can't have a texture that big.  Throws
+  /// std::runtime_error if the file can't be read.
+  virtualTexture(const std::string &fileName, const int slotsPerSide = 16);
+  ~virtualTexture();
+
+  /// \brief Makes a tile file from a PNG file.
+  ///
+  /// The image is read a row at a time, and each mipmap level is made
+  /// from the rows of the one above as they come, so only a strip of
+  /// tiles per level is ever in memory.  The levels stop at the first
+  /// that fits in one tile.  Each tile is tileSize pixels square, with
+  /// border pixels more on each side copied from its neighbors, so it
+  /// can be filtered at its edges.  Returns false, after complaining,
+  /// if the PNG file can't be read or the tile file can't be written.
+  static bool makeTiles(const std::string &pngName, const std::string &tileName,
+                        const GLsizei tileSize = 128, const GLsizei border = 1);
+
+  /// \brief How many tiles may be loaded each frame.
+  ///
+  /// Each is a glTexSubImage2D() of about 64KB, with the default tile
+  /// size.  The default is 16.
+  void setUploadsPerFrame(const int n) { _uploadsPerFrame = n; };
+
+  /// \brief How much smaller than the window the feedback pass is.
+  ///
+  /// The default is 8: one pixel of feedback for each 8x8 of the
+  /// window.  Smaller numbers catch smaller pieces of the texture, at
+  /// more cost.
+  void setFeedbackScale(const int scale) { _feedbackScale = std::max(1, scale); };
+
+  /// \brief Starts the feedback pass.
+  ///
+  /// Shrinks the viewport, clears it to white, which means no tile,
+  /// and sets the shader to write tile requests.  Draw the objects
+  /// that use this texture next.
+  void beginFeedback();
+
+  /// \brief Ends the feedback pass and loads the tiles it asked for.
+  ///
+  /// Reads back the requests, puts back the viewport, and loads tiles
+  /// up to the per-frame limit.  The color buffer is left holding the
+  /// requests, so clear it before drawing for real.
+  void endFeedback();
+
+  void load(shaderMgr &shader);
+  void draw();
+
+  /// The cache and page table's share of video memory.
+  size_t getBytes();
+
+  int getNumLevels() { return _levels.size(); };
+  size_t getNumTiles() { return _nTiles; };
+  /// How many tiles are in the cache now, and how many it can hold.
+  size_t getNumResident();
+  size_t getNumSlots() { return _slotTile.size(); };
+};
+
+}
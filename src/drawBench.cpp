@@ -0,0 +1,216 @@
+#include "bsg.h"
+#include "bsgObjModel.h"
+#include "bsgInstances.h"
+
+// A benchmark for the drawing side of the bsg classes.  It loads one
+// model and draws it many times per frame at different positions, so
+// that the time per frame is dominated by the per-draw work: binding
+// buffers, pointing attributes, and fetching vertices.  The same model
+// is timed once for each buffer layout, with and without vertex array
+// objects, so they can be compared.  Besides the time per frame, the
+// time the CPU spends issuing the draws, before the buffer swap, is
+// shown, since that is what the vertex array objects save.  Try it
+// with 10000 copies to see the difference.
+//
+// Then the copies are drawn as one drawableInstances, in each of the
+// ways this graphics card can do that.  Those copies stand still, so
+// their matrices are only sent once; try 100000 of them.
+//
+// Usage: bin/drawBench [model.obj] [copies] [frames]
+//
+// Run it from the build directory, like the demos, so it can find the
+// shaders in ../src.
+
+// The number of frames to draw before we start timing, to let the
+// driver settle down.
+const int warmupFrames = 10;
+
+// Wall clock time in milliseconds.
+double now() {
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec * 1000.0 + tp.tv_usec / 1000.0;
+}
+
+// The copies are laid out in a cube-ish grid, this many on a side.
+int gridSide(const int copies) {
+  return (int)ceil(pow(copies, 1.0 / 3.0));
+}
+
+glm::vec3 gridPosition(const int i, const int side) {
+  return glm::vec3(3.0f * ((i % side) - side / 2),
+                   3.0f * (((i / side) % side) - side / 2),
+                   3.0f * ((i / (side * side)) - side / 2));
+}
+
+// Draws the model 'copies' times per frame, for 'nFrames' frames, and
+// returns the average milliseconds per frame, and in submitTime, the
+// part of that spent issuing the draws.  The grid is looked at from a
+// distance.  An instanced model has its copies in it already, and is
+// drawn once per frame.
+double timeFrames(bsg::drawableCompound* model, const int copies,
+                  const bool instanced, const int nFrames,
+                  double &submitTime) {
+
+  int side = gridSide(copies);
+  glm::mat4 viewMatrix = glm::lookAt(glm::vec3(0.0f, 0.0f, 6.0f * side),
+                                     glm::vec3(0.0f, 0.0f, 0.0f),
+                                     glm::vec3(0.0f, 1.0f, 0.0f));
+  glm::mat4 projMatrix = glm::perspective((float)M_PI / 3.0f, 1.0f,
+                                          0.1f, 100.0f * side);
+
+  double start = 0.0;
+  submitTime = 0.0;
+  for (int frame = 0; frame < warmupFrames + nFrames; frame++) {
+
+    if (frame == warmupFrames) {
+      glFinish();
+      start = now();
+    }
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    bsg::bsgStats::newFrame();
+
+    double submitStart = now();
+    if (instanced) {
+      model->load();
+      model->draw(viewMatrix, projMatrix);
+    } else {
+      for (int i = 0; i < copies; i++) {
+        model->setPosition(gridPosition(i, side));
+        model->load();
+        model->draw(viewMatrix, projMatrix);
+      }
+    }
+    if (frame >= warmupFrames) submitTime += now() - submitStart;
+
+    glutSwapBuffers();
+    glutMainLoopEvent();
+  }
+  glFinish();
+
+  submitTime /= nFrames;
+  return (now() - start) / nFrames;
+}
+
+// Makes a window and checks that we have what we need.  See the demos
+// for a more talkative version of this.
+void makeWindow(int argc, char** argv) {
+
+  glutInit(&argc, argv);
+  glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
+  glutInitWindowSize(512, 512);
+  glutCreateWindow("drawBench");
+
+  glewExperimental = true;
+  if (glewInit() != GLEW_OK) {
+    throw std::runtime_error("Failed to initialize GLEW");
+  }
+
+  std::cout << "Hardware: " << glGetString(GL_RENDERER)
+            << " / " << glGetString(GL_VERSION) << std::endl;
+
+  glClearColor(0.1, 0.0, 0.4, 1.0);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_CULL_FACE);
+}
+
+// Builds the model with the given layout, with or without vertex
+// array objects, and times it.
+void timeLayout(bsg::bsgPtr<bsg::shaderMgr> shader,
+                const std::string &modelFile,
+                const bsg::GLLAYOUTTYPE layout, const bool vertexArrays,
+                const int copies, const int nFrames) {
+
+  bsg::drawableObj::setUseVertexArrays(vertexArrays);
+  bsg::drawableObjModel model(shader, modelFile);
+  model.setLayout(layout);
+  model.prepare();
+
+  double submitTime;
+  double frameTime = timeFrames(&model, copies, false, nFrames, submitTime);
+  std::cout << "  " << std::left << std::setw(12)
+            << ((layout == bsg::GLLAYOUT_SEPARATE) ? "separate" : "interleaved")
+            << std::setw(10) << (vertexArrays ? "VAO" : "no VAO") << std::right
+            << frameTime << " ms/frame, " << submitTime << " ms submitting"
+            << std::endl;
+}
+
+// Times the copies as one drawableInstances.
+void timeInstances(bsg::bsgPtr<bsg::drawableInstances> instances,
+                   const int copies, const int nFrames) {
+
+  instances->prepare();
+
+  double submitTime;
+  double frameTime = timeFrames(&(*instances), copies, true, nFrames, submitTime);
+  const char* names[] = { "instanced arrays", "uniform batches", "one at a time" };
+  std::cout << "  " << std::left << std::setw(22) << names[instances->getMode()]
+            << std::right << frameTime << " ms/frame, " << submitTime
+            << " ms submitting" << std::endl;
+}
+
+int main(int argc, char **argv) {
+
+  std::string modelFile = "../data/LEGO_Man.obj";
+  int copies = 1000;
+  int nFrames = 100;
+  if (argc > 1) modelFile = std::string(argv[1]);
+  if (argc > 2) copies = atoi(argv[2]);
+  if (argc > 3) nFrames = atoi(argv[3]);
+
+  makeWindow(argc, argv);
+
+  bsg::bsgPtr<bsg::lightList> lights = new bsg::lightList();
+  lights->addLight(glm::vec4(0.0f, 0.0f, 3.0f, 1.0f),
+                   glm::vec4(1.0f, 1.0f, 1.0f, 0.0f));
+
+  bsg::bsgPtr<bsg::shaderMgr> shader = new bsg::shaderMgr();
+  shader->addLights(lights);
+  shader->addShader(bsg::GLSHADER_VERTEX, "../src/textureShader.vp");
+  shader->addShader(bsg::GLSHADER_FRAGMENT, "../src/textureShader.fp");
+
+  // The instanced copies, in each mode the card can do.  They share a
+  // shader; each compiles its own variant of it when prepared.
+  bsg::bsgPtr<bsg::shaderMgr> instanceShader = new bsg::shaderMgr();
+  instanceShader->addLights(lights);
+  instanceShader->addShader(bsg::GLSHADER_VERTEX, "../src/instanceShader.vp");
+  instanceShader->addShader(bsg::GLSHADER_FRAGMENT, "../src/textureShader.fp");
+
+  std::vector<bsg::bsgPtr<bsg::drawableInstances> > instances;
+  int side = gridSide(copies);
+  for (int mode = bsg::drawableInstances::getBestMode();
+       mode <= bsg::GLINSTANCE_SINGLE; mode++) {
+    bsg::drawableObjModel mesh(instanceShader, modelFile);
+    bsg::bsgPtr<bsg::drawableInstances> copy =
+      new bsg::drawableInstances(instanceShader, (bsg::GLINSTANCETYPE)mode);
+    copy->addObjects(mesh);
+    for (int i = 0; i < copies; i++) copy->addInstance(gridPosition(i, side));
+    instances.push_back(copy);
+  }
+
+  bsg::shaderMgr::compileAll();
+  bsg::shaderMgr::printCompileStats(std::cout);
+
+  bsg::bsgPtr<bsg::textureMgr> texture = new bsg::textureMgr();
+  texture->readFile(bsg::textureCHK, "");
+  shader->addTexture(texture);
+  instanceShader->addTexture(texture);
+
+  std::cout << "Drawing " << modelFile << " " << copies << " times per frame, "
+            << nFrames << " frames." << std::endl;
+
+  if (!GLEW_ARB_vertex_array_object)
+    std::cout << "  (no vertex array objects here; those runs are the same)" << std::endl;
+  timeLayout(shader, modelFile, bsg::GLLAYOUT_SEPARATE, false, copies, nFrames);
+  timeLayout(shader, modelFile, bsg::GLLAYOUT_SEPARATE, true, copies, nFrames);
+  timeLayout(shader, modelFile, bsg::GLLAYOUT_INTERLEAVED, false, copies, nFrames);
+  timeLayout(shader, modelFile, bsg::GLLAYOUT_INTERLEAVED, true, copies, nFrames);
+
+  for (std::vector<bsg::bsgPtr<bsg::drawableInstances> >::iterator it = instances.begin();
+       it != instances.end(); it++) {
+    timeInstances(*it, copies, nFrames);
+  }
+
+  return 0;
+}
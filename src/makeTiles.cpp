@@ -0,0 +1,41 @@
+#include "bsgVirtualTexture.h"
+
+// Cuts a PNG file into the tiles of a bsg::virtualTexture.  The image
+// is read a row at a time, so it can be far bigger than memory.
+//
+// Usage: bin/makeTiles [-tile size] [-border pixels] in.png out.bsgtiles
+//
+// The tiles are 128 pixels square by default, with a border of one
+// pixel, which is all that linear filtering needs.  Bigger tiles make
+// for a smaller page table and fewer, bigger uploads.
+
+int main(int argc, char **argv) {
+
+  GLsizei tileSize = 128;
+  GLsizei border = 1;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if ((arg == "-tile") && (i + 1 < argc)) {
+      tileSize = atoi(argv[++i]);
+    } else if ((arg == "-border") && (i + 1 < argc)) {
+      border = atoi(argv[++i]);
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  if (files.size() != 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-tile size] [-border pixels] in.png out.bsgtiles" << std::endl;
+    return 1;
+  }
+
+  if (!bsg::virtualTexture::makeTiles(files[0], files[1], tileSize, border))
+    return 1;
+
+  std::cout << files[1] << ": " << tileSize << " pixel tiles, with "
+            << border << " pixel border" << std::endl;
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include "bsg.h"
+#include "bsgObjModel.h"
+#include <sys/stat.h>
+#include <sstream>
+#include <thread>
+
+// A benchmark for the OBJ reader.  It reads the same file several
+// times and reports the throughput, first for the parser alone, with
+// one thread and then with more, up to the number of cores.  Then it
+// times building the indexed mesh that drawableObjModel draws, both
+// from the text and from the binary cache.  None of this touches
+// OpenGL, so it needs no window.  It leaves a cache file beside the
+// model.
+//
+// Usage: bin/objBench [model.obj] [repetitions]
+
+// Wall clock time in milliseconds.
+double now() {
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec * 1000.0 + tp.tv_usec / 1000.0;
+}
+
+void report(const std::string &label, const double ms,
+            const double megabytes, const size_t nFaces) {
+  std::cout << label << ms << " ms, "
+            << megabytes / (ms / 1000.0) << " MB/s, "
+            << nFaces / (ms / 1000.0) << " faces/s" << std::endl;
+}
+
+int main(int argc, char **argv) {
+
+  std::string modelFile = "../data/LEGO_Man.obj";
+  int repetitions = 5;
+  if (argc > 1) modelFile = std::string(argv[1]);
+  if (argc > 2) repetitions = atoi(argv[2]);
+
+  struct stat fileStat;
+  if (stat(modelFile.c_str(), &fileStat) < 0) {
+    std::cerr << "** Cannot find " << modelFile << std::endl;
+    return 1;
+  }
+  double megabytes = fileStat.st_size / (1024.0 * 1024.0);
+
+  // Once untimed, to warm the file cache and count the contents.
+  bsg::objFileData contents;
+  contents.readFile(modelFile);
+
+  std::cout << modelFile << ": " << megabytes << " MB, "
+            << contents.positions.size() / 3 << " positions, "
+            << contents.normals.size() / 3 << " normals, "
+            << contents.uvs.size() / 2 << " uvs, "
+            << contents.nFaces << " faces, "
+            << contents.corners.size() / 9 << " triangles" << std::endl;
+
+  // The parser alone, with more and more threads.  Each result is
+  // checked against the single-threaded one.
+  bsg::objFileData serial;
+  serial.readFile(modelFile, 1);
+
+  // Powers of two, then the core count itself.
+  unsigned int nCores = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << "  " << nCores << " cores" << std::endl;
+
+  std::vector<unsigned int> threadCounts;
+  for (unsigned int n = 1; n < nCores; n *= 2) threadCounts.push_back(n);
+  threadCounts.push_back(nCores);
+
+  double serialTime = 0.0;
+  for (std::vector<unsigned int>::iterator it = threadCounts.begin();
+       it != threadCounts.end(); it++) {
+
+    unsigned int nThreads = *it;
+
+    double start = now();
+    for (int i = 0; i < repetitions; i++) {
+      bsg::objFileData data;
+      data.readFile(modelFile, nThreads);
+      if (i > 0) continue;
+      if ((data.positions != serial.positions) ||
+          (data.normals != serial.normals) ||
+          (data.uvs != serial.uvs) ||
+          (data.corners != serial.corners)) {
+        std::cerr << "** Caution: " << nThreads
+                  << " threads do not match the serial parse." << std::endl;
+      }
+    }
+    double ms = (now() - start) / repetitions;
+    if (nThreads == 1) serialTime = ms;
+
+    std::stringstream label;
+    label << "  parse, " << nThreads << " thread" << (nThreads > 1 ? "s" : "")
+          << " (x" << serialTime / ms << "): ";
+    report(label.str(), ms, megabytes, contents.nFaces);
+  }
+
+  // Building the mesh from the text, and reading it from the cache.
+  double start = now();
+  for (int i = 0; i < repetitions; i++) {
+    bsg::objFileData data;
+    data.readFile(modelFile);
+    bsg::objMesh mesh;
+    mesh.build(data);
+  }
+  report("  mesh from text:  ", (now() - start) / repetitions, megabytes,
+         contents.nFaces);
+
+  // The same, making smooth normals for any faces without them.
+  bsg::objLoadOptions smooth;
+  smooth.normals = bsg::OBJNORMALS_SMOOTH;
+  start = now();
+  for (int i = 0; i < repetitions; i++) {
+    bsg::objFileData data;
+    data.readFile(modelFile);
+    bsg::objMesh mesh;
+    mesh.build(data, smooth);
+  }
+  report("  smooth normals:  ", (now() - start) / repetitions, megabytes,
+         contents.nFaces);
+
+  std::string cacheName = modelFile + ".bsgcache";
+  bsg::objMesh mesh;
+  mesh.build(contents);
+  if (!mesh.writeCache(cacheName, modelFile)) {
+    std::cerr << "** Cannot write " << cacheName << std::endl;
+    return 1;
+  }
+
+  start = now();
+  for (int i = 0; i < repetitions; i++) {
+    bsg::objMesh cached;
+    if (!cached.readCache(cacheName, modelFile)) {
+      std::cerr << "** Caution: the cache was not used." << std::endl;
+    }
+  }
+  report("  mesh from cache: ", (now() - start) / repetitions, megabytes,
+         contents.nFaces);
+
+  return 0;
+}
@@ -0,0 +1,280 @@
+#include "bsg.h"
+
+// Converts a PNG file to a block-compressed DDS file, with mipmaps,
+// for textureMgr::readFile(bsg::textureDDS, ...).  A compressed
+// texture takes a quarter to an eighth of the video memory of the
+// PNG it came from, and loads with no decoding.
+//
+// The encoder is built for speed, not the best quality: each block's
+// end colors are the corners of its bounding box, pulled in a little,
+// and each pixel takes whichever of the block's colors is nearest.
+//
+// Usage: bin/png2dds [-bc1 | -bc3 | -bc5] [-nomips] in.png out.dds
+//
+// BC1 (DXT1) is for opaque images and BC3 (DXT5) for images with
+// alpha; by default, the one that suits the image is chosen.  BC5
+// keeps only the red and green channels, at higher quality, and is
+// meant for normal maps.
+//
+// The blocks are written from the bottom row up, the way OpenGL takes
+// them, rather than from the top down as DDS files usually are, and
+// the file is marked so readDDS() knows not to turn them over.  That
+// way every mipmap level comes out right, even one, like 6 pixels
+// high, whose last row of blocks is only partly used and so can't be
+// turned over.  Other programs will show these files upside down.
+
+typedef enum { BC1, BC3, BC5 } BCTYPE;
+
+// One 4x4 block of pixels, always as RGBA.
+typedef unsigned char block[16][4];
+
+// Copies out the block whose lower left corner is at (x, y), counting
+// y from the bottom of the image, as OpenGL does.  Pixels past the
+// edge are copies of the edge.  The block's first row is its lowest.
+void getBlock(const bsg::textureImage &image, const int x, const int y,
+              block &out) {
+
+  int channels = (image.format == GL_RGBA) ? 4 : 3;
+  for (int j = 0; j < 4; j++) {
+    int row = std::min(y + j, image.height - 1);
+    for (int i = 0; i < 4; i++) {
+      int col = std::min(x + i, image.width - 1);
+      const unsigned char* in = &image.pixels[row * image.rowBytes + col * channels];
+      out[4 * j + i][0] = in[0];
+      out[4 * j + i][1] = in[1];
+      out[4 * j + i][2] = in[2];
+      out[4 * j + i][3] = (channels == 4) ? in[3] : 255;
+    }
+  }
+}
+
+unsigned short to565(const int r, const int g, const int b) {
+  return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+void from565(const unsigned short c, int* rgb) {
+  rgb[0] = ((c >> 11) & 31) * 255 / 31;
+  rgb[1] = ((c >> 5) & 63) * 255 / 63;
+  rgb[2] = (c & 31) * 255 / 31;
+}
+
+// Writes the 8-byte color half of a BC1 or BC3 block.
+void encodeColor(const block &pixels, unsigned char* out) {
+
+  int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+  int mean[3] = { 0, 0, 0 };
+  for (int p = 0; p < 16; p++) {
+    for (int c = 0; c < 3; c++) {
+      lo[c] = std::min(lo[c], (int)pixels[p][c]);
+      hi[c] = std::max(hi[c], (int)pixels[p][c]);
+      mean[c] += pixels[p][c];
+    }
+  }
+
+  // The bounding box has four diagonals.  Pick the one that runs the
+  // way red and blue go along with green.
+  int covRG = 0, covBG = 0;
+  for (int p = 0; p < 16; p++) {
+    int g = 16 * pixels[p][1] - mean[1];
+    covRG += (16 * pixels[p][0] - mean[0]) * g;
+    covBG += (16 * pixels[p][2] - mean[2]) * g;
+  }
+  if (covRG < 0) std::swap(lo[0], hi[0]);
+  if (covBG < 0) std::swap(lo[2], hi[2]);
+
+  // Pull the ends in by 1/16, which fits the colors better.
+  for (int c = 0; c < 3; c++) {
+    int inset = (hi[c] - lo[c]) / 16;
+    lo[c] += inset;
+    hi[c] -= inset;
+  }
+
+  unsigned short c0 = to565(hi[0], hi[1], hi[2]);
+  unsigned short c1 = to565(lo[0], lo[1], lo[2]);
+  // c0 > c1 means four colors and no transparency.
+  if (c0 < c1) std::swap(c0, c1);
+
+  int palette[4][3];
+  from565(c0, palette[0]);
+  from565(c1, palette[1]);
+  for (int c = 0; c < 3; c++) {
+    palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+    palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+  }
+
+  unsigned int indices = 0;
+  if (c0 != c1) {
+    for (int p = 0; p < 16; p++) {
+      int best = 0, bestDist = 1 << 30;
+      for (int k = 0; k < 4; k++) {
+        int dist = 0;
+        for (int c = 0; c < 3; c++) {
+          int d = pixels[p][c] - palette[k][c];
+          dist += d * d;
+        }
+        if (dist < bestDist) {
+          best = k;
+          bestDist = dist;
+        }
+      }
+      indices |= best << (2 * p);
+    }
+  }
+
+  out[0] = c0 & 0xff;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 0xff;
+  out[3] = c1 >> 8;
+  for (int i = 0; i < 4; i++) out[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// Writes an 8-byte block of one channel, as in the alpha half of BC3,
+// or either half of BC5.
+void encodeChannel(const block &pixels, const int channel, unsigned char* out) {
+
+  int lo = 255, hi = 0;
+  for (int p = 0; p < 16; p++) {
+    lo = std::min(lo, (int)pixels[p][channel]);
+    hi = std::max(hi, (int)pixels[p][channel]);
+  }
+
+  // With the first end above the second, there are eight values,
+  // evenly spaced: index 0 is hi, 1 is lo, and 2 through 7 step down
+  // from hi to lo.
+  uint64_t indices = 0;
+  if (hi > lo) {
+    for (int p = 0; p < 16; p++) {
+      int t = ((pixels[p][channel] - lo) * 14 + (hi - lo)) / (2 * (hi - lo));
+      uint64_t index = (t == 7) ? 0 : (t == 0) ? 1 : 8 - t;
+      indices |= index << (3 * p);
+    }
+  }
+
+  out[0] = hi;
+  out[1] = lo;
+  for (int i = 0; i < 6; i++) out[2 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// Encodes a whole image, block row by block row, from the bottom.
+void encode(const bsg::textureImage &image, const BCTYPE type,
+            std::vector<unsigned char> &out) {
+
+  size_t blockBytes = (type == BC1) ? 8 : 16;
+  out.resize(blockBytes * ((image.width + 3) / 4) * ((image.height + 3) / 4));
+
+  unsigned char* next = &out[0];
+  block pixels;
+  for (int y = 0; y < image.height; y += 4) {
+    for (int x = 0; x < image.width; x += 4) {
+      getBlock(image, x, y, pixels);
+      switch (type) {
+      case BC1:
+        encodeColor(pixels, next);
+        break;
+      case BC3:
+        encodeChannel(pixels, 3, next);
+        encodeColor(pixels, next + 8);
+        break;
+      case BC5:
+        encodeChannel(pixels, 0, next);
+        encodeChannel(pixels, 1, next + 8);
+        break;
+      }
+      next += blockBytes;
+    }
+  }
+}
+
+bool hasAlpha(const bsg::textureImage &image) {
+  if (image.format != GL_RGBA) return false;
+  for (int y = 0; y < image.height; y++) {
+    for (int x = 0; x < image.width; x++) {
+      if (image.pixels[y * image.rowBytes + 4 * x + 3] != 255) return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+
+  BCTYPE type = BC1;
+  bool chooseType = true;
+  bool mipmaps = true;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == "-bc1") {
+      type = BC1;
+      chooseType = false;
+    } else if (arg == "-bc3") {
+      type = BC3;
+      chooseType = false;
+    } else if (arg == "-bc5") {
+      type = BC5;
+      chooseType = false;
+    } else if (arg == "-nomips") {
+      mipmaps = false;
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  if (files.size() != 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-bc1 | -bc3 | -bc5] [-nomips] in.png out.dds" << std::endl;
+    return 1;
+  }
+
+  std::vector<bsg::textureImage> levels(1);
+  if (!levels[0].readPNG(files[0])) return 1;
+  if (mipmaps) bsg::textureImage::addMipmaps(levels);
+  if (chooseType) type = hasAlpha(levels[0]) ? BC3 : BC1;
+
+  // The DDS header, as 32 little-endian words, counting the magic
+  // number.  See the DDS_HEADER documentation.
+  uint32_t header[32];
+  memset(header, 0, sizeof(header));
+  header[0] = 0x20534444;                      // "DDS "
+  header[1] = 124;                             // size
+  header[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | 0x20000;
+  header[3] = levels[0].height;
+  header[4] = levels[0].width;
+  header[5] = ((type == BC1) ? 8 : 16) *       // linear size of level 0
+    ((levels[0].width + 3) / 4) * ((levels[0].height + 3) / 4);
+  header[7] = levels.size();                   // mipmap count
+  memcpy(&header[8], "BSGU", 4);               // rows run bottom up
+  header[19] = 32;                             // pixel format size
+  header[20] = 0x4;                            // has a four-character code
+  const char* code = (type == BC1) ? "DXT1" : (type == BC3) ? "DXT5" : "ATI2";
+  memcpy(&header[21], code, 4);
+  header[27] = 0x1000 | ((levels.size() > 1) ? (0x8 | 0x400000) : 0);
+
+  FILE* fp = fopen(files[1].c_str(), "wb");
+  if (!fp) {
+    perror(files[1].c_str());
+    return 1;
+  }
+  fwrite(header, 4, 32, fp);
+
+  size_t inBytes = 0, outBytes = 0;
+  std::vector<unsigned char> blocks;
+  for (std::vector<bsg::textureImage>::iterator it = levels.begin();
+       it != levels.end(); it++) {
+    encode(*it, type, blocks);
+    fwrite(&blocks[0], 1, blocks.size(), fp);
+    inBytes += it->getBytes();
+    outBytes += blocks.size();
+  }
+
+  if (fclose(fp) != 0) {
+    perror(files[1].c_str());
+    return 1;
+  }
+
+  std::cout << files[1] << ": " << levels[0].width << "x" << levels[0].height
+            << ", " << levels.size() << " level" << (levels.size() > 1 ? "s" : "")
+            << ", " << code << ", " << outBytes << " bytes ("
+            << (float)inBytes / outBytes << "x smaller)" << std::endl;
+  return 0;
+}
@@ -294,9 +294,6 @@ int main(int argc, char **argv) {
   std::string fragmentFile = std::string("../src/textureShader.fp");
   shader->addShader(bsg::GLSHADER_FRAGMENT, fragmentFile);
 
-  // The shaders are loaded, now compile them.
-  shader->compileShaders();
-
   // Add a texture to our shader manager object.
   bsg::bsgPtr<bsg::textureMgr> texture = new bsg::textureMgr();
   texture->readFile(bsg::texturePNG, "../data/gladiolas-sq.png");
@@ -306,7 +303,11 @@ int main(int argc, char **argv) {
   bsg::bsgPtr<bsg::shaderMgr> axesShader = new bsg::shaderMgr();
   axesShader->addShader(bsg::GLSHADER_VERTEX, "../src/shader2.vp");
   axesShader->addShader(bsg::GLSHADER_FRAGMENT, "../src/shader.fp");
-  axesShader->compileShaders();
+
+  // The shaders are loaded, now compile them, all at once, so the
+  // driver can work on them together.
+  bsg::shaderMgr::compileAll();
+  bsg::shaderMgr::printCompileStats(std::cout);
   
   // Here are the drawable objects that make up the compound object
   // that make up the scene.
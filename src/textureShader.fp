@@ -1,7 +1,7 @@
 #version 120
 
-// The number of lights is filled in before the shader is compiled.
-const int NUM_LIGHTS = XX;
+// BSG_NUM_LIGHTS is defined by the shader compile code.
+const int NUM_LIGHTS = BSG_NUM_LIGHTS;
 const float MAX_DIST = 50.0;
 const float MAX_DIST_SQUARED = MAX_DIST * MAX_DIST;
 
@@ -29,6 +29,12 @@ void main() {
 
   vec4 color = 0.05 * colorFrag;
   //vec4 color = vec4(0,0,0,0);
+
+  // If we are looking at the back of a triangle (only possible when
+  // face culling is off, as for two-sided objects), the normal points
+  // away from us, so turn it around.
+  vec4 normal = normalCS;
+  if (!gl_FrontFacing) normal = -normalCS;
   
   // The lighting effects are additive, so we run through the lights,
   // and add their effects.
@@ -45,13 +51,13 @@ void main() {
     //  - light is at the vertical of the triangle -> 1
     //  - light is perpendicular to the triangle -> 0
     //  - light is behind the triangle -> 0
-    float cosAngleFromNormal = max(0.0, dot(normalCS, lightDirectionCS[i]));
+    float cosAngleFromNormal = max(0.0, dot(normal, lightDirectionCS[i]));
 
     // Diffuse : "color" of the object
     vec4 diffuse = materialColor * lightColor[i] * cosAngleFromNormal;
     
     // Direction in which the triangle reflects the light
-    vec4 reflectDir = reflect(-lightDirectionCS[i], normalCS);
+    vec4 reflectDir = reflect(-lightDirectionCS[i], normal);
 
     // Cosine of the angle between the Eye vector and the Reflect vector,
     // clamped to remain above 0.
@@ -0,0 +1,119 @@
+#include "bsg.h"
+#include "bsgTransformStore.h"
+
+// A benchmark for transformStore.  It builds a big random hierarchy,
+// a thousand roots with everything else hung under some earlier node,
+// gives every node a random position, orientation and scale, and then
+// times updating all the world matrices, with update() and with
+// updateScalar(), and reports how many matrices per second each
+// manages.  The two answers are compared, and a few nodes are checked
+// against multiplying out their chain of parents with glm.
+//
+// Nothing is drawn, so this needs no window.
+//
+// Usage: bin/transformBench [nodes] [passes]
+
+// Wall clock time in milliseconds.
+double now() {
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec * 1000.0 + tp.tv_usec / 1000.0;
+}
+
+float randomFloat(const float lo, const float hi) {
+  return lo + (hi - lo) * (float)rand() / RAND_MAX;
+}
+
+// The largest difference between two lists of matrices.
+float maxDifference(const std::vector<glm::mat4> &a,
+                    const std::vector<glm::mat4> &b) {
+  float diff = 0.0f;
+  for (size_t i = 0; i < a.size(); i++) {
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 4; r++) {
+        diff = std::max(diff, fabsf(a[i][c][r] - b[i][c][r]));
+      }
+    }
+  }
+  return diff;
+}
+
+// Times 'passes' updates, and returns matrices per second.
+double timeUpdates(bsg::transformStore &store, const bool simd, const int passes) {
+
+  double start = now();
+  for (int i = 0; i < passes; i++) {
+    if (simd) {
+      store.update();
+    } else {
+      store.updateScalar();
+    }
+  }
+  double elapsed = now() - start;
+  return 1000.0 * store.size() * passes / elapsed;
+}
+
+int main(int argc, char **argv) {
+
+  int nodes = 1000000;
+  int passes = 20;
+  if (argc > 1) nodes = std::max(1, atoi(argv[1]));
+  if (argc > 2) passes = std::max(1, atoi(argv[2]));
+
+  srand(1);
+
+  bsg::transformStore store;
+  store.reserve(nodes);
+  std::vector<int> parents(nodes);
+  std::vector<glm::mat4> locals(nodes);
+  for (int i = 0; i < nodes; i++) {
+    parents[i] = (i < 1000) ? -1 : rand() % i;
+    glm::vec3 position(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f),
+                       randomFloat(-1.0f, 1.0f));
+    glm::quat orientation =
+      glm::angleAxis(randomFloat(0.0f, 2.0f * (float)M_PI),
+                     glm::normalize(glm::vec3(randomFloat(-1.0f, 1.0f),
+                                              randomFloat(-1.0f, 1.0f),
+                                              randomFloat(0.1f, 1.0f))));
+    glm::vec3 scale(randomFloat(0.9f, 1.1f), randomFloat(0.9f, 1.1f),
+                    randomFloat(0.9f, 1.1f));
+    store.add(parents[i], position, orientation, scale);
+    locals[i] = glm::translate(glm::mat4(1.0f), position) *
+      glm::mat4_cast(orientation) * glm::scale(glm::mat4(1.0f), scale);
+  }
+
+  // The first update sorts the nodes, so leave it out of the timing.
+  double start = now();
+  store.update();
+  std::cout << nodes << " nodes, first update (with sorting): "
+            << now() - start << " ms" << std::endl;
+
+  double scalarRate = timeUpdates(store, false, passes);
+  std::vector<glm::mat4> scalarMatrices;
+  store.getWorldMatrices(scalarMatrices);
+
+  double simdRate = timeUpdates(store, true, passes);
+  std::vector<glm::mat4> simdMatrices;
+  store.getWorldMatrices(simdMatrices);
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "updateScalar(): " << scalarRate / 1.0e6 << "M matrices/s" << std::endl
+            << "update():       " << simdRate / 1.0e6 << "M matrices/s ("
+            << std::setprecision(2) << simdRate / scalarRate << "x)" << std::endl;
+
+  std::cout << std::scientific << std::setprecision(2)
+            << "Largest difference between the two: "
+            << maxDifference(scalarMatrices, simdMatrices) << std::endl;
+
+  // Check some nodes the slow way.
+  float diff = 0.0f;
+  for (int i = 0; i < nodes; i += std::max(1, nodes / 1000)) {
+    glm::mat4 world = locals[i];
+    for (int p = parents[i]; p >= 0; p = parents[p]) world = locals[p] * world;
+    std::vector<glm::mat4> one(1, world), other(1, simdMatrices[i]);
+    diff = std::max(diff, maxDifference(one, other));
+  }
+  std::cout << "Largest difference from glm: " << diff << std::endl;
+
+  return 0;
+}
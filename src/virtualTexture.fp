@@ -0,0 +1,145 @@
+#version 120
+
+// A copy of textureShader.fp that reads its color from a
+// bsg::virtualTexture.  Use it with textureShader.vp.
+
+// BSG_NUM_LIGHTS is defined by the shader compile code.
+const int NUM_LIGHTS = BSG_NUM_LIGHTS;
+const float MAX_DIST = 50.0;
+const float MAX_DIST_SQUARED = MAX_DIST * MAX_DIST;
+
+// Interpolated values from the vertex shaders
+varying vec4 colorFrag;
+varying vec2 uvFrag;
+varying vec4 positionWS;
+varying vec4 eyeDirectionCS;
+varying vec4 lightDirectionCS[NUM_LIGHTS];
+varying vec4 normalCS;
+varying vec4 lightPositionCS;
+
+// Values that stay constant for the whole mesh.
+uniform vec4 lightPositionWS[NUM_LIGHTS];
+uniform vec4 lightColor[NUM_LIGHTS];
+
+// The virtual texture, set up by bsg::virtualTexture.  The cache holds
+// the tiles that are in memory, and the page table says, for each tile
+// of each level, which cache slot holds it or its nearest ancestor,
+// as (slot column, slot row, level of that tile) in the red, green,
+// and blue channels.
+uniform sampler2D vtCache;
+uniform sampler2D vtPageTable;
+uniform vec2 vtTableSize;
+// The tile size, its border, the tile size with both borders, and the
+// size of the cache texture, all in pixels.
+uniform vec4 vtParams;
+// For each level, where its tiles start in the page table, and its
+// width and height in pixels.
+uniform vec4 vtLevels[15];
+uniform float vtMaxLevel;
+// In the feedback pass, we write the tile we want instead of a color,
+// with a bias for the smaller viewport.
+uniform float vtFeedback;
+uniform float vtLodBias;
+
+// The position of a texel at some level, kept inside the level, so it
+// always lands on one of its tiles.
+vec2 vtTexel(vec2 texel, float level) {
+  vec4 info = vtLevels[int(level)];
+  return clamp(texel / exp2(level), vec2(0.5), info.zw - 0.5);
+}
+
+// Writes out a tile number: the low bits of its column and row in red
+// and green, and in blue, their high bits and the level.  A pixel
+// cleared to white asks for nothing, since there's no level 15.
+vec4 vtEncodeTile(vec2 tile, float level) {
+  vec2 high = floor(tile / 256.0);
+  vec2 low = tile - 256.0 * high;
+  return vec4(low, high.x + 4.0 * high.y + 16.0 * level, 255.0) / 255.0;
+}
+
+vec4 vtSample(vec2 uv) {
+
+  // Texture coordinates run up from the bottom, but tiles are counted
+  // from the top.
+  vec2 texel = vec2(uv.x, 1.0 - uv.y) * vtLevels[0].zw;
+
+  // The level whose texels come closest to one per pixel.
+  vec2 dx = dFdx(texel);
+  vec2 dy = dFdy(texel);
+  float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vtLodBias;
+  float level = clamp(floor(lod + 0.5), 0.0, vtMaxLevel);
+
+  vec2 tile = floor(vtTexel(texel, level) / vtParams.x);
+  if (vtFeedback > 0.5) return vtEncodeTile(tile, level);
+
+  // What's actually in memory may be an ancestor.
+  vec4 entry = texture2D(vtPageTable,
+                         (vtLevels[int(level)].xy + tile + 0.5) / vtTableSize);
+  vec2 slot = floor(entry.rg * 255.0 + 0.5);
+  float resident = floor(entry.b * 255.0 + 0.5);
+
+  vec2 texelR = vtTexel(texel, resident);
+  vec2 tileR = floor(texelR / vtParams.x);
+  vec2 inTile = clamp(texelR - tileR * vtParams.x, 0.0, vtParams.x);
+  return texture2D(vtCache,
+                   (slot * vtParams.z + vtParams.y + inTile) / vtParams.w);
+}
+
+void main() {
+
+  vec4 materialColor = vtSample(uvFrag);
+  if (vtFeedback > 0.5) {
+    gl_FragColor = materialColor;
+    return;
+  }
+
+  float ambientCoefficient = 0.3;
+  vec4 materialSpecularColor = 0.5 * vec4(1.0, 1.0, 1.0, 0.0);
+
+  vec4 color = 0.05 * colorFrag;
+
+  // If we are looking at the back of a triangle (only possible when
+  // face culling is off, as for two-sided objects), the normal points
+  // away from us, so turn it around.
+  vec4 normal = normalCS;
+  if (!gl_FrontFacing) normal = -normalCS;
+  
+  // The lighting effects are additive, so we run through the lights,
+  // and add their effects.
+  for (int i = 0; i < NUM_LIGHTS; i++) {
+
+    // Ambient : simulates indirect lighting
+    vec4 ambient = ambientCoefficient * lightColor[i] * materialColor;
+    
+    // Distance to the light
+    float distanceToLight = length(lightPositionWS[i] - positionWS);
+
+    // Cosine of the angle between the normal and the light direction, 
+    // clamped to remain above 0.
+    //  - light is at the vertical of the triangle -> 1
+    //  - light is perpendicular to the triangle -> 0
+    //  - light is behind the triangle -> 0
+    float cosAngleFromNormal = max(0.0, dot(normal, lightDirectionCS[i]));
+
+    // Diffuse : "color" of the object
+    vec4 diffuse = materialColor * lightColor[i] * cosAngleFromNormal;
+    
+    // Direction in which the triangle reflects the light
+    vec4 reflectDir = reflect(-lightDirectionCS[i], normal);
+
+    // Cosine of the angle between the Eye vector and the Reflect vector,
+    // clamped to remain above 0.
+    float cosAlpha = clamp(dot(eyeDirectionCS, reflectDir), 0.0, 1.0);
+
+    // Specular : reflective highlight, like a mirror. Adjust the
+    // exponent to adjust the size of the highlight.
+    vec4 specular = materialSpecularColor * lightColor[i] * pow(cosAlpha, 5);
+    
+    float attenuation = 1.0 / (1.0 + 0.01 * pow(distanceToLight, 2));
+    
+    color += ambient + attenuation * (diffuse + 0.0 * specular);
+  }
+  
+  gl_FragColor = color;
+
+}